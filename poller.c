@@ -0,0 +1,267 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Rick Parrish <unitrunker@unitrunker.net>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Pollers.
+ *
+ * Three builds of one interface. kqueue and epoll keep the watch list in
+ * the kernel, so a wakeup costs the same for ten queues as for a thousand;
+ * the poll(2) fallback hands the whole list over on every wait.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#elif defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "poller.h"
+
+#if !defined(__linux__)
+static struct timespec
+poller_interval(long long ns)
+{
+	struct timespec interval = {
+		.tv_sec = ns / 1000000000LL,
+		.tv_nsec = ns % 1000000000LL
+	};
+
+	return (interval);
+}
+#endif
+
+#if defined(__FreeBSD__)
+
+const char poller_kind[] = "kqueue";
+
+struct poller {
+	int kq;
+	struct kevent *events;
+	long capacity;
+};
+
+struct poller *
+poller_create(long capacity)
+{
+	struct poller *poller = calloc(1, sizeof(*poller));
+
+	if (poller == NULL)
+		return (NULL);
+	poller->capacity = capacity > 0 ? capacity : 1;
+	poller->events = calloc(poller->capacity, sizeof(*poller->events));
+	poller->kq = kqueue();
+	if (poller->events == NULL || poller->kq < 0) {
+		int what = poller->events == NULL ? ENOMEM : errno;
+
+		if (poller->kq >= 0)
+			close(poller->kq);
+		free(poller->events);
+		free(poller);
+		errno = what;
+		return (NULL);
+	}
+	return (poller);
+}
+
+void
+poller_destroy(struct poller *poller)
+{
+	close(poller->kq);
+	free(poller->events);
+	free(poller);
+}
+
+int
+poller_add(struct poller *poller, int fd, long cookie)
+{
+	struct kevent change;
+
+	EV_SET(&change, fd, EVFILT_READ, EV_ADD, 0, 0,
+	    (void *)(intptr_t)cookie);
+	return (kevent(poller->kq, &change, 1, NULL, 0, NULL) < 0 ? -1 : 0);
+}
+
+int
+poller_wait(struct poller *poller, long *ready, int max, long long ns)
+{
+	struct timespec interval = poller_interval(ns);
+
+	if (max > poller->capacity)
+		max = poller->capacity;
+
+	int count = kevent(poller->kq, NULL, 0, poller->events, max,
+	    &interval);
+
+	for (int i = 0; i < count; i++)
+		ready[i] = (long)(intptr_t)poller->events[i].udata;
+	return (count);
+}
+
+#elif defined(__linux__)
+
+const char poller_kind[] = "epoll";
+
+struct poller {
+	int epfd;
+	struct epoll_event *events;
+	long capacity;
+};
+
+struct poller *
+poller_create(long capacity)
+{
+	struct poller *poller = calloc(1, sizeof(*poller));
+
+	if (poller == NULL)
+		return (NULL);
+	poller->capacity = capacity > 0 ? capacity : 1;
+	poller->events = calloc(poller->capacity, sizeof(*poller->events));
+	poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (poller->events == NULL || poller->epfd < 0) {
+		int what = poller->events == NULL ? ENOMEM : errno;
+
+		if (poller->epfd >= 0)
+			close(poller->epfd);
+		free(poller->events);
+		free(poller);
+		errno = what;
+		return (NULL);
+	}
+	return (poller);
+}
+
+void
+poller_destroy(struct poller *poller)
+{
+	close(poller->epfd);
+	free(poller->events);
+	free(poller);
+}
+
+int
+poller_add(struct poller *poller, int fd, long cookie)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.u64 = (uint64_t)cookie
+	};
+
+	return (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, fd, &event));
+}
+
+int
+poller_wait(struct poller *poller, long *ready, int max, long long ns)
+{
+	/* epoll_wait counts milliseconds; round up rather than spin. */
+	long long ms = (ns + 999999) / 1000000;
+
+	if (max > poller->capacity)
+		max = poller->capacity;
+
+	int count = epoll_wait(poller->epfd, poller->events, max,
+	    ms > INT32_MAX ? INT32_MAX : (int)ms);
+
+	for (int i = 0; i < count; i++)
+		ready[i] = (long)poller->events[i].data.u64;
+	return (count);
+}
+
+#else /* poll(2) */
+
+const char poller_kind[] = "poll";
+
+struct poller {
+	struct pollfd *fds;
+	long *cookies;
+	long count;
+	long capacity;
+};
+
+struct poller *
+poller_create(long capacity)
+{
+	struct poller *poller = calloc(1, sizeof(*poller));
+
+	if (poller == NULL)
+		return (NULL);
+	poller->capacity = capacity > 0 ? capacity : 1;
+	poller->fds = calloc(poller->capacity, sizeof(*poller->fds));
+	poller->cookies = calloc(poller->capacity, sizeof(*poller->cookies));
+	if (poller->fds == NULL || poller->cookies == NULL) {
+		free(poller->fds);
+		free(poller->cookies);
+		free(poller);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	return (poller);
+}
+
+void
+poller_destroy(struct poller *poller)
+{
+	free(poller->fds);
+	free(poller->cookies);
+	free(poller);
+}
+
+int
+poller_add(struct poller *poller, int fd, long cookie)
+{
+	if (poller->count == poller->capacity) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	poller->fds[poller->count].fd = fd;
+	poller->fds[poller->count].events = POLLIN;
+	poller->cookies[poller->count++] = cookie;
+	return (0);
+}
+
+int
+poller_wait(struct poller *poller, long *ready, int max, long long ns)
+{
+	struct timespec interval = poller_interval(ns);
+	int count = ppoll(poller->fds, poller->count, &interval, NULL);
+	int found = 0;
+
+	for (long i = 0; i < poller->count && count > 0 && found < max; i++) {
+		if (poller->fds[i].revents != 0)
+			ready[found++] = poller->cookies[i];
+	}
+	return (count < 0 ? -1 : found);
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Rick Parrish <unitrunker@unitrunker.net>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef POLLER_H
+#define POLLER_H
+
+/*
+ * A poller watches many descriptors for readability and reports which are
+ * ready, at a cost per wakeup that does not grow with the number watched
+ * where the platform allows: kqueue(2) on FreeBSD, epoll(7) on Linux and
+ * poll(2) elsewhere. Each descriptor carries a caller chosen cookie, which
+ * is what poller_wait() hands back. Calls that fail return -1 (NULL for
+ * poller_create) with errno set.
+ */
+struct poller;
+
+/* name of the mechanism in use, for messages. */
+extern const char poller_kind[];
+
+/* a poller expecting up to capacity descriptors. */
+struct poller *poller_create(long capacity);
+void poller_destroy(struct poller *poller);
+/* watch fd for readability, level triggered. */
+int poller_add(struct poller *poller, int fd, long cookie);
+
+/*
+ * Wait up to ns nanoseconds for a watched descriptor to turn readable.
+ * Stores up to max cookies in ready and returns how many; zero on timeout.
+ */
+int poller_wait(struct poller *poller, long *ready, int max, long long ns);
+
+#endif /* POLLER_H */
@@ -25,22 +25,38 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <limits.h>
+#include <math.h>
 #include <mqueue.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "poller.h"
+#include "shmq.h"
+#include "transport.h"
+
 struct Creation {
 	/* true if the queue exists. */
 	bool exists;
@@ -62,6 +78,54 @@ struct Creation {
 	bool set_user;
 	/* user ID. */
 	uid_t user;
+	/* true if a --type was specified. */
+	bool set_type;
+	/* true for a single producer, single consumer queue. */
+	bool spsc;
+};
+
+struct Retry {
+	/* immediate retries of a full non-blocking queue before backing off. */
+	long spins;
+	/* first backoff interval in microseconds. doubled on each attempt. */
+	long backoff;
+	/* seconds to keep retrying. zero disables backoff. */
+	double max_wait;
+};
+
+/* one route --rule, in command line order. */
+struct Rule {
+	enum {
+		RULE_PRIORITY,
+		RULE_PREFIX,
+		RULE_BYTE
+	} kind;
+	/* RULE_PRIORITY: inclusive priority range. */
+	long low;
+	long high;
+	/* RULE_BYTE: payload offset and the byte value expected there. */
+	long offset;
+	unsigned char value;
+	/* RULE_PREFIX: leading payload bytes. */
+	char *prefix;
+	size_t prefix_length;
+	/* destination queue name. */
+	char *target;
+};
+
+/* how rehash finds the key of a message. */
+struct KeySpec {
+	enum {
+		KEY_ALL,
+		KEY_BYTES,
+		KEY_FIELD
+	} kind;
+	/* KEY_BYTES: offset and length of the key. */
+	long offset;
+	long length;
+	/* KEY_FIELD: separator and zero based field index. */
+	char separator;
+	long field;
 };
 
 struct element {
@@ -82,9 +146,48 @@ malloc_element(const char *context)
 
 static STAILQ_HEAD(tqh, element)
 	queues = STAILQ_HEAD_INITIALIZER(queues),
+	targets = STAILQ_HEAD_INITIALIZER(targets),
 	contents = STAILQ_HEAD_INITIALIZER(contents);
 /* send defaults to medium priority. */
 static long priority = MQ_PRIO_MAX / 2;
+/* number of queues worked on concurrently. one means sequential. */
+static long jobs = 1;
+/* number of consume worker threads. */
+static long threads = 1;
+/* consume --exec handler command, or NULL to print messages. */
+static const char *exec_command = NULL;
+/* number of long-lived --exec handler processes. */
+static long workers = 1;
+/* consume waits for mq_notify(2) signals instead of polling. */
+static bool notify = false;
+/* true if a -T timeout was given. */
+static bool set_deadline = false;
+/* absolute CLOCK_REALTIME deadline shared by every timed operation. */
+static struct timespec deadline;
+/* directory holding spill journals, or NULL when spilling is disabled. */
+static const char *spill_dir = NULL;
+/* what tee does when a destination backlog is full. */
+static enum {
+	SLOW_BLOCK,
+	SLOW_DROP,
+	SLOW_SPILL
+} slow_policy = SLOW_BLOCK;
+/* messages tee holds for each destination that has no room. */
+static long backlog = 64;
+/* route rules and the queue for messages no rule matches. */
+static struct Rule *rules = NULL;
+static long rule_count = 0;
+static const char *fallback = NULL;
+/* number of shards in each named queue group. zero if not sharded. */
+static long shards = 0;
+static bool set_shards = false;
+/* send --key that picks the shard. */
+static const char *key = NULL;
+/* rehash --key. */
+static struct KeySpec key_spec = {.kind = KEY_ALL};
+static bool set_key_spec = false;
+/* most shards a queue group may have. */
+static const long shards_max = 65536;
 static struct Creation creation = {
 	.exists = false,
 	.set_mode = false,
@@ -95,9 +198,56 @@ static struct Creation creation = {
 	.set_group = false,
 	.group = 0,
 	.set_user = false,
-	.user = 0
+	.user = 0,
+	.set_type = false,
+	.spsc = false
+};
+static struct Retry retry = {
+	.spins = 0,
+	.backoff = 100,
+	.max_wait = 0
 };
 static const mqd_t fail = (mqd_t)-1;
+/* when send moves a payload to shared memory. */
+static enum {
+	LARGE_NEVER,
+	LARGE_AUTO,
+	LARGE_ALWAYS
+} large_mode = LARGE_NEVER;
+/* send splits long messages into fragments. */
+static bool fragment = false;
+/* recv joins fragments back together. */
+static bool reassemble = false;
+/* send packs many records into each message. */
+static bool batch = false;
+/* recv splits batches back into records. */
+static bool unbatch = false;
+/* longest a partial batch waits for more records, in microseconds. */
+static long linger_us = 1000;
+/* record and replay traffic log path. */
+static const char *log_path = NULL;
+/* replay rate as a multiple of the recorded rate. zero is unpaced. */
+static double speed = 1.0;
+/* replay skips this many seconds from the start of the log. */
+static double skip = 0;
+/* schedule timer wheel resolution in microseconds. */
+static long tick_us = 1;
+/* bench pushes this many messages through each queue. */
+static long bench_messages = 100000;
+/* bench keeps one message in flight and reports its latency. */
+static bool bench_latency = false;
+/* wait --until: the queue depths that end the wait. */
+static bool set_until = false;
+static long until_low = 0;
+static long until_high = LONG_MAX;
+/* set by SIGINT or SIGTERM to wind down long running verbs. */
+static volatile sig_atomic_t stopping = 0;
+/* set by SIGINFO to request a progress report. */
+static volatile sig_atomic_t reporting = 0;
+/* write end of a pipe that wakes consume workers, or -1. */
+static int wake_fd = -1;
+/* backoff never sleeps longer than this between two attempts. */
+static const long backoff_cap_ns = 100000000L;
 static const mode_t accepted_mode_bits =
     S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID | S_ISTXT;
 
@@ -136,6 +286,10 @@ sane_queue(const char *queue)
 {
 	int size = 0;
 
+	/* shared memory queues follow the same naming rules. */
+	if (shmq_named(queue))
+		queue += strlen(SHMQ_PREFIX);
+
 	if (queue[size] != '/') {
 		warnx("queue name [%-.*s] must start with '/'.", NAME_MAX, queue);
 		return (false);
@@ -160,23 +314,41 @@ sane_queue(const char *queue)
 /* OPTIONS parsers */
 
 static void
-parse_block(const char *text)
+parse_backlog(const char *text)
+{
+	parse_long(text, &backlog, "--backlog", "depth");
+}
+
+static void
+parse_flag(const char *text, bool *capture, const char *knob)
 {
 	if (strcmp(text, "true") == 0 || strcmp(text, "yes") == 0) {
-		creation.block = true;
+		*capture = true;
 	} else if (strcmp(text, "false") == 0 || strcmp(text, "no") == 0) {
-		creation.block = false;
+		*capture = false;
 	} else {
 		char *cursor = NULL;
 		long value = strtol(text, &cursor, 10);
 		if (cursor > text) {
-			creation.block = value != 0;
+			*capture = value != 0;
 		} else {
-			warnx("bad -b block format [%s] ignored.", text);
+			warnx("bad %s format [%s] ignored.", knob, text);
 		}
 	}
 }
 
+static void
+parse_batch(const char *text)
+{
+	parse_flag(text, &batch, "--batch");
+}
+
+static void
+parse_block(const char *text)
+{
+	parse_flag(text, &creation.block, "-b block");
+}
+
 static void
 parse_content(const char *content)
 {
@@ -186,12 +358,74 @@ parse_content(const char *content)
 	STAILQ_INSERT_TAIL(&contents, n1, links);
 }
 
+/* read a whole file as one message text. */
+static void
+parse_content_file(const char *path)
+{
+	FILE *file = fopen(path, "r");
+
+	if (file == NULL) {
+		warn("--content-file [%s] ignored", path);
+		return;
+	}
+
+	size_t size = 0;
+	size_t capacity = 65536;
+	char *text = malloc(capacity + 1);
+
+	if (text == NULL)
+		err(1, "malloc(content)");
+	for (;;) {
+		size += fread(text + size, 1, capacity - size, file);
+		if (size < capacity)
+			break;
+		capacity *= 2;
+		text = realloc(text, capacity + 1);
+		if (text == NULL)
+			err(1, "realloc(content)");
+	}
+	if (ferror(file)) {
+		warn("--content-file [%s] ignored", path);
+		fclose(file);
+		free(text);
+		return;
+	}
+	fclose(file);
+	text[size] = 0;
+	parse_content(text);
+}
+
+static void
+parse_default(const char *queue)
+{
+	if (sane_queue(queue))
+		fallback = queue;
+}
+
 static void
 parse_depth(const char *text)
 {
 	parse_long(text, &creation.depth, "-d", "depth");
 }
 
+static void
+parse_exec(const char *text)
+{
+	exec_command = text;
+}
+
+static void
+parse_file(const char *text)
+{
+	log_path = text;
+}
+
+static void
+parse_fragment(const char *text)
+{
+	parse_flag(text, &fragment, "--fragment");
+}
+
 static void
 parse_group(const char *text)
 {
@@ -206,6 +440,82 @@ parse_group(const char *text)
 	}
 }
 
+static void
+parse_jobs(const char *text)
+{
+	parse_long(text, &jobs, "-j", "jobs");
+}
+
+static void
+parse_key(const char *text)
+{
+	key = text;
+}
+
+/* text: one of all, bytes:OFFSET:LENGTH or field:SEPARATOR:INDEX. */
+static void
+parse_key_spec(const char *text)
+{
+	char *cursor = NULL;
+	bool valid = false;
+
+	if (strcmp(text, "all") == 0) {
+		key_spec.kind = KEY_ALL;
+		valid = true;
+	} else if (strncmp(text, "bytes:", 6) == 0) {
+		key_spec.kind = KEY_BYTES;
+		key_spec.offset = strtol(text + 6, &cursor, 10);
+		if (cursor > text + 6 && *cursor == ':') {
+			const char *start = cursor + 1;
+
+			key_spec.length = strtol(start, &cursor, 10);
+			valid = cursor > start && *cursor == 0 &&
+			    key_spec.offset >= 0 && key_spec.length > 0;
+		}
+	} else if (strncmp(text, "field:", 6) == 0 && text[6] != 0 &&
+	    text[7] == ':') {
+		key_spec.kind = KEY_FIELD;
+		key_spec.separator = text[6];
+		key_spec.field = strtol(text + 8, &cursor, 10);
+		valid = cursor > text + 8 && *cursor == 0 && key_spec.field >= 0;
+	}
+
+	if (valid)
+		set_key_spec = true;
+	else
+		warnx("bad --key [%s] ignored.", text);
+}
+
+static void
+parse_large(const char *text)
+{
+	if (strcmp(text, "never") == 0)
+		large_mode = LARGE_NEVER;
+	else if (strcmp(text, "auto") == 0)
+		large_mode = LARGE_AUTO;
+	else if (strcmp(text, "always") == 0)
+		large_mode = LARGE_ALWAYS;
+	else
+		warnx("bad --large mode [%s] ignored.", text);
+}
+
+static void
+parse_type(const char *text)
+{
+	if (strcmp(text, "mpmc") == 0 || strcmp(text, "spsc") == 0) {
+		creation.set_type = true;
+		creation.spsc = strcmp(text, "spsc") == 0;
+	} else {
+		warnx("bad --type [%s] ignored.", text);
+	}
+}
+
+static void
+parse_linger(const char *text)
+{
+	parse_long(text, &linger_us, "--linger", "microseconds");
+}
+
 static void
 parse_mode(const char *text)
 {
@@ -221,6 +531,21 @@ parse_mode(const char *text)
 	}
 }
 
+static void
+parse_policy(const char *text)
+{
+	if (strcmp(text, "block") == 0) {
+		slow_policy = SLOW_BLOCK;
+	} else if (strcmp(text, "drop") == 0 ||
+	    strcmp(text, "drop-oldest") == 0) {
+		slow_policy = SLOW_DROP;
+	} else if (strcmp(text, "spill") == 0) {
+		slow_policy = SLOW_SPILL;
+	} else {
+		warnx("bad --policy [%s] ignored.", text);
+	}
+}
+
 static void
 parse_priority(const char *text)
 {
@@ -249,6 +574,91 @@ parse_queue(const char *queue)
 	}
 }
 
+static void
+parse_notify(const char *text)
+{
+	parse_flag(text, &notify, "--notify");
+}
+
+static void
+parse_reassemble(const char *text)
+{
+	parse_flag(text, &reassemble, "--reassemble");
+}
+
+/*
+ * text: one of priority:LOW[-HIGH]=/queue, prefix:TEXT=/queue or
+ * byte:OFFSET:VALUE=/queue.
+ */
+static void
+parse_rule(const char *text)
+{
+	const char *split = NULL;
+
+	/* the queue name starts after the last "=/". */
+	for (const char *at = strstr(text, "=/"); at != NULL;
+	    at = strstr(at + 1, "=/"))
+		split = at;
+
+	if (split == NULL || !sane_queue(split + 1)) {
+		warnx("bad -r rule [%s] ignored; expected KIND:MATCH=/queue.",
+		    text);
+		return;
+	}
+
+	struct Rule rule = {.target = strdup(split + 1)};
+	char *cursor = NULL;
+	bool valid = false;
+
+	if (strncmp(text, "priority:", 9) == 0) {
+		rule.kind = RULE_PRIORITY;
+		rule.low = rule.high = strtol(text + 9, &cursor, 10);
+		if (cursor > text + 9 && *cursor == '-')
+			rule.high = strtol(cursor + 1, &cursor, 10);
+		valid = cursor == split && rule.low >= 0 &&
+		    rule.low <= rule.high && rule.high < MQ_PRIO_MAX;
+	} else if (strncmp(text, "prefix:", 7) == 0) {
+		rule.kind = RULE_PREFIX;
+		rule.prefix_length = split - (text + 7);
+		rule.prefix = strndup(text + 7, rule.prefix_length);
+		valid = rule.prefix_length > 0;
+	} else if (strncmp(text, "byte:", 5) == 0) {
+		long value;
+
+		rule.kind = RULE_BYTE;
+		rule.offset = strtol(text + 5, &cursor, 0);
+		if (cursor > text + 5 && *cursor == ':') {
+			const char *start = cursor + 1;
+
+			value = strtol(start, &cursor, 0);
+			valid = cursor > start && cursor == split &&
+			    rule.offset >= 0 && value >= 0 && value <= UCHAR_MAX;
+			rule.value = (unsigned char)value;
+		}
+	}
+
+	if (!valid) {
+		warnx("bad -r rule [%s] ignored.", text);
+		free(rule.prefix);
+		free(rule.target);
+		return;
+	}
+
+	struct Rule *grown = realloc(rules, (rule_count + 1) * sizeof(*rules));
+
+	if (grown == NULL)
+		err(1, "realloc(rules)");
+	rules = grown;
+	rules[rule_count++] = rule;
+}
+
+static void
+parse_shards(const char *text)
+{
+	set_shards = true;
+	parse_long(text, &shards, "--shards", "count");
+}
+
 static void
 parse_single_queue(const char *queue)
 {
@@ -263,12 +673,186 @@ parse_single_queue(const char *queue)
 	}
 }
 
+static void
+parse_target(const char *queue)
+{
+	if (sane_queue(queue)) {
+		struct element *n1 = malloc_element("target name");
+
+		n1->text = queue;
+		STAILQ_INSERT_TAIL(&targets, n1, links);
+	}
+}
+
 static void
 parse_size(const char *text)
 {
 	parse_long(text, &creation.size, "-s", "size");
 }
 
+static void
+parse_backoff(const char *text)
+{
+	parse_long(text, &retry.backoff, "--backoff", "microseconds");
+}
+
+static void
+parse_max_wait(const char *text)
+{
+	char *cursor = NULL;
+	double value = strtod(text, &cursor);
+
+	if (cursor > text && *cursor == 0 && value >= 0) {
+		retry.max_wait = value;
+	} else {
+		warnx("bad --max-wait format [%s] ignored.", text);
+	}
+}
+
+static void
+parse_skip(const char *text)
+{
+	char *cursor = NULL;
+	double value = strtod(text, &cursor);
+
+	if (cursor > text && *cursor == 0 && value >= 0)
+		skip = value;
+	else
+		warnx("bad --skip seconds [%s] ignored.", text);
+}
+
+static void
+parse_speed(const char *text)
+{
+	char *cursor = NULL;
+	double value = strtod(text, &cursor);
+
+	if (strcmp(text, "max") == 0)
+		speed = 0;
+	else if (cursor > text && *cursor == 0 && value > 0)
+		speed = value;
+	else
+		warnx("bad --speed factor [%s] ignored.", text);
+}
+
+static void
+parse_spill_dir(const char *text)
+{
+	spill_dir = text;
+}
+
+static void
+parse_spin(const char *text)
+{
+	parse_long(text, &retry.spins, "--spin", "count");
+}
+
+static void
+parse_threads(const char *text)
+{
+	parse_long(text, &threads, "--threads", "count");
+}
+
+static void
+parse_workers(const char *text)
+{
+	parse_long(text, &workers, "--workers", "count");
+}
+
+static void
+parse_messages(const char *text)
+{
+	parse_long(text, &bench_messages, "-n", "count");
+}
+
+static void
+parse_pattern(const char *text)
+{
+	if (strcmp(text, "throughput") == 0)
+		bench_latency = false;
+	else if (strcmp(text, "latency") == 0)
+		bench_latency = true;
+	else
+		warnx("bad --pattern [%s] ignored.", text);
+}
+
+static void
+parse_tick(const char *text)
+{
+	parse_long(text, &tick_us, "--tick", "microseconds");
+}
+
+static void
+parse_timeout(const char *text)
+{
+	char *cursor = NULL;
+	double value = strtod(text, &cursor);
+
+	if (cursor > text && *cursor == 0 && value >= 0) {
+		double whole = 0;
+		double fraction = modf(value, &whole);
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += (time_t)whole;
+		deadline.tv_nsec += (long)(fraction * 1000000000L);
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		set_deadline = true;
+	} else {
+		warnx("bad -T timeout format [%s] ignored.", text);
+	}
+}
+
+static void
+parse_unbatch(const char *text)
+{
+	parse_flag(text, &unbatch, "--unbatch");
+}
+
+/*
+ * text: one of empty, nonempty, below:COUNT or above:COUNT; a space may
+ * stand for the colon, as in "below 100".
+ */
+static void
+parse_until(const char *text)
+{
+	char *cursor = NULL;
+	long count = 0;
+	bool below = strncmp(text, "below", 5) == 0 &&
+	    (text[5] == ':' || text[5] == ' ');
+	bool above = strncmp(text, "above", 5) == 0 &&
+	    (text[5] == ':' || text[5] == ' ');
+
+	if (below || above) {
+		count = strtol(text + 6, &cursor, 10);
+		if (cursor == text + 6 || *cursor != 0 || count < 0 ||
+		    count == LONG_MAX) {
+			warnx("bad --until count [%s] ignored.", text);
+			return;
+		}
+	}
+
+	if (strcmp(text, "empty") == 0) {
+		until_low = 0;
+		until_high = 0;
+	} else if (strcmp(text, "nonempty") == 0) {
+		until_low = 1;
+		until_high = LONG_MAX;
+	} else if (below && count > 0) {
+		until_low = 0;
+		until_high = count - 1;
+	} else if (above) {
+		until_low = count + 1;
+		until_high = LONG_MAX;
+	} else {
+		warnx("bad --until [%s] ignored.", text);
+		return;
+	}
+	set_until = true;
+}
+
 static void
 parse_user(const char *text)
 {
@@ -291,89 +875,347 @@ validate_always_true(void)
 }
 
 static bool
-validate_content(void)
+validate_retry(void)
 {
-	bool valid = !STAILQ_EMPTY(&contents);
+	bool valid = retry.spins >= 0 && retry.backoff > 0;
 
 	if (!valid)
-		warnx("no content to send.");
+		warnx("--spin must not be negative and --backoff must be positive.");
 	return (valid);
 }
 
 static bool
-validate_depth(void)
+validate_spill_dir(void)
 {
-	bool valid = creation.exists || creation.depth > 0;
+	bool valid = spill_dir != NULL;
 
 	if (!valid)
-		warnx("-d maximum queue depth not provided.");
+		warnx("missing --spill-dir.");
 	return (valid);
 }
 
 static bool
-validate_queue(void)
+validate_large(void)
 {
-	bool valid = !STAILQ_EMPTY(&queues);
+	bool valid = large_mode == LARGE_NEVER || spill_dir == NULL;
 
 	if (!valid)
-		warnx("missing -q, or no sane queue name given.");
+		warnx("--large does not combine with --spill-dir.");
 	return (valid);
 }
 
+/* a journal record would be cut to the message size on respill. */
 static bool
-validate_single_queue(void)
+validate_fragment(void)
 {
-	bool valid = !STAILQ_EMPTY(&queues) &&
-	    STAILQ_NEXT(STAILQ_FIRST(&queues), links) == NULL;
+	bool valid = !fragment || spill_dir == NULL;
 
 	if (!valid)
-		warnx("expected one queue.");
+		warnx("--fragment does not combine with --spill-dir.");
 	return (valid);
 }
 
+/* true when send goes through send_stream(). */
 static bool
-validate_size(void)
+send_streaming(void)
 {
-	bool valid = creation.exists || creation.size > 0;
+	bool streaming = batch;
+	struct element *itc;
+
+	STAILQ_FOREACH(itc, &contents, links)
+		streaming |= strcmp(itc->text, "-") == 0;
+	return (streaming);
+}
+
+static bool
+validate_batch(void)
+{
+	bool valid = !send_streaming() || (large_mode == LARGE_NEVER &&
+	    !fragment && spill_dir == NULL && jobs == 1);
 
 	if (!valid)
-		warnx("-s maximum message size not provided.");
+		warnx("--batch and -c - do not combine with --large, "
+		    "--fragment, --spill-dir or -j.");
 	return (valid);
 }
 
-/* OPTIONS table handling. */
+static bool
+validate_type(void)
+{
+	bool valid = true;
+	struct element *itq;
 
-struct Option {
-	/* points to array of string pointers terminated by a null pointer. */
-	const char **pattern;
-	/* parse argument. */
-	void (*parse)(const char *);
-	/*
-	 * displays an error and returns false if this parameter is not valid.
-	 * returns true otherwise.
-	 */
-	bool (*validate)(void);
-};
+	STAILQ_FOREACH(itq, &queues, links) {
+		if (creation.spsc && !shmq_named(itq->text)) {
+			warnx("--type spsc needs a shm: queue, not [%s].",
+			    itq->text);
+			valid = false;
+		}
+	}
+	return (valid);
+}
 
-/*
- * parse options by table.
- * index - current index into argv list.
- * argc, argv - command line parameters.
- * options - null terminated list of pointers to options.
- */
-static void
-parse_options(int index, int argc,
-    const char *argv[], const struct Option **options)
+static bool
+validate_backlog(void)
 {
-	while ((index + 1) < argc) {
-		const struct Option **cursor = options;
-		bool match = false;
-		while (*cursor != NULL && !match) {
-			const struct Option *option = cursor[0];
-			const char **pattern = option->pattern;
-
-			while (*pattern != NULL && !match) {
-				const char *knob = *pattern;
+	bool valid = backlog > 0;
+
+	if (!valid)
+		warnx("--backlog must be at least one.");
+	return (valid);
+}
+
+static bool
+validate_policy(void)
+{
+	bool valid = slow_policy != SLOW_SPILL || spill_dir != NULL;
+
+	if (!valid)
+		warnx("--policy spill needs --spill-dir.");
+	return (valid);
+}
+
+static bool
+validate_targets(void)
+{
+	bool valid = !STAILQ_EMPTY(&targets);
+
+	if (!valid)
+		warnx("missing -t, or no sane target queue name given.");
+	return (valid);
+}
+
+static bool
+validate_rules(void)
+{
+	bool valid = rule_count > 0;
+
+	if (!valid)
+		warnx("no -r rule to route by.");
+	return (valid);
+}
+
+static bool
+validate_default(void)
+{
+	bool valid = fallback != NULL;
+
+	if (!valid)
+		warnx("missing --default queue for messages no rule matches.");
+	return (valid);
+}
+
+static bool
+validate_shards(void)
+{
+	bool valid = !set_shards || (shards >= 1 && shards <= shards_max);
+
+	if (!valid)
+		warnx("--shards must be between 1 and %ld.", shards_max);
+	return (valid);
+}
+
+static bool
+validate_key(void)
+{
+	bool valid = (key == NULL) == (shards == 0);
+
+	if (!valid)
+		warnx("--key and --shards must be given together.");
+	return (valid);
+}
+
+static bool
+validate_key_spec(void)
+{
+	if (!set_key_spec)
+		warnx("missing --key.");
+	return (set_key_spec);
+}
+
+static bool
+validate_content(void)
+{
+	bool valid = !STAILQ_EMPTY(&contents);
+
+	if (!valid)
+		warnx("no content to send.");
+	return (valid);
+}
+
+static bool
+validate_depth(void)
+{
+	bool valid = creation.exists || creation.depth > 0;
+
+	if (!valid)
+		warnx("-d maximum queue depth not provided.");
+	return (valid);
+}
+
+static bool
+validate_jobs(void)
+{
+	bool valid = jobs > 0;
+
+	if (!valid)
+		warnx("-j jobs must be at least one.");
+	return (valid);
+}
+
+static bool
+validate_messages(void)
+{
+	bool valid = bench_messages > 0;
+
+	if (!valid)
+		warnx("-n must be at least one message.");
+	return (valid);
+}
+
+static bool
+validate_tick(void)
+{
+	bool valid = tick_us > 0;
+
+	if (!valid)
+		warnx("--tick must be at least one microsecond.");
+	return (valid);
+}
+
+static bool
+validate_threads(void)
+{
+	bool valid = threads > 0;
+
+	if (!valid)
+		warnx("--threads must be at least one.");
+	return (valid);
+}
+
+static bool
+validate_file(void)
+{
+	bool valid = log_path != NULL;
+
+	if (!valid)
+		warnx("missing -f log file.");
+	return (valid);
+}
+
+static bool
+validate_linger(void)
+{
+	bool valid = linger_us >= 0;
+
+	if (!valid)
+		warnx("--linger may not be negative.");
+	return (valid);
+}
+
+static bool
+validate_workers(void)
+{
+	bool valid = workers > 0;
+
+	if (!valid)
+		warnx("--workers must be at least one.");
+	return (valid);
+}
+
+static bool
+validate_notify(void)
+{
+	bool valid = !notify || exec_command == NULL;
+
+	if (!valid)
+		warnx("--notify does not combine with --exec.");
+	return (valid);
+}
+
+static bool
+validate_until(void)
+{
+	if (!set_until)
+		warnx("missing --until, or no valid condition given.");
+	return (set_until);
+}
+
+static bool
+validate_queue(void)
+{
+	bool valid = !STAILQ_EMPTY(&queues);
+
+	if (!valid)
+		warnx("missing -q, or no sane queue name given.");
+	return (valid);
+}
+
+static bool
+validate_single_queue(void)
+{
+	bool valid = !STAILQ_EMPTY(&queues) &&
+	    STAILQ_NEXT(STAILQ_FIRST(&queues), links) == NULL;
+
+	if (!valid)
+		warnx("expected one queue.");
+	return (valid);
+}
+
+static bool
+validate_single_target(void)
+{
+	bool valid = !STAILQ_EMPTY(&targets) &&
+	    STAILQ_NEXT(STAILQ_FIRST(&targets), links) == NULL;
+
+	if (!valid)
+		warnx("expected one -t target queue.");
+	return (valid);
+}
+
+static bool
+validate_size(void)
+{
+	bool valid = creation.exists || creation.size > 0;
+
+	if (!valid)
+		warnx("-s maximum message size not provided.");
+	return (valid);
+}
+
+/* OPTIONS table handling. */
+
+struct Option {
+	/* points to array of string pointers terminated by a null pointer. */
+	const char **pattern;
+	/* parse argument. */
+	void (*parse)(const char *);
+	/*
+	 * displays an error and returns false if this parameter is not valid.
+	 * returns true otherwise.
+	 */
+	bool (*validate)(void);
+};
+
+/*
+ * parse options by table.
+ * index - current index into argv list.
+ * argc, argv - command line parameters.
+ * options - null terminated list of pointers to options.
+ */
+static void
+parse_options(int index, int argc,
+    const char *argv[], const struct Option **options)
+{
+	while ((index + 1) < argc) {
+		const struct Option **cursor = options;
+		bool match = false;
+		while (*cursor != NULL && !match) {
+			const struct Option *option = cursor[0];
+			const char **pattern = option->pattern;
+
+			while (*pattern != NULL && !match) {
+				const char *knob = *pattern;
 
 				match = strcmp(knob, argv[index]) == 0;
 				if (!match)
@@ -399,6 +1241,44 @@ parse_options(int index, int argc,
 	}
 }
 
+/*
+ * Verbs that speak to kernel queues only. Returns false, naming each,
+ * if any -q, -t, -r or --default queue is a shm: queue.
+ */
+static bool
+kernel_only(const char *verb)
+{
+	bool valid = true;
+	struct element *item;
+
+	STAILQ_FOREACH(item, &queues, links) {
+		if (shmq_named(item->text)) {
+			warnx("%s does not take shm: queue [%s].", verb,
+			    item->text);
+			valid = false;
+		}
+	}
+	STAILQ_FOREACH(item, &targets, links) {
+		if (shmq_named(item->text)) {
+			warnx("%s does not take shm: queue [%s].", verb,
+			    item->text);
+			valid = false;
+		}
+	}
+	for (long r = 0; r < rule_count; r++) {
+		if (shmq_named(rules[r].target)) {
+			warnx("%s does not take shm: queue [%s].", verb,
+			    rules[r].target);
+			valid = false;
+		}
+	}
+	if (fallback != NULL && shmq_named(fallback)) {
+		warnx("%s does not take shm: queue [%s].", verb, fallback);
+		valid = false;
+	}
+	return (valid);
+}
+
 /* options - null terminated list of pointers to options. */
 static bool
 validate_options(const struct Option **options)
@@ -415,72 +1295,413 @@ validate_options(const struct Option **options)
 	return (valid);
 }
 
-/* SUBCOMMANDS */
+/* queue utilitarian */
 
-/*
- * queue: name of queue to be created.
- * q_creation: creation parameters (copied by value).
- */
-static int
-create(const char *queue, struct Creation q_creation)
+/* 64 bit FNV-1a; cheap, and spreads short keys well enough for sharding. */
+static uint64_t
+hash_key(const char *text, size_t length)
 {
-	int flags = O_RDWR;
-	struct mq_attr stuff = {
-		.mq_curmsgs = 0,
-		.mq_maxmsg = q_creation.depth,
-		.mq_msgsize = q_creation.size,
-		.mq_flags = 0
-	};
-
-	if (!q_creation.block) {
-		flags |= O_NONBLOCK;
-		stuff.mq_flags |= O_NONBLOCK;
-	}
+	uint64_t hash = 14695981039346656037ULL;
 
-	mqd_t handle = mq_open(queue, flags);
-	q_creation.exists = handle != fail;
-	if (!q_creation.exists) {
-		/*
-		 * apply size and depth checks here.
-		 * if queue exists, we can default to existing depth and size.
-		 * but for a new queue, we require that input.
-		 */
-		if (validate_size() && validate_depth()) {
-			/* no need to re-apply mode. */
-			q_creation.set_mode = false;
-			flags |= O_CREAT;
-			handle = mq_open(queue, flags, q_creation.mode, &stuff);
-		}
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)text[i];
+		hash *= 1099511628211ULL;
 	}
+	return (hash);
+}
 
-	if (handle == fail) {
-		errno_t what = errno;
+/* Return the malloc'd name of shard index of queue group, or NULL. */
+static char *
+shard_name(const char *queue, long index)
+{
+	char *name = NULL;
 
-		warnc(what, "mq_open(create)");
-		return (what);
+	if (asprintf(&name, "%s.%ld", queue, index) < 0)
+		err(1, "asprintf(shard)");
+	if (!sane_queue(name)) {
+		free(name);
+		return (NULL);
 	}
+	return (name);
+}
 
-#ifdef __FreeBSD__
-	/*
-	 * undocumented.
-	 * See https://bugs.freebsd.org/bugzilla//show_bug.cgi?id=273230
-	 */
-	int fd = mq_getfd_np(handle);
+/*
+ * Replace every queue group in the -q list with the names of its shards:
+ * all of them when only is negative, otherwise just shard 'only'.
+ */
+static void
+shard_queues(long only)
+{
+	struct tqh expanded = STAILQ_HEAD_INITIALIZER(expanded);
+	struct element *item;
 
-	if (fd < 0) {
+	STAILQ_FOREACH(item, &queues, links) {
+		long first = only < 0 ? 0 : only;
+		long last = only < 0 ? shards - 1 : only;
+
+		for (long i = first; i <= last; i++) {
+			char *name = shard_name(item->text, i);
+
+			if (name != NULL) {
+				struct element *n1 = malloc_element("shard name");
+
+				n1->text = name;
+				STAILQ_INSERT_TAIL(&expanded, n1, links);
+			}
+		}
+	}
+	STAILQ_INIT(&queues);
+	STAILQ_CONCAT(&queues, &expanded);
+}
+
+/*
+ * Open a queue to drain without blocking. Asks for write access too, when
+ * permitted, so messages that could not be delivered can be handed back.
+ */
+static mqd_t
+open_source(const char *queue)
+{
+	mqd_t handle = mq_open(queue, O_RDWR | O_NONBLOCK);
+
+	if (handle == fail && errno == EACCES)
+		handle = mq_open(queue, O_RDONLY | O_NONBLOCK);
+	return (handle);
+}
+
+/* Return the current CLOCK_REALTIME time in nanoseconds. */
+static long long
+now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (now.tv_sec * 1000000000LL + now.tv_nsec);
+}
+
+static struct timespec
+ns_timespec(long long ns)
+{
+	struct timespec result = {
+		.tv_sec = ns / 1000000000LL,
+		.tv_nsec = ns % 1000000000LL
+	};
+
+	return (result);
+}
+
+static void
+on_signal(int number)
+{
+	if (number == SIGINT || number == SIGTERM)
+		stopping = 1;
+	else
+		reporting = 1;
+	if (wake_fd >= 0)
+		(void)write(wake_fd, "", 1);
+}
+
+/*
+ * Route SIGINT and SIGTERM (and SIGINFO where it exists) to on_signal.
+ * No SA_RESTART, so a blocked wait returns EINTR and the verb can report
+ * before it exits.
+ */
+static void
+catch_signals(void)
+{
+	struct sigaction action = {
+		.sa_handler = on_signal,
+		.sa_flags = 0
+	};
+
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+#ifdef SIGINFO
+	sigaction(SIGINFO, &action, NULL);
+#endif
+}
+
+/* message and byte counters of a long running verb. */
+struct Tally {
+	unsigned long long messages;
+	unsigned long long bytes;
+	/* CLOCK_REALTIME nanoseconds when the verb started. */
+	long long started;
+};
+
+static void
+tally_report(FILE *file, const char *verb, const struct Tally *tally)
+{
+	double seconds = (now_ns() - tally->started) / 1e9;
+
+	if (seconds <= 0)
+		seconds = 1e-9;
+	fprintf(file,
+	    "%s: %llu message(s), %llu byte(s) in %.3f s "
+	    "(%.1f msg/s, %.3f MB/s)\n",
+	    verb, tally->messages, tally->bytes, seconds,
+	    tally->messages / seconds, tally->bytes / seconds / 1e6);
+	fflush(file);
+}
+
+/*
+ * Return cap nanoseconds, shortened to whatever is left before the -T
+ * deadline. Zero or less means the deadline has passed.
+ */
+static long long
+until_deadline(long long cap)
+{
+	if (set_deadline) {
+		long long left = deadline.tv_sec * 1000000000LL +
+		    deadline.tv_nsec - now_ns();
+
+		if (left < cap)
+			return (left);
+	}
+	return (cap);
+}
+
+/*
+ * Sleep up to ns nanoseconds, returning early if the queue behind fd can
+ * accept a message (events == POLLOUT) or has one to deliver
+ * (events == POLLIN). Without a descriptor (fd < 0) it just sleeps.
+ */
+static void
+wait_queue(int fd, short events, long long ns)
+{
+	struct timespec interval = ns_timespec(ns);
+	struct pollfd entry = {
+		.fd = fd,
+		.events = events
+	};
+
+	if (entry.fd >= 0)
+		ppoll(&entry, 1, &interval, NULL);
+	else
+		nanosleep(&interval, NULL);
+}
+
+/*
+ * Hand a message that could not be delivered back to queue, drained
+ * through handle, waiting for room until the -T deadline.
+ * Returns zero, or an errno value once the message is lost.
+ */
+static int
+hand_back(mqd_t handle, const char *queue, const char *text, size_t length,
+    unsigned q_priority)
+{
+	while (mq_send(handle, text, length, q_priority) != 0) {
 		errno_t what = errno;
 
-		warnc(what, "mq_getfd_np(create)");
-		mq_close(handle);
+		if (what == EINTR && !stopping)
+			continue;
+		if (what == EAGAIN && !stopping) {
+			long long pause = until_deadline(1000000000LL);
+
+			if (pause > 0) {
+				wait_queue(queue_fd(handle), POLLOUT, pause);
+				continue;
+			}
+		}
+		warnc(what, "lost %zu byte message returning to %s", length,
+		    queue);
 		return (what);
 	}
+	return (0);
+}
+
+/* one open queue, on whichever transport holds it. */
+struct Endpoint {
+	const struct transport *transport;
+	void *handle;
+};
+
+/*
+ * Open queue on its transport, as mq_open(2) would.
+ * Returns zero or an errno value.
+ */
+static int
+endpoint_open(struct Endpoint *endpoint, const char *queue, int flags,
+    mode_t mode, const struct mq_attr *attr)
+{
+	endpoint->transport = transport_for(queue);
+	endpoint->handle = endpoint->transport->open(queue, flags, mode, attr);
+	return (endpoint->handle != NULL ? 0 : errno);
+}
+
+static int
+endpoint_close(struct Endpoint *endpoint)
+{
+	int result = 0;
+
+	if (endpoint->handle != NULL)
+		result = endpoint->transport->close(endpoint->handle);
+	endpoint->handle = NULL;
+	return (result);
+}
+
+static int
+endpoint_getattr(const struct Endpoint *endpoint, struct mq_attr *attr)
+{
+	return (endpoint->transport->getattr(endpoint->handle, attr));
+}
+
+/* send one message, waiting no later than the -T deadline. */
+static int
+endpoint_send(const struct Endpoint *endpoint, const char *text, size_t size,
+    unsigned q_priority)
+{
+	return (endpoint->transport->send(endpoint->handle, text, size,
+	    q_priority, set_deadline ? &deadline : NULL));
+}
+
+/* receive one message, waiting no later than the -T deadline. */
+static ssize_t
+endpoint_receive(const struct Endpoint *endpoint, char *text, size_t size,
+    unsigned *q_priority)
+{
+	return (endpoint->transport->receive(endpoint->handle, text, size,
+	    q_priority, set_deadline ? &deadline : NULL));
+}
+
+/*
+ * Retry a send that failed because a non-blocking queue was full.
+ * Spins first, then backs off exponentially with jitter, waking early when
+ * the queue becomes writable. Gives up after --max-wait seconds or at the
+ * -T deadline, whichever comes first.
+ * Returns zero on success, otherwise -1 with errno set.
+ */
+static int
+send_retry(const struct Endpoint *endpoint, const char *text, size_t size,
+    unsigned q_priority)
+{
+	const struct transport *transport = endpoint->transport;
+
+	for (long i = 0; i < retry.spins; i++) {
+		if (transport->send(endpoint->handle, text, size, q_priority,
+		    NULL) == 0)
+			return (0);
+		if (errno != EAGAIN)
+			return (-1);
+	}
+
+	long long now = now_ns();
+	long long give_up = now + (long long)(retry.max_wait * 1e9);
+	errno_t expired = EAGAIN;
+
+	if (set_deadline) {
+		long long limit =
+		    deadline.tv_sec * 1000000000LL + deadline.tv_nsec;
+
+		if (limit < give_up) {
+			give_up = limit;
+			expired = ETIMEDOUT;
+		}
+	}
+
+	/* the cap applies from the first sleep, and keeps the jitter in range. */
+	long long delay = retry.backoff < backoff_cap_ns / 1000 ?
+	    retry.backoff * 1000LL : backoff_cap_ns;
+
+	while (now < give_up) {
+		/* sleep somewhere between half and all of the delay. */
+		long long pause = delay / 2 + arc4random_uniform(delay / 2 + 1);
+
+		if (pause > give_up - now)
+			pause = give_up - now;
+		wait_queue(transport->notify_fd(endpoint->handle), POLLOUT,
+		    pause);
+
+		if (transport->send(endpoint->handle, text, size, q_priority,
+		    NULL) == 0)
+			return (0);
+		if (errno != EAGAIN)
+			return (-1);
+
+		delay = delay * 2 < backoff_cap_ns ? delay * 2 : backoff_cap_ns;
+		now = now_ns();
+	}
+
+	errno = expired;
+	return (-1);
+}
+
+/* SUBCOMMANDS */
+
+/*
+ * queue: name of queue to be created.
+ * q_creation: creation parameters (copied by value).
+ */
+static int
+create(const char *queue, struct Creation q_creation)
+{
+	int flags = O_RDWR;
+	struct mq_attr stuff = {
+		.mq_curmsgs = 0,
+		.mq_maxmsg = q_creation.depth,
+		.mq_msgsize = q_creation.size,
+		.mq_flags = 0
+	};
+
+	if (!q_creation.block) {
+		flags |= O_NONBLOCK;
+		stuff.mq_flags |= O_NONBLOCK;
+	}
+
+	struct Endpoint endpoint;
+	int result = endpoint_open(&endpoint, queue, flags, 0, NULL);
+	const struct transport *wanted = endpoint.transport;
+
+	if (q_creation.spsc)
+		wanted = transport_named("spsc");
+	else if (q_creation.set_type && wanted == transport_named("spsc"))
+		wanted = transport_named("shmq");
+	if (result == 0 && endpoint.transport != wanted) {
+		warnx("queue [%s] exists as a %s queue.", queue,
+		    endpoint.transport->name);
+		endpoint_close(&endpoint);
+		return (EEXIST);
+	}
+
+	q_creation.exists = result == 0;
+	if (!q_creation.exists) {
+		/*
+		 * apply size and depth checks here.
+		 * if queue exists, we can default to existing depth and size.
+		 * but for a new queue, we require that input.
+		 */
+		if (validate_size() && validate_depth()) {
+			/* no need to re-apply mode. */
+			q_creation.set_mode = false;
+			flags |= O_CREAT;
+			endpoint.transport = wanted;
+			endpoint.handle = wanted->open(queue, flags,
+			    q_creation.mode, &stuff);
+			result = endpoint.handle != NULL ? 0 : errno;
+		}
+	}
+
+	const char *name = endpoint.transport->name;
+
+	if (result != 0) {
+		warnc(result, "%s_open(create)", name);
+		return (result);
+	}
+
+	/* ownership and mode need a descriptor of the queue. */
+	int fd = endpoint.transport->fd(endpoint.handle);
+
+	if (fd < 0)
+		return (endpoint_close(&endpoint));
+
 	struct stat status = {0};
-	int result = fstat(fd, &status);
+
+	result = fstat(fd, &status);
 	if (result != 0) {
 		errno_t what = errno;
 
 		warnc(what, "fstat(create)");
-		mq_close(handle);
+		endpoint_close(&endpoint);
 		return (what);
 	}
 
@@ -495,7 +1716,7 @@ create(const char *queue, struct Creation q_creation)
 			errno_t what = errno;
 
 			warnc(what, "fchown(create)");
-			mq_close(handle);
+			endpoint_close(&endpoint);
 			return (what);
 		}
 	}
@@ -508,214 +1729,5791 @@ create(const char *queue, struct Creation q_creation)
 			errno_t what = errno;
 
 			warnc(what, "fchmod(create)");
-			mq_close(handle);
+			endpoint_close(&endpoint);
 			return (what);
 		}
 	}
-#endif /* __FreeBSD__ */
-
-	return (mq_close(handle));
+
+	return (endpoint_close(&endpoint));
+}
+
+/* queue: name of queue to be removed. */
+static int
+rm(const char *queue)
+{
+	const struct transport *transport = transport_for(queue);
+	int result = transport->unlink(queue);
+
+	if (result != 0) {
+		errno_t what = errno;
+
+		warnc(what, "%s_unlink", transport->name);
+		return (what);
+	}
+
+	return (result);
+}
+
+/* Return the display character for non-zero mode. */
+static char
+dual(mode_t mode, char display)
+{
+	return (mode != 0 ? display : '-');
+}
+
+/* Select one of four display characters based on mode and modifier. */
+static char
+quad(mode_t mode, mode_t modifier)
+{
+	static const char display[] = "-xSs";
+	unsigned index = 0;
+	if (mode != 0)
+		index += 1;
+	if (modifier)
+		index += 2;
+	return (display[index]);
+}
+
+/* queue: name of queue to be inspected. */
+static int
+info(const char *queue)
+{
+	struct Endpoint endpoint;
+	int result = endpoint_open(&endpoint, queue, O_RDONLY, 0, NULL);
+	const char *name = endpoint.transport->name;
+
+	if (result != 0) {
+		warnc(result, "%s_open(info)", name);
+		return (result);
+	}
+
+	struct mq_attr actual;
+
+	result = endpoint_getattr(&endpoint, &actual);
+	if (result != 0) {
+		errno_t what = errno;
+
+		warnc(what, "%s_getattr(info)", name);
+		endpoint_close(&endpoint);
+		return (what);
+	}
+
+	fprintf(stdout,
+	    "queue: '%s'\nQSIZE: %lu\nMSGSIZE: %ld\nMAXMSG: %ld\n"
+	    "CURMSG: %ld\nflags: %03ld\n",
+	    queue, actual.mq_msgsize * actual.mq_curmsgs, actual.mq_msgsize,
+	    actual.mq_maxmsg, actual.mq_curmsgs, actual.mq_flags);
+
+	int fd = endpoint.transport->fd(endpoint.handle);
+	struct stat status;
+
+	/* without a descriptor there is no ownership to show. */
+	if (fd >= 0 && fstat(fd, &status) != 0) {
+		warn("fstat(info)");
+	} else if (fd >= 0) {
+		mode_t mode = status.st_mode;
+
+		fprintf(stdout, "UID: %u\nGID: %u\n", status.st_uid, status.st_gid);
+		fprintf(stdout, "MODE: %c%c%c%c%c%c%c%c%c%c\n",
+		    dual(mode & S_ISVTX, 's'),
+		    dual(mode & S_IRUSR, 'r'),
+		    dual(mode & S_IWUSR, 'w'),
+		    quad(mode & S_IXUSR, mode & S_ISUID),
+		    dual(mode & S_IRGRP, 'r'),
+		    dual(mode & S_IWGRP, 'w'),
+		    quad(mode & S_IXGRP, mode & S_ISGID),
+		    dual(mode & S_IROTH, 'r'),
+		    dual(mode & S_IWOTH, 'w'),
+		    dual(mode & S_IXOTH, 'x'));
+	}
+
+	return (endpoint_close(&endpoint));
+}
+
+/* queue: name of queue group whose --shards are summed up. */
+static int
+info_group(const char *queue)
+{
+	struct mq_attr total = {0};
+	long *depths = calloc(shards, sizeof(long));
+	int worst = 0;
+
+	if (depths == NULL)
+		err(1, "calloc(info)");
+
+	for (long i = 0; i < shards; i++) {
+		char *name = shard_name(queue, i);
+
+		if (name == NULL) {
+			worst = ENAMETOOLONG;
+			break;
+		}
+
+		mqd_t handle = mq_open(name, O_RDONLY);
+		struct mq_attr actual;
+
+		if (handle == fail || mq_getattr(handle, &actual) != 0) {
+			worst = errno;
+			warnc(worst, "mq_open(info %s)", name);
+			if (handle != fail)
+				mq_close(handle);
+			free(name);
+			continue;
+		}
+		mq_close(handle);
+		free(name);
+
+		/* shards may differ; report the largest message size. */
+		if (actual.mq_msgsize > total.mq_msgsize)
+			total.mq_msgsize = actual.mq_msgsize;
+		total.mq_maxmsg += actual.mq_maxmsg;
+		total.mq_curmsgs += actual.mq_curmsgs;
+		depths[i] = actual.mq_curmsgs;
+	}
+
+	fprintf(stdout,
+	    "queue: '%s'\nSHARDS: %ld\nQSIZE: %lu\nMSGSIZE: %ld\n"
+	    "MAXMSG: %ld\nCURMSG: %ld\n",
+	    queue, shards, total.mq_msgsize * total.mq_curmsgs,
+	    total.mq_msgsize, total.mq_maxmsg, total.mq_curmsgs);
+	for (long i = 0; i < shards; i++)
+		fprintf(stdout, "CURMSG.%ld: %ld\n", i, depths[i]);
+
+	free(depths);
+	return (worst);
+}
+
+/* wait samples the depth no sooner, and no later, than these apart. */
+static const long long wait_sample_min_ns = 50000LL;
+static const long long wait_sample_max_ns = 50000000LL;
+
+/*
+ * queue: name of queue to watch until its depth falls in
+ * [until_low, until_high]. One descriptor stays open for the whole wait.
+ * A queue that must grow from empty, or shrink from full, is waited on
+ * with poll(2), which wakes the moment it changes; any other depth is
+ * sampled with mq_getattr(2) at intervals that start at
+ * wait_sample_min_ns, double while the depth holds still and start over
+ * when it moves.
+ */
+static int
+wait_depth(const char *queue)
+{
+	struct Endpoint endpoint;
+	int result = endpoint_open(&endpoint, queue, O_RDONLY, 0, NULL);
+	const char *name = endpoint.transport->name;
+
+	if (result != 0) {
+		warnc(result, "%s_open(wait)", name);
+		return (result);
+	}
+
+	int fd = endpoint.transport->notify_fd(endpoint.handle);
+	long long interval = wait_sample_min_ns;
+	long last = -1;
+
+	for (;;) {
+		struct mq_attr actual;
+
+		if (endpoint_getattr(&endpoint, &actual) != 0) {
+			result = errno;
+			warnc(result, "%s_getattr(wait)", name);
+			break;
+		}
+		if (actual.mq_curmsgs >= until_low &&
+		    actual.mq_curmsgs <= until_high)
+			break;
+		if (until_low > actual.mq_maxmsg) {
+			/* above:N with N >= mq_maxmsg: the depth never gets there. */
+			result = EINVAL;
+			warnx("queue [%s] holds at most %ld message(s); "
+			    "--until above:%ld can never be met.", queue,
+			    actual.mq_maxmsg, until_low - 1);
+			break;
+		}
+
+		if (actual.mq_curmsgs != last)
+			interval = wait_sample_min_ns;
+		last = actual.mq_curmsgs;
+
+		long long pause = until_deadline(interval);
+
+		if (pause <= 0) {
+			result = ETIMEDOUT;
+			warnc(result, "wait(%s)", queue);
+			break;
+		}
+
+		if (fd >= 0 && actual.mq_curmsgs == 0) {
+			/* only a message can change it: sleep until one comes. */
+			wait_queue(fd, POLLIN, until_deadline(backoff_cap_ns));
+		} else if (fd >= 0 && actual.mq_curmsgs == actual.mq_maxmsg) {
+			/* likewise only a receive. */
+			wait_queue(fd, POLLOUT, until_deadline(backoff_cap_ns));
+		} else {
+			wait_queue(-1, 0, pause);
+			if (interval < wait_sample_max_ns)
+				interval *= 2;
+		}
+	}
+
+	if (result != 0) {
+		endpoint_close(&endpoint);
+		return (result);
+	}
+	return (endpoint_close(&endpoint));
+}
+
+/*
+ * Large payloads.
+ *
+ * A payload too big for its queue is written to a POSIX shared memory
+ * segment, and the queue carries a LargeDescriptor naming the segment.
+ * The segment starts with a LargeSegment counting the descriptors still
+ * queued for it, so tee can hand one segment to every target. The receiver
+ * maps the segment, checks the payload against the descriptor and drops
+ * its reference; the last one unlinks the segment.
+ */
+
+static const char large_magic[8] = "PMQLARG2";
+
+struct LargeDescriptor {
+	char magic[8];
+	/* payload bytes in the segment. */
+	uint64_t length;
+	/* hash_key() of the payload. */
+	uint64_t checksum;
+	/* shm_open(2) name of the segment. */
+	char name[48];
+};
+
+/* head of a segment; the payload follows. */
+struct LargeSegment {
+	/* descriptors naming the segment that are yet to be received. */
+	atomic_ullong references;
+};
+
+static bool
+large_descriptor(const char *text, size_t length)
+{
+	return (length == sizeof(struct LargeDescriptor) &&
+	    memcmp(text, large_magic, sizeof(large_magic)) == 0);
+}
+
+/* the descriptor's segment name, which need not be terminated. */
+static void
+large_name(const struct LargeDescriptor *descriptor,
+    char name[sizeof(descriptor->name) + 1])
+{
+	memcpy(name, descriptor->name, sizeof(descriptor->name));
+	name[sizeof(descriptor->name)] = 0;
+}
+
+/*
+ * Copy a payload to a new segment readable by whoever may read the queue.
+ * Returns zero or an errno value.
+ */
+static int
+large_store(const struct Endpoint *endpoint, const char *text, size_t length,
+    struct LargeDescriptor *descriptor)
+{
+	struct stat status;
+	mode_t mode = 0600;
+	int queue = endpoint->transport->fd(endpoint->handle);
+
+	if (queue >= 0 && fstat(queue, &status) == 0)
+		mode = status.st_mode & 0666;
+
+	memset(descriptor, 0, sizeof(*descriptor));
+	memcpy(descriptor->magic, large_magic, sizeof(descriptor->magic));
+	descriptor->length = length;
+	descriptor->checksum = hash_key(text, length);
+	snprintf(descriptor->name, sizeof(descriptor->name),
+	    "/posixmqcontrol.%ld.%08x%08x", (long)getpid(), arc4random(),
+	    arc4random());
+
+	int fd = shm_open(descriptor->name, O_RDWR | O_CREAT | O_EXCL, mode);
+
+	if (fd < 0)
+		return (errno);
+
+	size_t size = sizeof(struct LargeSegment) + length;
+	int result = 0;
+
+	if (ftruncate(fd, size) != 0) {
+		result = errno;
+	} else {
+		char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+
+		if (map == MAP_FAILED) {
+			result = errno;
+		} else {
+			atomic_init(&((struct LargeSegment *)map)->references,
+			    1);
+			memcpy(map + sizeof(struct LargeSegment), text, length);
+			munmap(map, size);
+		}
+	}
+	close(fd);
+	if (result != 0)
+		shm_unlink(descriptor->name);
+	return (result);
+}
+
+/*
+ * Add count references to the segment a descriptor names, or drop one when
+ * count is -1, unlinking the segment with its last reference. A process
+ * that may read but not write the segment cannot count and unlinks it.
+ * Returns zero or an errno value.
+ */
+static int
+large_refer(const struct LargeDescriptor *descriptor, long long count)
+{
+	char name[sizeof(descriptor->name) + 1];
+
+	large_name(descriptor, name);
+
+	int fd = shm_open(name, O_RDWR, 0);
+
+	if (fd < 0 && errno == EACCES && count < 0) {
+		if (shm_unlink(name) != 0)
+			return (errno);
+		return (0);
+	}
+	if (fd < 0)
+		return (errno);
+
+	struct LargeSegment *segment = mmap(NULL, sizeof(*segment),
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int result = 0;
+
+	close(fd);
+	if (segment == MAP_FAILED)
+		return (errno);
+	if (atomic_fetch_add(&segment->references, count) == 1 && count < 0 &&
+	    shm_unlink(name) != 0)
+		result = errno;
+	munmap(segment, sizeof(*segment));
+	return (result);
+}
+
+/* drop a reference to the segment of a descriptor that is discarded. */
+static void
+large_release(const char *text, size_t length, const char *verb)
+{
+	struct LargeDescriptor descriptor;
+
+	if (!large_descriptor(text, length))
+		return;
+	memcpy(&descriptor, text, sizeof(descriptor));
+
+	int result = large_refer(&descriptor, -1);
+
+	if (result != 0 && result != ENOENT) {
+		char name[sizeof(descriptor.name) + 1];
+
+		large_name(&descriptor, name);
+		warnc(result, "shm_unlink(%s %s)", verb, name);
+	}
+}
+
+/*
+ * Print the payload a descriptor names, straight from the mapping, and
+ * release the segment. Returns zero or an errno value.
+ */
+static int
+large_emit(const struct LargeDescriptor *descriptor, unsigned q_priority)
+{
+	char name[sizeof(descriptor->name) + 1];
+
+	large_name(descriptor, name);
+
+	int fd = shm_open(name, O_RDONLY, 0);
+
+	if (fd < 0) {
+		errno_t what = errno;
+
+		warnc(what, "shm_open(recv %s)", name);
+		return (what);
+	}
+
+	struct stat status;
+	size_t size = sizeof(struct LargeSegment) + descriptor->length;
+	int result = 0;
+
+	if (fstat(fd, &status) != 0) {
+		result = errno;
+		warnc(result, "fstat(recv %s)", name);
+	} else if ((uint64_t)status.st_size != size) {
+		result = EIO;
+		warnx("segment %s holds %jd bytes, expected %zu.", name,
+		    (intmax_t)status.st_size, size);
+	}
+
+	char *map = NULL;
+
+	if (result == 0) {
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+			result = errno;
+			warnc(result, "mmap(recv %s)", name);
+		} else if (hash_key(map + sizeof(struct LargeSegment),
+		    descriptor->length) != descriptor->checksum) {
+			result = EIO;
+			warnx("segment %s fails its checksum.", name);
+		}
+	}
+	close(fd);
+
+	if (result == 0) {
+		fprintf(stdout, "[%u]: ", q_priority);
+		fwrite(map + sizeof(struct LargeSegment), 1,
+		    descriptor->length, stdout);
+		fputc('\n', stdout);
+	}
+	if (map != NULL)
+		munmap(map, size);
+
+	/* a damaged payload is left in place for inspection. */
+	if (result == 0)
+		large_release((const char *)descriptor, sizeof(*descriptor),
+		    "recv");
+	return (result);
+}
+
+/*
+ * Fragments.
+ *
+ * send --fragment splits a message longer than the queue's message size
+ * into fragments, each a FragmentHeader then as much payload as fits.
+ * recv --reassemble collects fragments by message id, in any order and
+ * interleaved with other messages, into a buffer sized from the header.
+ * The header carries the fragment size, so the receiving queue may differ
+ * from the one the fragments were sent to.
+ */
+
+static const char fragment_magic[8] = "PMQFRAG2";
+
+/* largest message recv --reassemble will allocate room for. */
+static const uint64_t fragment_total_max = (uint64_t)1 << 30;
+
+struct FragmentHeader {
+	char magic[8];
+	/* random id shared by the fragments of one message. */
+	uint64_t id;
+	uint32_t index;
+	uint32_t count;
+	/* payload bytes of the whole message. */
+	uint64_t total;
+	/* payload bytes of every fragment but the last. */
+	uint32_t chunk;
+	uint32_t reserved;
+};
+
+/* a message recv --reassemble has part of. */
+struct Partial {
+	uint64_t id;
+	uint64_t total;
+	uint32_t count;
+	uint32_t chunk;
+	uint32_t received;
+	unsigned priority;
+	char *buffer;
+	/* one bit per fragment received. */
+	uint8_t *have;
+};
+
+/*
+ * Batches.
+ *
+ * send --batch packs records into one message: a BatchHeader, then for
+ * each record a two byte length and the record bytes, with no padding.
+ */
+
+static const char batch_magic[4] = "PMQB";
+
+struct BatchHeader {
+	char magic[4];
+	uint32_t count;
+};
+
+/* longest record a batch can carry. */
+static const size_t batch_record_max = UINT16_MAX;
+
+/*
+ * Print each record of a batch as a message of its own.
+ * Returns false if the batch is malformed.
+ */
+static bool
+recv_unbatch(const char *text, ssize_t length, unsigned q_priority)
+{
+	struct BatchHeader header;
+	const char *cursor = text + sizeof(header);
+	const char *end = text + length;
+
+	memcpy(&header, text, sizeof(header));
+	for (uint32_t i = 0; i < header.count; i++) {
+		uint16_t size;
+
+		if (end - cursor < (ssize_t)sizeof(size))
+			return (false);
+		memcpy(&size, cursor, sizeof(size));
+		cursor += sizeof(size);
+		if (end - cursor < size)
+			return (false);
+		cursor += size;
+	}
+	if (cursor != end)
+		return (false);
+
+	cursor = text + sizeof(header);
+	for (uint32_t i = 0; i < header.count; i++) {
+		uint16_t size;
+
+		memcpy(&size, cursor, sizeof(size));
+		cursor += sizeof(size);
+		fprintf(stdout, "[%u]: %-*.*s\n", q_priority, size, size, cursor);
+		cursor += size;
+	}
+	return (true);
+}
+
+/* print one received message, following a large payload descriptor. */
+static int
+recv_emit(const char *text, ssize_t length, unsigned q_priority)
+{
+	if (large_descriptor(text, length)) {
+		struct LargeDescriptor descriptor;
+
+		memcpy(&descriptor, text, sizeof(descriptor));
+		return (large_emit(&descriptor, q_priority));
+	}
+
+	fprintf(stdout, "[%u]: %-*.*s\n", q_priority, (int)length, (int)length,
+	    text);
+	return (0);
+}
+
+/*
+ * File one fragment. Returns the message it completes, or NULL.
+ * The caller owns and frees a completed Partial.
+ */
+static struct Partial *
+fragment_take(struct Partial **table, long *count, const char *text,
+    ssize_t length, unsigned q_priority)
+{
+	struct FragmentHeader header;
+
+	memcpy(&header, text, sizeof(header));
+	text += sizeof(header);
+	length -= sizeof(header);
+
+	uint64_t chunk = header.chunk;
+	struct Partial *partial = NULL;
+
+	for (long i = 0; i < *count && partial == NULL; i++) {
+		if ((*table)[i].id == header.id)
+			partial = &(*table)[i];
+	}
+
+	/* every fragment but the last is full. */
+	bool valid = chunk > 0 && header.total <= fragment_total_max &&
+	    header.count > 0 && header.index < header.count &&
+	    (header.total + chunk - 1) / chunk == header.count &&
+	    (partial == NULL || (partial->total == header.total &&
+	    partial->count == header.count && partial->chunk == chunk));
+
+	if (valid) {
+		uint64_t expected = header.index + 1 < header.count ? chunk :
+		    header.total - header.index * chunk;
+
+		valid = (uint64_t)length == expected;
+	}
+	if (valid && partial == NULL) {
+		char *buffer = malloc(header.total + 1);
+		uint8_t *have = calloc((header.count + 7) / 8, 1);
+
+		valid = buffer != NULL && have != NULL;
+		if (valid) {
+			*table = realloc(*table, (*count + 1) * sizeof(**table));
+			if (*table == NULL)
+				err(1, "realloc(reassemble)");
+			partial = &(*table)[(*count)++];
+			partial->id = header.id;
+			partial->total = header.total;
+			partial->count = header.count;
+			partial->chunk = chunk;
+			partial->received = 0;
+			partial->priority = q_priority;
+			partial->buffer = buffer;
+			partial->have = have;
+		} else {
+			free(buffer);
+			free(have);
+		}
+	}
+	if (!valid) {
+		warnx("malformed fragment %u/%u of message %016jx dropped.",
+		    header.index, header.count, (uintmax_t)header.id);
+		return (NULL);
+	}
+
+	uint8_t bit = 1 << (header.index % 8);
+
+	if ((partial->have[header.index / 8] & bit) != 0)
+		return (NULL);
+	partial->have[header.index / 8] |= bit;
+	memcpy(partial->buffer + header.index * chunk, text, length);
+	if (++partial->received < partial->count)
+		return (NULL);
+
+	struct Partial *done = malloc(sizeof(*done));
+
+	if (done == NULL)
+		err(1, "malloc(reassemble)");
+	*done = *partial;
+	*partial = (*table)[--*count];
+	return (done);
+}
+
+/* put the fragments of messages left incomplete back in the queue. */
+static void
+fragment_requeue(const struct Endpoint *endpoint, struct Partial *table,
+    long count,
+    long msgsize, bool writable)
+{
+	/* every fragment was received from this queue, so fits it again. */
+	char *buffer = malloc(msgsize);
+
+	if (buffer == NULL)
+		err(1, "malloc(reassemble)");
+	for (long i = 0; i < count; i++) {
+		struct Partial *partial = &table[i];
+		size_t chunk = partial->chunk;
+		struct FragmentHeader header = {
+			.id = partial->id,
+			.count = partial->count,
+			.total = partial->total,
+			.chunk = partial->chunk
+		};
+
+		memcpy(header.magic, fragment_magic, sizeof(header.magic));
+		for (uint32_t j = 0; j < partial->count && writable; j++) {
+			if ((partial->have[j / 8] & 1 << (j % 8)) == 0)
+				continue;
+
+			uint64_t offset = (uint64_t)j * chunk;
+			size_t length = partial->total - offset < chunk ?
+			    partial->total - offset : chunk;
+
+			header.index = j;
+			memcpy(buffer, &header, sizeof(header));
+			memcpy(buffer + sizeof(header), partial->buffer + offset,
+			    length);
+			if (endpoint->transport->send(endpoint->handle, buffer,
+			    sizeof(header) + length, partial->priority,
+			    NULL) != 0) {
+				warn("%s_send(reassemble)",
+				    endpoint->transport->name);
+				writable = false;
+			} else {
+				partial->received--;
+			}
+		}
+		if (partial->received > 0)
+			warnx("%u fragment(s) of message %016jx lost.",
+			    partial->received, (uintmax_t)partial->id);
+		free(partial->have);
+		free(partial->buffer);
+	}
+	free(buffer);
+}
+
+/* one queue recv takes a message from. */
+struct Receiver {
+	const char *queue;
+	struct Endpoint endpoint;
+	long msgsize;
+	/* reassembly hands back fragments it could not complete. */
+	bool writable;
+	struct Partial *table;
+	long partials;
+};
+
+/* open a queue for recv, adding flags to the open mode. */
+static int
+receiver_open(struct Receiver *receiver, const char *queue, int flags)
+{
+	struct Endpoint *endpoint = &receiver->endpoint;
+
+	receiver->queue = queue;
+	receiver->writable = reassemble;
+	receiver->table = NULL;
+	receiver->partials = 0;
+
+	int result = endpoint_open(endpoint, queue,
+	    (receiver->writable ? O_RDWR : O_RDONLY) | flags, 0, NULL);
+	const char *name = endpoint->transport->name;
+
+	if (result == EACCES && receiver->writable) {
+		receiver->writable = false;
+		result = endpoint_open(endpoint, queue, O_RDONLY | flags, 0,
+		    NULL);
+	}
+	if (result != 0) {
+		warnc(result, "%s_open(recv %s)", name, queue);
+		return (result);
+	}
+
+	struct mq_attr actual;
+
+	if (endpoint_getattr(endpoint, &actual) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "%s_attr(recv %s)", name, queue);
+		endpoint_close(endpoint);
+		return (what);
+	}
+	receiver->msgsize = actual.mq_msgsize;
+	return (0);
+}
+
+static int
+receiver_close(struct Receiver *receiver)
+{
+	if (receiver->endpoint.handle == NULL)
+		return (0);
+	fragment_requeue(&receiver->endpoint, receiver->table,
+	    receiver->partials, receiver->msgsize, receiver->writable);
+	free(receiver->table);
+	return (endpoint_close(&receiver->endpoint));
+}
+
+/*
+ * Act on one received message. Returns true once a whole message has been
+ * printed, with its result in *result; false while a fragmented message is
+ * still incomplete.
+ */
+static bool
+receiver_take(struct Receiver *receiver, const char *text, ssize_t got,
+    unsigned q_priority, int *result)
+{
+	*result = 0;
+	if (reassemble && got >= (ssize_t)sizeof(struct FragmentHeader) &&
+	    memcmp(text, fragment_magic, sizeof(fragment_magic)) == 0) {
+		struct Partial *done = fragment_take(&receiver->table,
+		    &receiver->partials, text, got, q_priority);
+
+		if (done == NULL)
+			return (false);
+		fprintf(stdout, "[%u]: ", done->priority);
+		fwrite(done->buffer, 1, done->total, stdout);
+		fputc('\n', stdout);
+		free(done->have);
+		free(done->buffer);
+		free(done);
+		return (true);
+	}
+
+	if (unbatch && got >= (ssize_t)sizeof(struct BatchHeader) &&
+	    memcmp(text, batch_magic, sizeof(batch_magic)) == 0 &&
+	    recv_unbatch(text, got, q_priority))
+		return (true);
+
+	*result = recv_emit(text, got, q_priority);
+	return (true);
+}
+
+/* queue: name of queue to drain one message. */
+static int
+recv(const char *queue)
+{
+	struct Receiver receiver;
+	int result = receiver_open(&receiver, queue, 0);
+
+	if (result != 0)
+		return (result);
+
+	const char *name = receiver.endpoint.transport->name;
+	char *text = calloc(1, receiver.msgsize + 1);
+	unsigned q_priority = 0;
+
+	if (text == NULL)
+		err(1, "malloc(recv)");
+	for (;;) {
+		ssize_t got = endpoint_receive(&receiver.endpoint, text,
+		    receiver.msgsize, &q_priority);
+
+		if (got < 0) {
+			result = errno;
+			warnc(result, "%s_receive", name);
+			break;
+		}
+		if (receiver_take(&receiver, text, got, q_priority, &result))
+			break;
+	}
+
+	free(text);
+	if (result != 0) {
+		receiver_close(&receiver);
+		return (result);
+	}
+	return (receiver_close(&receiver));
+}
+
+/* recv looks at queues without a pollable descriptor this often. */
+static const long long recv_sample_ns = 10000000LL;
+
+/*
+ * recv with several -q queues: take one message from whichever queue
+ * has one first. Every queue is opened non-blocking and its descriptor
+ * handed to a poller, so a wakeup costs the same however many idle queues
+ * there are. Queues without a descriptor (shm:) are sampled instead.
+ */
+static int
+recv_any(void)
+{
+	long count = 0;
+	struct element *itq;
+
+	STAILQ_FOREACH(itq, &queues, links)
+		count++;
+
+	struct Receiver *receivers = calloc(count, sizeof(*receivers));
+	long *ready = calloc(count, sizeof(*ready));
+	long *sampled = calloc(count, sizeof(*sampled));
+	struct poller *poller = poller_create(count);
+	long msgsize = 0;
+	long samples = 0;
+	long opened = 0;
+	int result = 0;
+
+	if (receivers == NULL || ready == NULL || sampled == NULL)
+		err(1, "malloc(recv)");
+	if (poller == NULL)
+		err(1, "%s(recv)", poller_kind);
+
+	STAILQ_FOREACH(itq, &queues, links) {
+		struct Receiver *receiver = &receivers[opened];
+
+		result = receiver_open(receiver, itq->text, O_NONBLOCK);
+		if (result != 0)
+			break;
+		opened++;
+
+		const struct Endpoint *endpoint = &receiver->endpoint;
+		int fd = endpoint->transport->notify_fd(endpoint->handle);
+
+		if (fd < 0) {
+			sampled[samples++] = opened - 1;
+		} else if (poller_add(poller, fd, opened - 1) != 0) {
+			result = errno;
+			warnc(result, "%s(recv %s)", poller_kind, itq->text);
+			break;
+		}
+		if (receiver->msgsize > msgsize)
+			msgsize = receiver->msgsize;
+	}
+
+	char *text = calloc(1, msgsize + 1);
+	bool done = result != 0;
+	/* the first pass looks at every queue: some may hold messages. */
+	int found = 0;
+
+	if (text == NULL)
+		err(1, "malloc(recv)");
+	for (long i = 0; i < opened && !done; i++)
+		ready[found++] = i;
+
+	while (!done) {
+		for (int k = 0; k < found && !done; k++) {
+			struct Receiver *receiver = &receivers[ready[k]];
+			unsigned q_priority = 0;
+			ssize_t got;
+
+			/* a fragmented message takes several receives. */
+			while (!done) {
+				got = endpoint_receive(&receiver->endpoint,
+				    text, receiver->msgsize, &q_priority);
+				if (got < 0)
+					break;
+				done = receiver_take(receiver, text, got,
+				    q_priority, &result);
+			}
+			if (!done && errno != EAGAIN) {
+				result = errno;
+				warnc(result, "%s_receive(recv %s)",
+				    receiver->endpoint.transport->name,
+				    receiver->queue);
+				done = true;
+			}
+		}
+		if (done)
+			break;
+
+		long long pause = until_deadline(samples > 0 ?
+		    recv_sample_ns : 1000000000LL);
+
+		if (pause <= 0) {
+			result = ETIMEDOUT;
+			warnc(result, "recv");
+			break;
+		}
+
+		found = poller_wait(poller, ready, count, pause);
+		if (found < 0) {
+			if (errno != EINTR) {
+				result = errno;
+				warnc(result, "%s(recv)", poller_kind);
+				break;
+			}
+			found = 0;
+		}
+		for (long i = 0; i < samples; i++)
+			ready[found++] = sampled[i];
+	}
+
+	for (long i = 0; i < opened; i++) {
+		int closed = receiver_close(&receivers[i]);
+
+		if (result == 0)
+			result = closed;
+	}
+	poller_destroy(poller);
+	free(text);
+	free(sampled);
+	free(ready);
+	free(receivers);
+	return (result);
+}
+
+/*
+ * queue: name of queue to empty in place. The queue keeps its attributes,
+ * owner and mode, and open descriptors stay valid. Messages are received
+ * non-blocking into one buffer until the queue is empty. A large payload
+ * descriptor drops its reference to its shared memory segment.
+ */
+static int
+purge(const char *queue)
+{
+	struct Endpoint endpoint;
+	int result = endpoint_open(&endpoint, queue, O_RDONLY | O_NONBLOCK, 0,
+	    NULL);
+	const char *name = endpoint.transport->name;
+
+	if (result != 0) {
+		warnc(result, "%s_open(purge %s)", name, queue);
+		return (result);
+	}
+
+	struct mq_attr actual;
+
+	if (endpoint_getattr(&endpoint, &actual) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "%s_getattr(purge %s)", name, queue);
+		endpoint_close(&endpoint);
+		return (what);
+	}
+
+	char *text = malloc(actual.mq_msgsize);
+	struct Tally tally = {.started = now_ns()};
+
+	if (text == NULL)
+		err(1, "malloc(purge)");
+	for (;;) {
+		unsigned q_priority;
+		ssize_t got = endpoint.transport->receive(endpoint.handle, text,
+		    actual.mq_msgsize, &q_priority, NULL);
+
+		if (got < 0) {
+			if (errno != EAGAIN) {
+				result = errno;
+				warnc(result, "%s_receive(purge %s)", name,
+				    queue);
+			}
+			break;
+		}
+		tally.messages++;
+		tally.bytes += got;
+		large_release(text, got, "purge");
+	}
+	free(text);
+
+	tally_report(stdout, queue, &tally);
+	if (result != 0) {
+		endpoint_close(&endpoint);
+		return (result);
+	}
+	return (endpoint_close(&endpoint));
+}
+
+/* send with the -T deadline and retry options. */
+static int
+send_message(const struct Endpoint *endpoint, const char *text, size_t size,
+    unsigned q_priority)
+{
+	int result = endpoint_send(endpoint, text, size, q_priority);
+
+	if (result != 0 && errno == EAGAIN &&
+	    (retry.spins > 0 || retry.max_wait > 0))
+		result = send_retry(endpoint, text, size, q_priority);
+	return (result);
+}
+
+/*
+ * Send text as fragments of at most msgsize bytes.
+ * Returns zero, or -1 with errno set.
+ */
+static int
+send_fragments(const struct Endpoint *endpoint, const char *text, size_t size,
+    long msgsize, unsigned q_priority)
+{
+	struct FragmentHeader header = {.total = size};
+	size_t chunk = msgsize - sizeof(header);
+	uint64_t count = (size + chunk - 1) / chunk;
+
+	/* no larger than recv --reassemble accepts. */
+	if (count > UINT32_MAX || chunk > UINT32_MAX ||
+	    size > fragment_total_max) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+
+	char *buffer = malloc(msgsize);
+
+	if (buffer == NULL)
+		err(1, "malloc(fragment)");
+	memcpy(header.magic, fragment_magic, sizeof(header.magic));
+	arc4random_buf(&header.id, sizeof(header.id));
+	header.count = count;
+	header.chunk = chunk;
+
+	int result = 0;
+
+	for (uint32_t i = 0; i < header.count && result == 0; i++) {
+		size_t offset = (size_t)i * chunk;
+		size_t length = size - offset < chunk ? size - offset : chunk;
+
+		header.index = i;
+		memcpy(buffer, &header, sizeof(header));
+		memcpy(buffer + sizeof(header), text + offset, length);
+		result = send_message(endpoint, buffer, sizeof(header) + length,
+		    q_priority);
+	}
+
+	errno_t what = errno;
+
+	free(buffer);
+	errno = what;
+	return (result);
+}
+
+/*
+ * queue: name of queue to send one message.
+ * text: message text.
+ * q_priority: message priority in range of 0 to 63.
+ */
+static int
+send(const char *queue, const char *text, unsigned q_priority)
+{
+	/* a spilling sender never waits on a full queue. */
+	bool block = creation.block && spill_dir == NULL;
+	struct Endpoint endpoint;
+	int result = endpoint_open(&endpoint, queue,
+	    O_WRONLY | (block ? 0 : O_NONBLOCK), 0, NULL);
+	const char *name = endpoint.transport->name;
+
+	if (result != 0) {
+		warnc(result, "%s_open(send)", name);
+		return (result);
+	}
+
+	struct mq_attr actual;
+
+	result = endpoint_getattr(&endpoint, &actual);
+
+	if (result != 0) {
+		errno_t what = errno;
+
+		warnc(what, "%s_attr(send)", name);
+		endpoint_close(&endpoint);
+		return (what);
+	}
+
+	if (actual.mq_curmsgs >= actual.mq_maxmsg &&
+	    (actual.mq_flags & O_NONBLOCK) == 0)
+		warnx("queue [%s] is full, waiting for space.", queue);
+
+	size_t size = strlen(text);
+	struct LargeDescriptor descriptor;
+	bool large = large_mode == LARGE_ALWAYS ||
+	    (large_mode == LARGE_AUTO && size > (size_t)actual.mq_msgsize);
+
+	if (large) {
+		if ((long)sizeof(descriptor) > actual.mq_msgsize) {
+			warnx("queue [%s] message size is below the %zu bytes of "
+			    "a large payload descriptor.", queue,
+			    sizeof(descriptor));
+			endpoint_close(&endpoint);
+			return (EMSGSIZE);
+		}
+		result = large_store(&endpoint, text, size, &descriptor);
+		if (result != 0) {
+			warnc(result, "shm_open(send)");
+			endpoint_close(&endpoint);
+			return (result);
+		}
+		text = (const char *)&descriptor;
+		size = sizeof(descriptor);
+	} else if (size > (size_t)actual.mq_msgsize && fragment) {
+		if ((long)sizeof(struct FragmentHeader) >= actual.mq_msgsize) {
+			warnx("queue [%s] message size leaves no room after the "
+			    "%zu byte fragment header.", queue,
+			    sizeof(struct FragmentHeader));
+			endpoint_close(&endpoint);
+			return (EMSGSIZE);
+		}
+	} else if (size > (size_t)actual.mq_msgsize) {
+		warnx("truncating message to %ld characters.\n", actual.mq_msgsize);
+		size = actual.mq_msgsize;
+	}
+
+	if (size > (size_t)actual.mq_msgsize)
+		result = send_fragments(&endpoint, text, size,
+		    actual.mq_msgsize, q_priority);
+	else
+		result = send_message(&endpoint, text, size, q_priority);
+
+	if (result != 0) {
+		errno_t what = errno;
+
+		/* send_contents() spills these instead. */
+		if (what != EAGAIN || spill_dir == NULL)
+			warnc(what, "%s_send", name);
+		if (large)
+			shm_unlink(descriptor.name);
+		endpoint_close(&endpoint);
+		return (what);
+	}
+
+	return (endpoint_close(&endpoint));
+}
+
+/*
+ * Spill journals.
+ *
+ * A journal is an append-only file named after its queue inside the
+ * --spill-dir directory. It starts with spill_magic and is followed by
+ * records, each a SpillRecord header then the payload padded to a multiple
+ * of eight bytes. Writers and respill passes serialize on flock(2).
+ */
+
+static const char spill_magic[8] = "PMQSPIL1";
+
+struct SpillRecord {
+	/* payload bytes following this header. */
+	uint32_t length;
+	/* message priority. */
+	uint32_t priority;
+	/* CLOCK_REALTIME time the message was spilled. */
+	int64_t seconds;
+	int64_t nanoseconds;
+};
+
+static size_t
+spill_padded(size_t length)
+{
+	return ((length + 7) & ~(size_t)7);
+}
+
+/*
+ * Journal path of queue: dir/name.spill for a kernel queue /name, and
+ * dir/shm.name.spill for shm:/name. Returns zero, or -1 with errno set.
+ */
+static int
+spill_path(const char *queue, char *path, size_t size)
+{
+	bool shared = shmq_named(queue);
+	const char *name = shared ? queue + strlen(SHMQ_PREFIX) + 1 : queue + 1;
+
+	if ((size_t)snprintf(path, size, "%s/%s%s.spill", spill_dir,
+	    shared ? "shm." : "", name) >= size) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Open and lock the journal of queue.
+ * Returns the descriptor, or -1 with errno set.
+ */
+static int
+spill_open(const char *queue)
+{
+	char path[PATH_MAX];
+
+	if (spill_path(queue, path, sizeof(path)) != 0)
+		return (-1);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+
+	if (fd < 0)
+		return (-1);
+	if (flock(fd, LOCK_EX) != 0) {
+		errno_t what = errno;
+
+		close(fd);
+		errno = what;
+		return (-1);
+	}
+	return (fd);
+}
+
+/* one message handed to spill_write(). */
+struct SpillItem {
+	const char *text;
+	size_t length;
+	unsigned priority;
+};
+
+/*
+ * Append count messages to the journal of queue as one group commit: a
+ * single mapping, a single msync and fsync.
+ * Returns zero or an errno value.
+ */
+static int
+spill_write(const char *queue, const struct SpillItem *items, size_t count)
+{
+	int fd = spill_open(queue);
+
+	if (fd < 0) {
+		errno_t what = errno;
+
+		warnc(what, "open(spill %s)", queue);
+		return (what);
+	}
+
+	struct stat status;
+
+	if (fstat(fd, &status) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "fstat(spill)");
+		close(fd);
+		return (what);
+	}
+
+	off_t start = status.st_size;
+	size_t header = start == 0 ? sizeof(spill_magic) : 0;
+	size_t total = header;
+
+	for (size_t i = 0; i < count; i++)
+		total += sizeof(struct SpillRecord) +
+		    spill_padded(items[i].length);
+
+	if (ftruncate(fd, start + total) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "ftruncate(spill)");
+		close(fd);
+		return (what);
+	}
+
+	/* mappings must begin on a page boundary. */
+	off_t base = start & ~((off_t)getpagesize() - 1);
+	size_t span = (size_t)(start - base) + total;
+	char *map = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    base);
+
+	if (map == MAP_FAILED) {
+		errno_t what = errno;
+
+		warnc(what, "mmap(spill)");
+		ftruncate(fd, start);
+		close(fd);
+		return (what);
+	}
+
+	char *cursor = map + (start - base);
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (header != 0) {
+		memcpy(cursor, spill_magic, sizeof(spill_magic));
+		cursor += sizeof(spill_magic);
+	}
+	for (size_t i = 0; i < count; i++) {
+		struct SpillRecord record = {
+			.length = items[i].length,
+			.priority = items[i].priority,
+			.seconds = now.tv_sec,
+			.nanoseconds = now.tv_nsec
+		};
+
+		memcpy(cursor, &record, sizeof(record));
+		cursor += sizeof(record);
+		memcpy(cursor, items[i].text, record.length);
+		cursor += spill_padded(record.length);
+	}
+
+	int result = 0;
+
+	if (msync(map, span, MS_SYNC) != 0 || fsync(fd) != 0) {
+		result = errno;
+		warnc(result, "fsync(spill)");
+	}
+	munmap(map, span);
+	close(fd);
+
+	if (result == 0)
+		warnx("queue [%s] full, spilled %zu message(s) to %s.",
+		    queue, count, spill_dir);
+	return (result);
+}
+
+/*
+ * Spill every content from first to the end of the list at the -p priority
+ * with one spill_write().
+ */
+static int
+spill_commit(const char *queue, struct element *first)
+{
+	size_t count = 0;
+	struct element *item;
+
+	for (item = first; item != NULL; item = STAILQ_NEXT(item, links))
+		count++;
+
+	struct SpillItem *items = calloc(count, sizeof(*items));
+
+	if (items == NULL)
+		err(1, "calloc(spill)");
+
+	count = 0;
+	for (item = first; item != NULL; item = STAILQ_NEXT(item, links)) {
+		items[count].text = item->text;
+		items[count].length = strlen(item->text);
+		items[count].priority = priority;
+		count++;
+	}
+
+	int result = spill_write(queue, items, count);
+
+	free(items);
+	return (result);
+}
+
+/* one journal record located by respill_pass(). */
+struct SpillEntry {
+	/* offset of the SpillRecord header within the journal. */
+	size_t offset;
+	/* copied out of the header for sorting. */
+	uint32_t priority;
+};
+
+/* highest priority first; equal priorities keep journal order. */
+static int
+spill_order(const void *left, const void *right)
+{
+	const struct SpillEntry *a = left;
+	const struct SpillEntry *b = right;
+
+	if (a->priority != b->priority)
+		return (a->priority > b->priority ? -1 : 1);
+	return (a->offset < b->offset ? -1 : a->offset > b->offset);
+}
+
+/*
+ * Send journaled messages of queue to handle in priority order until the
+ * queue is full, then rewrite the journal with whatever is left.
+ * remaining: receives the number of messages still journaled.
+ * Returns zero or an errno value.
+ */
+static int
+respill_pass(const char *queue, const struct Endpoint *endpoint, long msgsize,
+    size_t *remaining)
+{
+	char path[PATH_MAX];
+	int fd = spill_open(queue);
+
+	*remaining = 0;
+	if (fd < 0) {
+		errno_t what = errno;
+
+		warnc(what, "open(spill %s)", queue);
+		return (what);
+	}
+
+	struct stat status;
+
+	if (fstat(fd, &status) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "fstat(spill)");
+		close(fd);
+		return (what);
+	}
+
+	size_t size = status.st_size;
+
+	if (size <= sizeof(spill_magic)) {
+		close(fd);
+		return (0);
+	}
+
+	char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		errno_t what = errno;
+
+		warnc(what, "mmap(spill)");
+		close(fd);
+		return (what);
+	}
+
+	/* spill_open() succeeded, so the path fits. */
+	spill_path(queue, path, sizeof(path));
+	if (memcmp(map, spill_magic, sizeof(spill_magic)) != 0) {
+		warnx("%s is not a spill journal.", path);
+		munmap(map, size);
+		close(fd);
+		return (EINVAL);
+	}
+
+	size_t count = 0;
+	size_t capacity = 64;
+	struct SpillEntry *entries = malloc(capacity * sizeof(*entries));
+	size_t offset = sizeof(spill_magic);
+
+	if (entries == NULL)
+		err(1, "malloc(spill entries)");
+	while (offset + sizeof(struct SpillRecord) <= size) {
+		struct SpillRecord record;
+
+		memcpy(&record, map + offset, sizeof(record));
+		if (offset + sizeof(record) + spill_padded(record.length) > size)
+			break;
+		if (count == capacity) {
+			capacity *= 2;
+			entries = realloc(entries, capacity * sizeof(*entries));
+			if (entries == NULL)
+				err(1, "realloc(spill entries)");
+		}
+		entries[count].offset = offset;
+		entries[count].priority = record.priority;
+		count++;
+		offset += sizeof(record) + spill_padded(record.length);
+	}
+	if (offset != size)
+		warnx("ignoring %zu trailing byte(s) of %s.", size - offset,
+		    path);
+
+	qsort(entries, count, sizeof(*entries), spill_order);
+
+	int result = 0;
+	size_t sent = 0;
+
+	for (; sent < count; sent++) {
+		struct SpillRecord record;
+		const char *text = map + entries[sent].offset + sizeof(record);
+
+		memcpy(&record, map + entries[sent].offset, sizeof(record));
+		if (record.length > msgsize) {
+			warnx("truncating message to %ld characters.", msgsize);
+			record.length = msgsize;
+		}
+		if (endpoint_send(endpoint, text, record.length,
+		    record.priority) != 0) {
+			if (errno != EAGAIN) {
+				result = errno;
+				warnc(result, "%s_send(respill)",
+				    endpoint->transport->name);
+			}
+			break;
+		}
+	}
+
+	/* compact the unsent tail, still in priority order, to the front. */
+	char *kept = NULL;
+	size_t kept_size = 0;
+
+	for (size_t i = sent; i < count; i++) {
+		struct SpillRecord record;
+
+		memcpy(&record, map + entries[i].offset, sizeof(record));
+		kept_size += sizeof(record) + spill_padded(record.length);
+	}
+	if (kept_size > 0) {
+		char *cursor = kept = malloc(kept_size);
+
+		if (kept == NULL)
+			err(1, "malloc(spill compaction)");
+		for (size_t i = sent; i < count; i++) {
+			struct SpillRecord record;
+			size_t span;
+
+			memcpy(&record, map + entries[i].offset, sizeof(record));
+			span = sizeof(record) + spill_padded(record.length);
+			memcpy(cursor, map + entries[i].offset, span);
+			cursor += span;
+		}
+		memcpy(map + sizeof(spill_magic), kept, kept_size);
+		msync(map, sizeof(spill_magic) + kept_size, MS_SYNC);
+	}
+	munmap(map, size);
+	free(kept);
+	free(entries);
+
+	if (sent > 0 &&
+	    (ftruncate(fd, sizeof(spill_magic) + kept_size) != 0 ||
+	    fsync(fd) != 0)) {
+		result = errno;
+		warnc(result, "ftruncate(spill)");
+	}
+	close(fd);
+
+	*remaining = count - sent;
+	return (result);
+}
+
+/*
+ * queue: name of queue to drain its spill journal into.
+ * with -b false this makes a single pass. otherwise it keeps waiting for
+ * room until the journal is empty or the -T deadline passes.
+ */
+static int
+respill(const char *queue)
+{
+	struct Endpoint endpoint;
+	int result = endpoint_open(&endpoint, queue, O_WRONLY | O_NONBLOCK, 0,
+	    NULL);
+	const char *name = endpoint.transport->name;
+
+	if (result != 0) {
+		warnc(result, "%s_open(respill)", name);
+		return (result);
+	}
+
+	struct mq_attr actual;
+
+	if (endpoint_getattr(&endpoint, &actual) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "%s_attr(respill)", name);
+		endpoint_close(&endpoint);
+		return (what);
+	}
+
+	size_t remaining = 0;
+
+	result = respill_pass(queue, &endpoint, actual.mq_msgsize, &remaining);
+
+	while (result == 0 && remaining > 0 && creation.block) {
+		long long pause = until_deadline(100000000LL);
+
+		if (pause <= 0) {
+			result = ETIMEDOUT;
+			break;
+		}
+		wait_queue(endpoint.transport->notify_fd(endpoint.handle),
+		    POLLOUT, pause);
+		result = respill_pass(queue, &endpoint, actual.mq_msgsize,
+		    &remaining);
+	}
+
+	if (remaining > 0)
+		warnx("queue [%s] still has %zu spilled message(s).",
+		    queue, remaining);
+	if (result == ETIMEDOUT)
+		warnc(result, "respill");
+
+	endpoint_close(&endpoint);
+	return (result);
+}
+
+/*
+ * queue: name of queue to send every -c content.
+ * once one content is spilled the rest are spilled too, so a later content
+ * never overtakes an earlier one of the same priority.
+ */
+static int
+send_contents(const char *queue)
+{
+	int worst = 0;
+	struct element *itc;
+
+	STAILQ_FOREACH(itc, &contents, links) {
+		int result = send(queue, itc->text, priority);
+
+		if (result == EAGAIN && spill_dir != NULL) {
+			result = spill_commit(queue, itc);
+			if (result != 0)
+				worst = result;
+			break;
+		}
+		if (result != 0)
+			worst = result;
+	}
+	return (worst);
+}
+
+/* the queues of a send_stream(). */
+struct Stream {
+	struct Endpoint *endpoints;
+	const char **names;
+	long count;
+	/* smallest message size of the queues. */
+	long msgsize;
+	/* batch being filled. */
+	char *frame;
+	size_t used;
+	uint32_t records;
+	/* CLOCK_REALTIME nanoseconds the first record joined the batch. */
+	long long first;
+	unsigned long long messages;
+	unsigned long long total;
+};
+
+/* send one message to every queue. returns zero or an errno value. */
+static int
+stream_send(struct Stream *stream, const char *text, size_t size)
+{
+	for (long i = 0; i < stream->count; i++) {
+		if (send_message(&stream->endpoints[i], text, size,
+		    priority) != 0) {
+			errno_t what = errno;
+
+			warnc(what, "%s_send(%s)",
+			    stream->endpoints[i].transport->name,
+			    stream->names[i]);
+			return (what);
+		}
+	}
+	stream->messages++;
+	return (0);
+}
+
+static int
+stream_flush(struct Stream *stream)
+{
+	if (stream->records == 0)
+		return (0);
+
+	struct BatchHeader header = {.count = stream->records};
+
+	memcpy(header.magic, batch_magic, sizeof(header.magic));
+	memcpy(stream->frame, &header, sizeof(header));
+
+	int result = stream_send(stream, stream->frame, stream->used);
+
+	stream->used = sizeof(header);
+	stream->records = 0;
+	return (result);
+}
+
+/* queue one record, sending a batch first if the record does not fit. */
+static int
+stream_record(struct Stream *stream, const char *text, size_t size)
+{
+	size_t limit = batch ?
+	    stream->msgsize - sizeof(struct BatchHeader) - sizeof(uint16_t) :
+	    (size_t)stream->msgsize;
+
+	if (batch && limit > batch_record_max)
+		limit = batch_record_max;
+	if (size > limit) {
+		warnx("truncating record to %zu characters.", limit);
+		size = limit;
+	}
+	stream->total++;
+	if (!batch)
+		return (stream_send(stream, text, size));
+
+	if (stream->used + sizeof(uint16_t) + size > (size_t)stream->msgsize) {
+		int result = stream_flush(stream);
+
+		if (result != 0)
+			return (result);
+	}
+
+	uint16_t length = size;
+
+	if (stream->records++ == 0)
+		stream->first = now_ns();
+	memcpy(stream->frame + stream->used, &length, sizeof(length));
+	memcpy(stream->frame + stream->used + sizeof(length), text, size);
+	stream->used += sizeof(length) + size;
+	return (0);
+}
+
+/*
+ * Send every line of standard input as a record. A partial batch is sent
+ * once its first record has waited --linger microseconds.
+ */
+static int
+stream_input(struct Stream *stream)
+{
+	size_t size = 65536;
+	char *input = malloc(size);
+	size_t used = 0;
+	bool skipping = false;
+	int result = 0;
+
+	if (input == NULL)
+		err(1, "malloc(send)");
+
+	for (;;) {
+		long long wait_ns = 1000000000LL;
+
+		if (stream->records > 0) {
+			wait_ns = stream->first + linger_us * 1000LL - now_ns();
+			if (wait_ns <= 0) {
+				result = stream_flush(stream);
+				if (result != 0)
+					break;
+				continue;
+			}
+		}
+
+		long long pause = until_deadline(wait_ns);
+
+		if (pause <= 0) {
+			result = ETIMEDOUT;
+			warnc(result, "send");
+			break;
+		}
+
+		struct pollfd wait = {.fd = STDIN_FILENO, .events = POLLIN};
+		struct timespec interval = ns_timespec(pause);
+
+		if (ppoll(&wait, 1, &interval, NULL) <= 0)
+			continue;
+
+		ssize_t got = read(STDIN_FILENO, input + used, size - used);
+
+		if (got < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			result = errno;
+			warnc(result, "read(send)");
+			break;
+		}
+		if (got == 0) {
+			/* a final line need not end in a newline. */
+			if (used > 0 && !skipping)
+				result = stream_record(stream, input, used);
+			break;
+		}
+		used += got;
+
+		char *line = input;
+		char *end;
+
+		while (result == 0 &&
+		    (end = memchr(line, '\n', input + used - line)) != NULL) {
+			if (!skipping)
+				result = stream_record(stream, line, end - line);
+			skipping = false;
+			line = end + 1;
+		}
+		if (result != 0)
+			break;
+		used -= line - input;
+		memmove(input, line, used);
+		if (used == size) {
+			/* keep the front of an overlong line. */
+			result = stream_record(stream, input, used);
+			skipping = true;
+			used = 0;
+			if (result != 0)
+				break;
+		}
+	}
+	free(input);
+	return (result);
+}
+
+/*
+ * Send every -c content, and every line of standard input for -c -, to
+ * every -q queue over one descriptor each, packed into batches with
+ * --batch.
+ */
+static int
+send_stream(void)
+{
+	struct Stream stream = {.count = 0, .msgsize = LONG_MAX};
+	struct element *item;
+
+	STAILQ_FOREACH(item, &queues, links)
+		stream.count++;
+	stream.endpoints = calloc(stream.count, sizeof(struct Endpoint));
+	stream.names = calloc(stream.count, sizeof(char *));
+	if (stream.endpoints == NULL || stream.names == NULL)
+		err(1, "calloc(send)");
+
+	int result = 0;
+	long opened = 0;
+
+	STAILQ_FOREACH(item, &queues, links) {
+		struct Endpoint *endpoint = &stream.endpoints[opened];
+		struct mq_attr actual;
+
+		stream.names[opened] = item->text;
+		result = endpoint_open(endpoint, item->text,
+		    O_WRONLY | (creation.block ? 0 : O_NONBLOCK), 0, NULL);
+		if (result != 0) {
+			warnc(result, "%s_open(send %s)",
+			    endpoint->transport->name, item->text);
+			break;
+		}
+		opened++;
+		if (endpoint_getattr(endpoint, &actual) != 0) {
+			result = errno;
+			warnc(result, "%s_attr(send %s)",
+			    endpoint->transport->name, item->text);
+			break;
+		}
+		if (actual.mq_msgsize < stream.msgsize)
+			stream.msgsize = actual.mq_msgsize;
+	}
+
+	if (result == 0 && batch && stream.msgsize <=
+	    (long)(sizeof(struct BatchHeader) + sizeof(uint16_t))) {
+		warnx("message size %ld is too small to batch.", stream.msgsize);
+		result = EMSGSIZE;
+	}
+
+	if (result == 0) {
+		stream.frame = malloc(stream.msgsize);
+		if (stream.frame == NULL)
+			err(1, "malloc(send)");
+		stream.used = sizeof(struct BatchHeader);
+
+		STAILQ_FOREACH(item, &contents, links) {
+			if (strcmp(item->text, "-") == 0)
+				result = stream_input(&stream);
+			else
+				result = stream_record(&stream, item->text,
+				    strlen(item->text));
+			if (result != 0)
+				break;
+		}
+		if (result == 0)
+			result = stream_flush(&stream);
+		if (batch)
+			fprintf(stderr, "send: %llu record(s) in %llu "
+			    "message(s)\n", stream.total, stream.messages);
+	}
+
+	for (long i = 0; i < opened; i++)
+		endpoint_close(&stream.endpoints[i]);
+	free(stream.frame);
+	free(stream.names);
+	free(stream.endpoints);
+	return (result);
+}
+
+/* upper bound on messages relay() holds between receiving and sending. */
+static const long relay_batch = 64;
+
+/*
+ * source: name of queue to move messages from.
+ * target: name of queue to move messages to, keeping their priority.
+ * receives until source is empty, then sends the whole batch. with -b false
+ * it stops once source is empty; otherwise it waits for more until
+ * interrupted or the -T deadline passes.
+ */
+static int
+relay(const char *source, const char *target)
+{
+	mqd_t input = open_source(source);
+
+	if (input == fail) {
+		errno_t what = errno;
+
+		warnc(what, "mq_open(relay %s)", source);
+		return (what);
+	}
+
+	mqd_t output =
+	    mq_open(target, O_WRONLY | (creation.block ? 0 : O_NONBLOCK));
+
+	if (output == fail) {
+		errno_t what = errno;
+
+		warnc(what, "mq_open(relay %s)", target);
+		mq_close(input);
+		return (what);
+	}
+
+	struct mq_attr from;
+	struct mq_attr to;
+
+	if (mq_getattr(input, &from) != 0 || mq_getattr(output, &to) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "mq_attr(relay)");
+		mq_close(output);
+		mq_close(input);
+		return (what);
+	}
+
+	/* one slot fits a message of either queue. */
+	long slot = from.mq_msgsize > to.mq_msgsize ?
+	    from.mq_msgsize : to.mq_msgsize;
+	long capacity = from.mq_maxmsg < relay_batch ?
+	    from.mq_maxmsg : relay_batch;
+	char *buffer = malloc(capacity * slot);
+	ssize_t *lengths = malloc(capacity * sizeof(ssize_t));
+	unsigned *priorities = malloc(capacity * sizeof(unsigned));
+
+	if (buffer == NULL || lengths == NULL || priorities == NULL)
+		err(1, "malloc(relay)");
+
+	struct Tally tally = {.messages = 0, .bytes = 0, .started = now_ns()};
+	int result = 0;
+
+	catch_signals();
+	while (result == 0 && !stopping) {
+		long count = 0;
+		errno_t why = 0;
+
+		while (count < capacity) {
+			ssize_t got = mq_receive(input, buffer + count * slot,
+			    slot, &priorities[count]);
+
+			if (got < 0) {
+				why = errno;
+				break;
+			}
+			lengths[count++] = got;
+		}
+		if (why != 0 && why != EAGAIN && why != EINTR) {
+			result = why;
+			warnc(result, "mq_receive(relay)");
+		}
+
+		for (long i = 0; i < count; i++) {
+			const char *text = buffer + i * slot;
+			int sent = set_deadline ?
+			    mq_timedsend(output, text, lengths[i], priorities[i],
+				&deadline) :
+			    mq_send(output, text, lengths[i], priorities[i]);
+
+			if (sent == 0) {
+				tally.messages++;
+				tally.bytes += lengths[i];
+				continue;
+			}
+			if (errno == EINTR && !stopping) {
+				i--;
+				continue;
+			}
+			if (errno == EMSGSIZE) {
+				/* stop rather than lose it. */
+				result = errno;
+				warnx("%zd byte message too large for %s.",
+				    lengths[i], target);
+			} else if (errno != EINTR) {
+				result = errno;
+				warnc(result, "mq_send(relay)");
+			}
+			/* hand undelivered messages back to the source. */
+			for (; i < count; i++) {
+				if (mq_send(input, buffer + i * slot, lengths[i],
+				    priorities[i]) != 0)
+					warn("lost %zd byte message returning to %s",
+					    lengths[i], source);
+			}
+		}
+
+		if (reporting) {
+			reporting = 0;
+			tally_report(stdout, "relay", &tally);
+		}
+
+		if (count == 0 && result == 0 && !stopping) {
+			if (!creation.block)
+				break;
+
+			long long pause = until_deadline(1000000000LL);
+
+			if (pause <= 0) {
+				result = ETIMEDOUT;
+				warnc(result, "relay");
+				break;
+			}
+			wait_queue(queue_fd(input), POLLIN, pause);
+		}
+	}
+
+	tally_report(stdout, "relay", &tally);
+	free(priorities);
+	free(lengths);
+	free(buffer);
+	mq_close(output);
+	mq_close(input);
+	return (result);
+}
+
+/*
+ * One received message shared by every tee destination that still has to
+ * deliver it. Released parcels are kept on a free list for reuse.
+ */
+struct Parcel {
+	/* destinations, plus tee itself while distributing, holding it. */
+	unsigned refs;
+	unsigned priority;
+	size_t length;
+	/* destinations that delivered or spilled it. */
+	unsigned sent;
+	/* on exit: 1 once handed back to the source, -1 if that failed. */
+	int handed;
+	/* next free parcel while on the free list. */
+	struct Parcel *next_free;
+	char text[];
+};
+
+/* one tee destination queue. */
+struct Subscriber {
+	const char *name;
+	mqd_t handle;
+	/* ring of 'backlog' parcels waiting for room in the queue. */
+	struct Parcel **ring;
+	long head;
+	long count;
+	unsigned long long delivered;
+	unsigned long long dropped;
+	unsigned long long spilled;
+	unsigned long long returned;
+};
+
+static struct Parcel *
+parcel_take(struct Parcel **pool, long slot)
+{
+	struct Parcel *parcel = *pool;
+
+	if (parcel != NULL) {
+		*pool = parcel->next_free;
+	} else {
+		parcel = malloc(sizeof(struct Parcel) + slot);
+		if (parcel == NULL)
+			err(1, "malloc(parcel)");
+	}
+	parcel->refs = 0;
+	parcel->sent = 0;
+	parcel->handed = 0;
+	return (parcel);
+}
+
+static void
+parcel_release(struct Parcel **pool, struct Parcel *parcel)
+{
+	if (parcel->refs > 0)
+		parcel->refs--;
+	if (parcel->refs == 0) {
+		parcel->next_free = *pool;
+		*pool = parcel;
+	}
+}
+
+static void
+subscriber_push(struct Subscriber *sub, struct Parcel *parcel)
+{
+	sub->ring[(sub->head + sub->count) % backlog] = parcel;
+	sub->count++;
+	parcel->refs++;
+}
+
+static struct Parcel *
+subscriber_pop(struct Subscriber *sub)
+{
+	struct Parcel *parcel = sub->ring[sub->head];
+
+	sub->head = (sub->head + 1) % backlog;
+	sub->count--;
+	return (parcel);
+}
+
+/* count a parcel the target will not get, and its large payload reference. */
+static void
+subscriber_drop(struct Subscriber *sub, const struct Parcel *parcel)
+{
+	sub->dropped++;
+	large_release(parcel->text, parcel->length, "tee");
+}
+
+/* send backlogged parcels, oldest first, until the queue is full. */
+static void
+subscriber_flush(struct Subscriber *sub, struct Parcel **pool)
+{
+	while (sub->count > 0) {
+		struct Parcel *parcel = sub->ring[sub->head];
+
+		if (mq_send(sub->handle, parcel->text, parcel->length,
+		    parcel->priority) == 0) {
+			sub->delivered++;
+			parcel->sent++;
+		} else if (errno == EAGAIN || errno == EINTR) {
+			return;
+		} else {
+			warn("mq_send(tee %s)", sub->name);
+			subscriber_drop(sub, parcel);
+		}
+		parcel_release(pool, subscriber_pop(sub));
+	}
+}
+
+/* move the whole backlog to the spill journal in one group commit. */
+static void
+subscriber_spill(struct Subscriber *sub, struct Parcel **pool)
+{
+	struct SpillItem *items = calloc(sub->count, sizeof(*items));
+	long count = sub->count;
+
+	if (items == NULL)
+		err(1, "calloc(tee spill)");
+	for (long i = 0; i < count; i++) {
+		struct Parcel *parcel = sub->ring[(sub->head + i) % backlog];
+
+		items[i].text = parcel->text;
+		items[i].length = parcel->length;
+		items[i].priority = parcel->priority;
+	}
+
+	bool spilled = spill_write(sub->name, items, count) == 0;
+
+	/* a spilled large payload keeps its reference for respill. */
+	if (spilled)
+		sub->spilled += count;
+	while (sub->count > 0) {
+		struct Parcel *parcel = subscriber_pop(sub);
+
+		if (spilled)
+			parcel->sent++;
+		else
+			subscriber_drop(sub, parcel);
+		parcel_release(pool, parcel);
+	}
+	free(items);
+}
+
+/*
+ * on exit, hand the backlog back to the source. a parcel goes back once,
+ * and only if no target has it yet; the rest are lost to this target.
+ */
+static void
+subscriber_return(struct Subscriber *sub, struct Parcel **pool, mqd_t input,
+    const char *source)
+{
+	long lost = 0;
+
+	while (sub->count > 0) {
+		struct Parcel *parcel = subscriber_pop(sub);
+		bool first = false;
+
+		if (parcel->sent == 0 && parcel->handed == 0) {
+			first = mq_send(input, parcel->text, parcel->length,
+			    parcel->priority) == 0;
+			parcel->handed = first ? 1 : -1;
+			if (!first)
+				warn("mq_send(tee %s)", source);
+		}
+		if (parcel->handed == 1) {
+			/* the source keeps the reference of the first. */
+			sub->returned++;
+			if (!first)
+				large_release(parcel->text, parcel->length, "tee");
+		} else {
+			subscriber_drop(sub, parcel);
+			lost++;
+		}
+		parcel_release(pool, parcel);
+	}
+	if (lost > 0)
+		warnx("dropping %ld backlogged message(s) for %s.", lost,
+		    sub->name);
+}
+
+/*
+ * source: name of queue to copy every message from.
+ * each message is received once and offered to every -t target from the
+ * same buffer. a target without room keeps it in a local backlog; when that
+ * backlog is full the --policy decides: block waits for room, drop discards
+ * the oldest backlogged message, spill moves the backlog to the journal.
+ * on exit, under block, the backlogs first get until the deadline to drain.
+ */
+static int
+tee_queue(const char *source)
+{
+	mqd_t input = open_source(source);
+
+	if (input == fail) {
+		errno_t what = errno;
+
+		warnc(what, "mq_open(tee %s)", source);
+		return (what);
+	}
+
+	struct mq_attr from;
+
+	if (mq_getattr(input, &from) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "mq_attr(tee)");
+		mq_close(input);
+		return (what);
+	}
+
+	long subscribers = 0;
+	struct element *item;
+
+	STAILQ_FOREACH(item, &targets, links)
+		subscribers++;
+
+	struct Subscriber *subs = calloc(subscribers, sizeof(*subs));
+	struct pollfd *waits = calloc(subscribers + 1, sizeof(*waits));
+
+	if (subs == NULL || waits == NULL)
+		err(1, "calloc(tee)");
+
+	int result = 0;
+	long opened = 0;
+
+	STAILQ_FOREACH(item, &targets, links) {
+		struct Subscriber *sub = &subs[opened];
+
+		sub->name = item->text;
+		sub->handle = mq_open(sub->name, O_WRONLY | O_NONBLOCK);
+		if (sub->handle == fail) {
+			result = errno;
+			warnc(result, "mq_open(tee %s)", sub->name);
+			break;
+		}
+		sub->ring = calloc(backlog, sizeof(struct Parcel *));
+		if (sub->ring == NULL)
+			err(1, "calloc(tee backlog)");
+		opened++;
+	}
+
+	struct Parcel *pool = NULL;
+	struct Tally tally = {.messages = 0, .bytes = 0, .started = now_ns()};
+
+	catch_signals();
+	while (result == 0 && !stopping) {
+		for (long i = 0; i < subscribers; i++)
+			subscriber_flush(&subs[i], &pool);
+
+		if (reporting) {
+			reporting = 0;
+			tally_report(stdout, "tee", &tally);
+		}
+
+		struct Parcel *parcel = parcel_take(&pool, from.mq_msgsize);
+		ssize_t got = mq_receive(input, parcel->text, from.mq_msgsize,
+		    &parcel->priority);
+
+		if (got < 0) {
+			errno_t what = errno;
+
+			parcel_release(&pool, parcel);
+			if (what == EINTR)
+				continue;
+			if (what != EAGAIN) {
+				result = what;
+				warnc(result, "mq_receive(tee)");
+				break;
+			}
+			if (!creation.block)
+				break;
+
+			long long pause = until_deadline(1000000000LL);
+
+			if (pause <= 0) {
+				result = ETIMEDOUT;
+				warnc(result, "tee");
+				break;
+			}
+
+			/* wake for a new message or room for a backlog. */
+			struct timespec interval = ns_timespec(pause);
+			nfds_t count = 0;
+
+			waits[count].fd = queue_fd(input);
+			waits[count++].events = POLLIN;
+			for (long i = 0; i < subscribers; i++) {
+				if (subs[i].count > 0) {
+					waits[count].fd = queue_fd(subs[i].handle);
+					waits[count++].events = POLLOUT;
+				}
+			}
+			ppoll(waits, count, &interval, NULL);
+			continue;
+		}
+
+		/* hold a reference of our own while distributing. */
+		parcel->refs = 1;
+		parcel->length = got;
+		tally.messages++;
+		tally.bytes += got;
+
+		/* every target receives the one large payload segment. */
+		if (subscribers > 1 && large_descriptor(parcel->text, got)) {
+			struct LargeDescriptor descriptor;
+
+			memcpy(&descriptor, parcel->text, sizeof(descriptor));
+
+			int refer = large_refer(&descriptor, subscribers - 1);
+
+			if (refer != 0)
+				warnc(refer, "shm_open(tee %.*s)",
+				    (int)sizeof(descriptor.name),
+				    descriptor.name);
+		}
+
+		for (long i = 0; i < subscribers; i++) {
+			struct Subscriber *sub = &subs[i];
+
+			if (sub->count == 0) {
+				if (mq_send(sub->handle, parcel->text, got,
+				    parcel->priority) == 0) {
+					sub->delivered++;
+					parcel->sent++;
+					continue;
+				}
+				if (errno != EAGAIN) {
+					warn("mq_send(tee %s)", sub->name);
+					subscriber_drop(sub, parcel);
+					continue;
+				}
+			}
+
+			while (sub->count == backlog && !stopping) {
+				if (slow_policy == SLOW_DROP) {
+					struct Parcel *oldest =
+					    subscriber_pop(sub);
+
+					subscriber_drop(sub, oldest);
+					parcel_release(&pool, oldest);
+				} else if (slow_policy == SLOW_SPILL) {
+					subscriber_spill(sub, &pool);
+				} else {
+					long long pause =
+					    until_deadline(1000000000LL);
+
+					if (pause <= 0) {
+						result = ETIMEDOUT;
+						warnc(result, "tee %s", sub->name);
+						break;
+					}
+					wait_queue(queue_fd(sub->handle), POLLOUT,
+					    pause);
+					subscriber_flush(sub, &pool);
+				}
+			}
+
+			if (sub->count < backlog)
+				subscriber_push(sub, parcel);
+			else
+				subscriber_drop(sub, parcel);
+		}
+		parcel_release(&pool, parcel);
+	}
+
+	/* under block the backlogs get until the -T deadline to drain. */
+	while (result == 0 && !stopping && slow_policy == SLOW_BLOCK) {
+		nfds_t count = 0;
+
+		for (long i = 0; i < subscribers; i++) {
+			subscriber_flush(&subs[i], &pool);
+			if (subs[i].count > 0) {
+				waits[count].fd = queue_fd(subs[i].handle);
+				waits[count++].events = POLLOUT;
+			}
+		}
+		if (count == 0)
+			break;
+
+		if (reporting) {
+			reporting = 0;
+			tally_report(stdout, "tee", &tally);
+		}
+
+		long long pause = until_deadline(1000000000LL);
+
+		if (pause <= 0) {
+			result = ETIMEDOUT;
+			warnc(result, "tee");
+			break;
+		}
+
+		struct timespec interval = ns_timespec(pause);
+
+		ppoll(waits, count, &interval, NULL);
+	}
+
+	/* whatever is still backlogged is spilled or handed back. */
+	for (long i = 0; i < opened; i++) {
+		struct Subscriber *sub = &subs[i];
+
+		subscriber_flush(sub, &pool);
+		if (sub->count > 0 && spill_dir != NULL)
+			subscriber_spill(sub, &pool);
+		subscriber_return(sub, &pool, input, source);
+	}
+
+	tally_report(stdout, "tee", &tally);
+	for (long i = 0; i < opened; i++) {
+		struct Subscriber *sub = &subs[i];
+
+		fprintf(stdout, "tee: %s delivered %llu, dropped %llu, "
+		    "spilled %llu, returned %llu\n", sub->name, sub->delivered,
+		    sub->dropped, sub->spilled, sub->returned);
+		if (sub->dropped > 0 && result == 0)
+			result = EAGAIN;
+		free(sub->ring);
+		mq_close(sub->handle);
+	}
+
+	while (pool != NULL) {
+		struct Parcel *next = pool->next_free;
+
+		free(pool);
+		pool = next;
+	}
+	free(waits);
+	free(subs);
+	mq_close(input);
+	return (result);
+}
+
+/* messages merge() reads ahead from each input queue. */
+static const long merge_lookahead = 4;
+
+/* one read-ahead message in the merge() heap. */
+struct Pending {
+	unsigned priority;
+	/* arrival order; breaks priority ties first in, first out. */
+	unsigned long long sequence;
+	/* index of the input queue it came from. */
+	long input;
+	size_t length;
+	char *text;
+};
+
+/* merge() input queue. */
+struct Source {
+	const char *name;
+	mqd_t handle;
+	long msgsize;
+	/* lookahead slots, and the stack of those not holding a message. */
+	char *slots;
+	char **free;
+	long free_count;
+	/* true once the queue reported empty. cleared when it turns readable. */
+	bool dry;
+};
+
+/* true if a should leave the heap before b. */
+static bool
+pending_before(const struct Pending *a, const struct Pending *b)
+{
+	if (a->priority != b->priority)
+		return (a->priority > b->priority);
+	return (a->sequence < b->sequence);
+}
+
+static void
+heap_push(struct Pending *heap, long *count, struct Pending item)
+{
+	long at = (*count)++;
+
+	while (at > 0) {
+		long parent = (at - 1) / 2;
+
+		if (!pending_before(&item, &heap[parent]))
+			break;
+		heap[at] = heap[parent];
+		at = parent;
+	}
+	heap[at] = item;
+}
+
+static struct Pending
+heap_pop(struct Pending *heap, long *count)
+{
+	struct Pending top = heap[0];
+	struct Pending last = heap[--(*count)];
+	long at = 0;
+
+	for (;;) {
+		long child = 2 * at + 1;
+
+		if (child >= *count)
+			break;
+		if (child + 1 < *count &&
+		    pending_before(&heap[child + 1], &heap[child]))
+			child++;
+		if (!pending_before(&heap[child], &last))
+			break;
+		heap[at] = heap[child];
+		at = child;
+	}
+	if (*count > 0)
+		heap[at] = last;
+	return (top);
+}
+
+/*
+ * target: name of queue receiving the merged stream of every -q input.
+ * each input is read ahead by a few messages and the highest priority of
+ * those, oldest first, is sent next, so priority order holds across inputs
+ * as it does within one queue.
+ */
+static int
+merge(const char *target)
+{
+	long inputs = 0;
+	struct element *item;
+
+	STAILQ_FOREACH(item, &queues, links)
+		inputs++;
+
+	struct Source *sources = calloc(inputs, sizeof(*sources));
+	struct Pending *heap = calloc(inputs * merge_lookahead, sizeof(*heap));
+	struct pollfd *waits = calloc(inputs, sizeof(*waits));
+	long *owners = calloc(inputs, sizeof(*owners));
+
+	if (sources == NULL || heap == NULL || waits == NULL || owners == NULL)
+		err(1, "calloc(merge)");
+
+	int result = 0;
+	long opened = 0;
+
+	STAILQ_FOREACH(item, &queues, links) {
+		struct Source *source = &sources[opened];
+		struct mq_attr actual;
+
+		source->name = item->text;
+		source->handle = open_source(source->name);
+		if (source->handle == fail) {
+			result = errno;
+			warnc(result, "mq_open(merge %s)", source->name);
+			break;
+		}
+		opened++;
+		if (mq_getattr(source->handle, &actual) != 0) {
+			result = errno;
+			warnc(result, "mq_attr(merge %s)", source->name);
+			break;
+		}
+		source->msgsize = actual.mq_msgsize;
+		source->slots = malloc(merge_lookahead * source->msgsize);
+		source->free = calloc(merge_lookahead, sizeof(char *));
+		if (source->slots == NULL || source->free == NULL)
+			err(1, "malloc(merge slots)");
+		for (long i = 0; i < merge_lookahead; i++)
+			source->free[i] = source->slots + i * source->msgsize;
+		source->free_count = merge_lookahead;
+	}
+
+	mqd_t output = fail;
+
+	if (result == 0) {
+		output = mq_open(target,
+		    O_WRONLY | (creation.block ? 0 : O_NONBLOCK));
+		if (output == fail) {
+			result = errno;
+			warnc(result, "mq_open(merge %s)", target);
+		}
+	}
+
+	long count = 0;
+	unsigned long long sequence = 0;
+	struct Tally tally = {.messages = 0, .bytes = 0, .started = now_ns()};
+
+	catch_signals();
+	while (result == 0 && !stopping) {
+		/* notice dry inputs that turned readable, in one call. */
+		nfds_t watched = 0;
+
+		for (long i = 0; i < inputs; i++) {
+			if (sources[i].dry && sources[i].free_count > 0) {
+				waits[watched].fd = queue_fd(sources[i].handle);
+				waits[watched].events = POLLIN;
+				waits[watched].revents = 0;
+				owners[watched++] = i;
+			}
+		}
+		if (watched > 0 && count > 0) {
+			struct timespec now = {0, 0};
+
+			ppoll(waits, watched, &now, NULL);
+			for (nfds_t i = 0; i < watched; i++) {
+				if (waits[i].revents != 0 || waits[i].fd < 0)
+					sources[owners[i]].dry = false;
+			}
+		}
+
+		/* top up every input's lookahead. */
+		for (long i = 0; i < inputs; i++) {
+			struct Source *source = &sources[i];
+
+			while (!source->dry && source->free_count > 0) {
+				char *slot = source->free[source->free_count - 1];
+				unsigned q_priority = 0;
+				ssize_t got = mq_receive(source->handle, slot,
+				    source->msgsize, &q_priority);
+
+				if (got < 0) {
+					if (errno != EAGAIN && errno != EINTR) {
+						result = errno;
+						warnc(result, "mq_receive(merge %s)",
+						    source->name);
+					}
+					source->dry = true;
+					break;
+				}
+				source->free_count--;
+				heap_push(heap, &count, (struct Pending){
+				    .priority = q_priority,
+				    .sequence = sequence++,
+				    .input = i,
+				    .length = got,
+				    .text = slot});
+			}
+		}
+
+		if (reporting) {
+			reporting = 0;
+			tally_report(stdout, "merge", &tally);
+		}
+
+		if (count == 0) {
+			if (!creation.block || result != 0)
+				break;
+
+			long long pause = until_deadline(1000000000LL);
+
+			if (pause <= 0) {
+				result = ETIMEDOUT;
+				warnc(result, "merge");
+				break;
+			}
+
+			struct timespec interval = ns_timespec(pause);
+
+			for (long i = 0; i < inputs; i++) {
+				waits[i].fd = queue_fd(sources[i].handle);
+				waits[i].events = POLLIN;
+				waits[i].revents = 0;
+			}
+			ppoll(waits, inputs, &interval, NULL);
+			for (long i = 0; i < inputs; i++)
+				sources[i].dry = false;
+			continue;
+		}
+
+		struct Pending top = heap[0];
+		int sent = set_deadline ?
+		    mq_timedsend(output, top.text, top.length, top.priority,
+			&deadline) :
+		    mq_send(output, top.text, top.length, top.priority);
+
+		if (sent != 0 && errno == EINTR && !stopping)
+			continue;
+		if (sent != 0) {
+			/* stop rather than lose it; it goes back below. */
+			if (errno == EMSGSIZE) {
+				result = errno;
+				warnx("%zu byte message too large for %s.",
+				    top.length, target);
+			} else if (errno != EINTR) {
+				result = errno;
+				warnc(result, "mq_send(merge)");
+			}
+			break;
+		}
+		tally.messages++;
+		tally.bytes += top.length;
+		heap_pop(heap, &count);
+		sources[top.input].free[sources[top.input].free_count++] =
+		    top.text;
+	}
+
+	/* hand read-ahead messages back to the queue they came from. */
+	while (count > 0) {
+		struct Pending left = heap_pop(heap, &count);
+
+		if (mq_send(sources[left.input].handle, left.text, left.length,
+		    left.priority) != 0)
+			warn("lost %zu byte message returning to %s",
+			    left.length, sources[left.input].name);
+	}
+
+	tally_report(stdout, "merge", &tally);
+	if (output != fail)
+		mq_close(output);
+	for (long i = 0; i < opened; i++) {
+		free(sources[i].free);
+		free(sources[i].slots);
+		mq_close(sources[i].handle);
+	}
+	free(owners);
+	free(waits);
+	free(heap);
+	free(sources);
+	return (result);
+}
+
+/* rule number meaning no rule matched. */
+static const int route_none = INT_MAX;
+
+/* node of the route prefix trie; child zero means no child. */
+struct TrieNode {
+	int child[UCHAR_MAX + 1];
+	/* lowest numbered prefix rule ending here. */
+	int rule;
+};
+
+/* byte rules sharing one payload offset. */
+struct ByteTable {
+	long offset;
+	/* lowest numbered rule for each byte value. */
+	int rule[UCHAR_MAX + 1];
+};
+
+/*
+ * The rules compiled into lookup tables. Matching costs one table lookup
+ * for the priority, one trie step per byte of the longest prefix, and one
+ * lookup per distinct byte offset, however many rules there are. Every
+ * table holds the lowest matching rule number so the first rule given wins.
+ */
+struct Router {
+	/* one entry per priority. */
+	int *by_priority;
+	struct TrieNode *trie;
+	int trie_count;
+	struct ByteTable *bytes;
+	long byte_count;
+	/* destination queues; rule i goes to destination target[i]. */
+	long *target;
+	const char **names;
+	mqd_t *handles;
+	unsigned long long *routed;
+	long destinations;
+	/* destination of messages no rule matches. */
+	long fallback;
+};
+
+/* Return the destination index for name, adding it when new. */
+static long
+router_destination(struct Router *router, const char *name)
+{
+	for (long i = 0; i < router->destinations; i++) {
+		if (strcmp(router->names[i], name) == 0)
+			return (i);
+	}
+	router->names[router->destinations] = name;
+	return (router->destinations++);
+}
+
+static void
+router_compile(struct Router *router)
+{
+	router->by_priority = malloc(MQ_PRIO_MAX * sizeof(int));
+	router->target = calloc(rule_count + 1, sizeof(long));
+	router->names = calloc(rule_count + 1, sizeof(char *));
+	router->bytes = calloc(rule_count + 1, sizeof(struct ByteTable));
+
+	/* the root plus at most one node per prefix byte. */
+	int nodes = 1;
+
+	for (long r = 0; r < rule_count; r++) {
+		if (rules[r].kind == RULE_PREFIX)
+			nodes += rules[r].prefix_length;
+	}
+	router->trie = calloc(nodes, sizeof(struct TrieNode));
+	if (router->by_priority == NULL || router->target == NULL ||
+	    router->names == NULL || router->bytes == NULL ||
+	    router->trie == NULL)
+		err(1, "malloc(router)");
+
+	for (long p = 0; p < MQ_PRIO_MAX; p++)
+		router->by_priority[p] = route_none;
+	router->trie[0].rule = route_none;
+	router->trie_count = 1;
+
+	/* walk backwards so earlier rules overwrite later ones. */
+	for (long r = rule_count - 1; r >= 0; r--) {
+		const struct Rule *rule = &rules[r];
+
+		if (rule->kind == RULE_PRIORITY) {
+			for (long p = rule->low; p <= rule->high; p++)
+				router->by_priority[p] = r;
+		} else if (rule->kind == RULE_PREFIX) {
+			int at = 0;
+
+			for (size_t i = 0; i < rule->prefix_length; i++) {
+				unsigned char c = rule->prefix[i];
+
+				if (router->trie[at].child[c] == 0) {
+					int fresh = router->trie_count++;
+
+					router->trie[fresh].rule = route_none;
+					router->trie[at].child[c] = fresh;
+				}
+				at = router->trie[at].child[c];
+			}
+			router->trie[at].rule = r;
+		} else {
+			struct ByteTable *table = NULL;
+
+			for (long i = 0; i < router->byte_count; i++) {
+				if (router->bytes[i].offset == rule->offset)
+					table = &router->bytes[i];
+			}
+			if (table == NULL) {
+				table = &router->bytes[router->byte_count++];
+				table->offset = rule->offset;
+				for (int v = 0; v <= UCHAR_MAX; v++)
+					table->rule[v] = route_none;
+			}
+			table->rule[rule->value] = r;
+		}
+	}
+
+	for (long r = 0; r < rule_count; r++)
+		router->target[r] = router_destination(router, rules[r].target);
+	router->fallback = router_destination(router, fallback);
+}
+
+/* Return the destination index for a message: its rule's, or --default. */
+static long
+router_match(const struct Router *router, const char *text, size_t length,
+    unsigned q_priority)
+{
+	int best = router->by_priority[q_priority];
+	int at = 0;
+
+	for (size_t i = 0; i < length; i++) {
+		at = router->trie[at].child[(unsigned char)text[i]];
+		if (at == 0)
+			break;
+		if (router->trie[at].rule < best)
+			best = router->trie[at].rule;
+	}
+
+	for (long i = 0; i < router->byte_count; i++) {
+		const struct ByteTable *table = &router->bytes[i];
+
+		if (table->offset < (long)length) {
+			int rule = table->rule[(unsigned char)text[table->offset]];
+
+			if (rule < best)
+				best = rule;
+		}
+	}
+
+	return (best == route_none ? router->fallback : router->target[best]);
+}
+
+/*
+ * source: name of queue whose messages are dispatched by the -r rules.
+ * the first matching rule picks the destination queue. messages no rule
+ * matches go to the required --default queue.
+ */
+static int
+route(const char *source)
+{
+	mqd_t input = open_source(source);
+
+	if (input == fail) {
+		errno_t what = errno;
+
+		warnc(what, "mq_open(route %s)", source);
+		return (what);
+	}
+
+	struct mq_attr from;
+
+	if (mq_getattr(input, &from) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "mq_attr(route)");
+		mq_close(input);
+		return (what);
+	}
+
+	struct Router router = {.byte_count = 0, .destinations = 0};
+
+	router_compile(&router);
+	router.handles = calloc(router.destinations, sizeof(mqd_t));
+	router.routed = calloc(router.destinations,
+	    sizeof(unsigned long long));
+	if (router.handles == NULL || router.routed == NULL)
+		err(1, "calloc(route)");
+
+	int result = 0;
+	long opened = 0;
+
+	for (; opened < router.destinations; opened++) {
+		router.handles[opened] = mq_open(router.names[opened],
+		    O_WRONLY | (creation.block ? 0 : O_NONBLOCK));
+		if (router.handles[opened] == fail) {
+			result = errno;
+			warnc(result, "mq_open(route %s)", router.names[opened]);
+			break;
+		}
+	}
+
+	char *text = malloc(from.mq_msgsize);
+
+	if (text == NULL)
+		err(1, "malloc(route)");
+
+	struct Tally tally = {.messages = 0, .bytes = 0, .started = now_ns()};
+
+	catch_signals();
+	while (result == 0 && !stopping) {
+		unsigned q_priority = 0;
+		ssize_t got = mq_receive(input, text, from.mq_msgsize,
+		    &q_priority);
+
+		if (reporting) {
+			reporting = 0;
+			tally_report(stdout, "route", &tally);
+		}
+
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				result = errno;
+				warnc(result, "mq_receive(route)");
+				break;
+			}
+			if (!creation.block)
+				break;
+
+			long long pause = until_deadline(1000000000LL);
+
+			if (pause <= 0) {
+				result = ETIMEDOUT;
+				warnc(result, "route");
+				break;
+			}
+			wait_queue(queue_fd(input), POLLIN, pause);
+			continue;
+		}
+
+		long to = router_match(&router, text, got, q_priority);
+
+		tally.messages++;
+		tally.bytes += got;
+
+		int sent;
+
+		do {
+			sent = set_deadline ?
+			    mq_timedsend(router.handles[to], text, got, q_priority,
+				&deadline) :
+			    mq_send(router.handles[to], text, got, q_priority);
+		} while (sent != 0 && errno == EINTR && !stopping);
+
+		if (sent == 0) {
+			router.routed[to]++;
+		} else {
+			/* stop rather than lose it. */
+			if (errno == EMSGSIZE) {
+				result = errno;
+				warnx("%zd byte message too large for %s.", got,
+				    router.names[to]);
+			} else if (errno != EINTR) {
+				result = errno;
+				warnc(result, "mq_send(route %s)", router.names[to]);
+			}
+			if (mq_send(input, text, got, q_priority) != 0)
+				warn("lost %zd byte message returning to %s", got,
+				    source);
+			tally.messages--;
+			tally.bytes -= got;
+		}
+	}
+
+	tally_report(stdout, "route", &tally);
+	for (long i = 0; i < router.destinations; i++)
+		fprintf(stdout, "route: %s received %llu\n", router.names[i],
+		    router.routed[i]);
+
+	for (long i = 0; i < opened; i++)
+		mq_close(router.handles[i]);
+	free(text);
+	free(router.routed);
+	free(router.handles);
+	free(router.trie);
+	free(router.bytes);
+	free(router.names);
+	free(router.target);
+	free(router.by_priority);
+	mq_close(input);
+	return (result);
+}
+
+/* state shared by the consume() worker threads. */
+struct Consume {
+	/* every -q queue, opened non-blocking. */
+	mqd_t *handles;
+	const char **names;
+	long count;
+	long threads;
+	/* largest message size of any queue. */
+	long msgsize;
+	/* read end of the wake pipe. */
+	int wake;
+	/* SIGINFO requests seen; each worker reports once per request. */
+	atomic_uint reports;
+	/* guards result. */
+	pthread_mutex_t lock;
+	int result;
+};
+
+/* one consume() worker thread. */
+struct Worker {
+	struct Consume *shared;
+	long index;
+	pthread_t thread;
+	struct Tally tally;
+	/* messages taken from queues owned by another worker. */
+	unsigned long long stolen;
+	/* shared->reports when this worker last reported. */
+	unsigned reported;
+};
+
+static void
+consume_fail(struct Consume *shared, int result)
+{
+	pthread_mutex_lock(&shared->lock);
+	shared->result = result;
+	pthread_mutex_unlock(&shared->lock);
+	stopping = 1;
+	(void)write(wake_fd, "", 1);
+}
+
+/*
+ * Take one message from queue i and write it to standard output.
+ * Returns true if a message was taken.
+ */
+static bool
+consume_one(struct Worker *worker, long i, char *text)
+{
+	struct Consume *shared = worker->shared;
+	unsigned q_priority = 0;
+	ssize_t got = mq_receive(shared->handles[i], text, shared->msgsize,
+	    &q_priority);
+
+	if (got < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			errno_t what = errno;
+
+			warnc(what, "mq_receive(consume %s)", shared->names[i]);
+			consume_fail(shared, what);
+		}
+		return (false);
+	}
+
+	flockfile(stdout);
+	fprintf(stdout, "[%u]: %-*.*s\n", q_priority, (int)got, (int)got,
+	    text);
+	funlockfile(stdout);
+
+	worker->tally.messages++;
+	worker->tally.bytes += got;
+	return (true);
+}
+
+/* report the worker's tally once for each SIGINFO. */
+static void
+consume_report(struct Worker *worker)
+{
+	struct Consume *shared = worker->shared;
+
+	if (reporting) {
+		reporting = 0;
+		atomic_fetch_add(&shared->reports, 1);
+	}
+
+	unsigned reports = atomic_load(&shared->reports);
+
+	if (worker->reported != reports) {
+		char verb[32];
+
+		worker->reported = reports;
+		snprintf(verb, sizeof(verb), "consume[%ld]", worker->index);
+		tally_report(stderr, verb, &worker->tally);
+	}
+}
+
+/*
+ * Worker loop. Visits the queues it owns (every threads'th queue starting
+ * at its own index) round robin; when they are all empty it steals from
+ * the others; when everything is empty it sleeps in its poller, which
+ * watches all queues and the wake pipe.
+ */
+static void *
+consume_worker(void *context)
+{
+	struct Worker *worker = context;
+	struct Consume *shared = worker->shared;
+	char *text = malloc(shared->msgsize);
+	long *ready = calloc(shared->count + 1, sizeof(*ready));
+	struct poller *poller = poller_create(shared->count + 1);
+
+	if (text == NULL || ready == NULL)
+		err(1, "malloc(consume)");
+	if (poller == NULL)
+		err(1, "%s(consume)", poller_kind);
+
+	/* the wake pipe's cookie is shared->count. */
+	for (long i = 0; i <= shared->count; i++) {
+		int fd = i < shared->count ? queue_fd(shared->handles[i]) :
+		    shared->wake;
+
+		if (fd >= 0 && poller_add(poller, fd, i) != 0) {
+			errno_t what = errno;
+
+			warnc(what, "%s(consume)", poller_kind);
+			consume_fail(shared, what);
+			break;
+		}
+	}
+
+	while (!stopping) {
+		bool busy = false;
+
+		consume_report(worker);
+		for (long i = worker->index; i < shared->count;
+		    i += shared->threads)
+			busy |= consume_one(worker, i, text);
+		if (busy)
+			continue;
+
+		for (long k = 1; k < shared->count && !busy; k++) {
+			long i = (worker->index + k) % shared->count;
+
+			if (i % shared->threads != worker->index &&
+			    consume_one(worker, i, text)) {
+				worker->stolen++;
+				busy = true;
+			}
+		}
+		if (busy)
+			continue;
+
+		if (!creation.block)
+			break;
+
+		long long pause = until_deadline(1000000000LL);
+
+		if (pause <= 0) {
+			consume_fail(shared, ETIMEDOUT);
+			break;
+		}
+
+		int found = poller_wait(poller, ready, shared->count + 1, pause);
+		bool woken = false;
+
+		for (int i = 0; i < found; i++)
+			woken |= ready[i] == shared->count;
+
+		/*
+		 * a SIGINFO byte must not keep the pipe readable; a stop byte
+		 * stays, to wake every worker.
+		 */
+		if (woken && !stopping) {
+			char drain[16];
+
+			while (read(shared->wake, drain, sizeof(drain)) > 0)
+				continue;
+		}
+	}
+
+	poller_destroy(poller);
+	free(ready);
+	free(text);
+	return (NULL);
+}
+
+/* the signal mq_notify(2) raises for consume --notify. */
+#define NOTIFY_SIGNAL SIGRTMIN
+/* consume --notify looks at every queue this often regardless. */
+static const long long notify_sweep_ns = 1000000000LL;
+
+/*
+ * Ask for a signal when queue i turns non-empty, then drain it.
+ * The order matters. A queue drained first and armed after would lose a
+ * message arriving in between: the queue is then no longer empty, so it
+ * never turns non-empty and the signal never comes. Armed first, such a
+ * message is either taken by the drain or signalled.
+ * EBUSY means the queue is still armed, by us or by another process.
+ */
+static void
+consume_arm(struct Worker *worker, long i, char *text, bool first)
+{
+	struct Consume *shared = worker->shared;
+	struct sigevent event = {
+		.sigev_notify = SIGEV_SIGNAL,
+		.sigev_signo = NOTIFY_SIGNAL,
+		.sigev_value.sival_int = i
+	};
+
+	if (mq_notify(shared->handles[i], &event) != 0) {
+		errno_t what = errno;
+
+		if (what != EBUSY) {
+			warnc(what, "mq_notify(consume %s)", shared->names[i]);
+			consume_fail(shared, what);
+			return;
+		}
+		if (first)
+			warnx("queue [%s] notifies another process; "
+			    "looking every %lld s.", shared->names[i],
+			    notify_sweep_ns / 1000000000LL);
+	}
+	while (!stopping && consume_one(worker, i, text))
+		continue;
+}
+
+/*
+ * consume --notify. One thread sleeps in sigtimedwait(2) until a queue
+ * turns non-empty, then drains that queue. Idle queues cost no thread and
+ * no descriptor poll. Signals can be lost to a full signal queue, so
+ * every queue is armed and drained again every notify_sweep_ns, however
+ * busy the others keep the thread.
+ */
+static void
+consume_notify(struct Worker *worker)
+{
+	struct Consume *shared = worker->shared;
+	char *text = malloc(shared->msgsize);
+	sigset_t wanted;
+
+	if (text == NULL)
+		err(1, "malloc(consume)");
+
+	/* stays blocked: a late notification must not kill the process. */
+	sigemptyset(&wanted);
+	sigaddset(&wanted, NOTIFY_SIGNAL);
+	pthread_sigmask(SIG_BLOCK, &wanted, NULL);
+
+	for (long i = 0; i < shared->count && !stopping; i++)
+		consume_arm(worker, i, text, true);
+
+	long long swept = now_ns();
+
+	while (!stopping && creation.block) {
+		/* SIGINFO interrupts sigtimedwait() too. */
+		consume_report(worker);
+
+		long long quiet = swept + notify_sweep_ns - now_ns();
+
+		if (quiet <= 0) {
+			for (long i = 0; i < shared->count && !stopping; i++)
+				consume_arm(worker, i, text, false);
+			swept = now_ns();
+			continue;
+		}
+
+		long long pause = until_deadline(quiet);
+
+		if (pause <= 0) {
+			consume_fail(shared, ETIMEDOUT);
+			break;
+		}
+
+		struct timespec interval = ns_timespec(pause);
+		siginfo_t info;
+		int number = sigtimedwait(&wanted, &info, &interval);
+
+		if (number == NOTIFY_SIGNAL) {
+			long i = info.si_value.sival_int;
+
+			if (i >= 0 && i < shared->count)
+				consume_arm(worker, i, text, false);
+		}
+	}
+
+	for (long i = 0; i < shared->count; i++)
+		mq_notify(shared->handles[i], NULL);
+	free(text);
+}
+
+/* one long-lived consume --exec handler process. */
+struct Handler {
+	pid_t pid;
+	/* write end of the handler's standard input. */
+	int input;
+	/* read end of the handler's standard output. */
+	int output;
+	bool alive;
+	bool busy;
+	/* the message in flight and its queue, to hand back if it dies. */
+	long queue;
+	char *payload;
+	ssize_t length;
+	unsigned priority;
+	/* CLOCK_REALTIME nanoseconds the handler was started. */
+	long long spawned;
+	/* CLOCK_REALTIME nanoseconds the message in flight was sent. */
+	long long dispatched;
+	unsigned long long messages;
+	long long busy_ns;
+	long long slowest_ns;
+	/* partial completion line. */
+	char line[LINE_MAX];
+	size_t used;
+	int status;
+};
+
+/* start a handler running --exec under sh(1). */
+static bool
+handler_spawn(struct Handler *handler)
+{
+	int in[2];
+	int out[2];
+
+	if (pipe2(in, O_CLOEXEC) != 0)
+		return (false);
+	if (pipe2(out, O_CLOEXEC) != 0) {
+		close(in[0]);
+		close(in[1]);
+		return (false);
+	}
+
+	handler->pid = fork();
+	if (handler->pid == 0) {
+		/* dup2 clears close-on-exec on the copies. */
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		execl("/bin/sh", "sh", "-c", exec_command, (char *)NULL);
+		_exit(127);
+	}
+
+	close(in[0]);
+	close(out[1]);
+	if (handler->pid < 0) {
+		close(in[1]);
+		close(out[0]);
+		return (false);
+	}
+	handler->input = in[1];
+	handler->output = out[0];
+	handler->alive = true;
+	handler->busy = false;
+	handler->spawned = now_ns();
+	handler->messages = 0;
+	handler->busy_ns = 0;
+	handler->slowest_ns = 0;
+	handler->used = 0;
+	return (true);
+}
+
+static bool
+write_all(int fd, const char *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t done = write(fd, data, length);
+
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return (false);
+		data += done;
+		length -= done;
+	}
+	return (true);
+}
+
+/*
+ * Read what the handler wrote. Each complete line marks its message done
+ * and is copied to standard output unless empty.
+ * Returns false once the handler closed its standard output.
+ */
+static bool
+handler_collect(struct Handler *handler)
+{
+	ssize_t got = read(handler->output, handler->line + handler->used,
+	    sizeof(handler->line) - handler->used);
+
+	if (got < 0)
+		return (errno == EINTR || errno == EAGAIN);
+	if (got == 0)
+		return (false);
+	handler->used += got;
+
+	char *end;
+
+	while ((end = memchr(handler->line, '\n', handler->used)) != NULL) {
+		size_t span = end - handler->line + 1;
+
+		if (span > 1)
+			fwrite(handler->line, 1, span, stdout);
+		if (handler->busy) {
+			long long spent = now_ns() - handler->dispatched;
+
+			handler->busy = false;
+			handler->messages++;
+			handler->busy_ns += spent;
+			if (spent > handler->slowest_ns)
+				handler->slowest_ns = spent;
+		}
+		handler->used -= span;
+		memmove(handler->line, end + 1, handler->used);
+	}
+
+	/* a line longer than the buffer still counts as one completion. */
+	if (handler->used == sizeof(handler->line)) {
+		fwrite(handler->line, 1, handler->used, stdout);
+		handler->used = 0;
+	}
+	fflush(stdout);
+	return (true);
+}
+
+/* report the exit status and work of handler w. */
+static void
+handler_report(long w, const struct Handler *handler)
+{
+	double mean = handler->messages == 0 ? 0 :
+	    handler->busy_ns / 1e6 / handler->messages;
+
+	if (WIFSIGNALED(handler->status))
+		fprintf(stderr, "consume: handler %ld pid %d killed by "
+		    "signal %d", w, (int)handler->pid,
+		    WTERMSIG(handler->status));
+	else
+		fprintf(stderr, "consume: handler %ld pid %d exit %d",
+		    w, (int)handler->pid, WEXITSTATUS(handler->status));
+	fprintf(stderr, ": %llu message(s), busy %.3f s, "
+	    "mean %.3f ms, slowest %.3f ms\n", handler->messages,
+	    handler->busy_ns / 1e9, mean, handler->slowest_ns / 1e6);
+}
+
+/* a handler that exits this soon, having finished nothing, stays dead. */
+static const long long handler_settle_ns = 1000000000LL;
+
+/*
+ * Handler w stopped taking input or hit end of file. Put the message it
+ * held back in its queue, reap it, and start another in its place, unless
+ * it died before it got going, which a new one would likely repeat.
+ */
+static void
+handler_restart(long w, struct Handler *handler, const mqd_t *handles,
+    const char **names)
+{
+	if (handler->busy)
+		hand_back(handles[handler->queue], names[handler->queue],
+		    handler->payload, handler->length, handler->priority);
+	handler->busy = false;
+	handler->alive = false;
+
+	close(handler->input);
+	while (handler_collect(handler))
+		;
+	close(handler->output);
+	while (waitpid(handler->pid, &handler->status, 0) < 0 &&
+	    errno == EINTR)
+		;
+	handler_report(w, handler);
+
+	if (handler->messages == 0 &&
+	    now_ns() - handler->spawned < handler_settle_ns) {
+		warnx("handler %ld exited at once; not restarted.", w);
+		return;
+	}
+	if (!handler_spawn(handler))
+		warn("fork(consume)");
+}
+
+/*
+ * Drain every -q queue through --workers long-lived --exec handlers.
+ * A message is framed as a decimal "length priority" line followed by the
+ * payload and goes to an idle handler; the handler writes one line to its
+ * standard output when done. Messages are only received while a handler is
+ * idle, so slow handlers hold messages back in the queue.
+ */
+static int
+consume_exec(void)
+{
+	long count = 0;
+	struct element *item;
+
+	STAILQ_FOREACH(item, &queues, links)
+		count++;
+
+	mqd_t *handles = calloc(count, sizeof(mqd_t));
+	const char **names = calloc(count, sizeof(char *));
+	struct Handler *handlers = calloc(workers, sizeof(struct Handler));
+	struct pollfd *waits = calloc(count + workers, sizeof(struct pollfd));
+
+	if (handles == NULL || names == NULL || handlers == NULL ||
+	    waits == NULL)
+		err(1, "calloc(consume)");
+
+	int result = 0;
+	long opened = 0;
+	long msgsize = 0;
+
+	STAILQ_FOREACH(item, &queues, links) {
+		struct mq_attr actual;
+
+		names[opened] = item->text;
+		handles[opened] = open_source(item->text);
+		if (handles[opened] == fail) {
+			result = errno;
+			warnc(result, "mq_open(consume %s)", item->text);
+			break;
+		}
+		opened++;
+		if (mq_getattr(handles[opened - 1], &actual) != 0) {
+			result = errno;
+			warnc(result, "mq_attr(consume %s)", item->text);
+			break;
+		}
+		if (actual.mq_msgsize > msgsize)
+			msgsize = actual.mq_msgsize;
+	}
+
+	long spawned = 0;
+
+	for (long w = 0; w < workers; w++) {
+		handlers[w].payload = malloc(msgsize);
+		if (handlers[w].payload == NULL)
+			err(1, "malloc(consume)");
+	}
+
+	/* a handler that exits early must not kill us with SIGPIPE. */
+	signal(SIGPIPE, SIG_IGN);
+	fflush(stdout);
+	for (; result == 0 && spawned < workers; spawned++) {
+		if (!handler_spawn(&handlers[spawned])) {
+			result = errno;
+			warnc(result, "fork(consume)");
+			break;
+		}
+	}
+
+	catch_signals();
+	long next = 0;
+
+	while (result == 0 && !stopping) {
+		long idle = -1;
+		long alive = 0;
+		long busy = 0;
+
+		for (long w = 0; w < spawned; w++) {
+			if (!handlers[w].alive)
+				continue;
+			alive++;
+			if (handlers[w].busy)
+				busy++;
+			else if (idle < 0)
+				idle = w;
+		}
+		if (alive == 0) {
+			warnx("every --exec handler has exited.");
+			result = ECHILD;
+			break;
+		}
+
+		/* hand a message to an idle handler. */
+		if (idle >= 0) {
+			bool taken = false;
+
+			struct Handler *handler = &handlers[idle];
+
+			for (long k = 0; k < count && !taken && result == 0;
+			    k++) {
+				long i = (next + k) % count;
+				ssize_t got = mq_receive(handles[i],
+				    handler->payload, msgsize, &handler->priority);
+
+				if (got < 0) {
+					if (errno != EAGAIN && errno != EINTR) {
+						result = errno;
+						warnc(result,
+						    "mq_receive(consume %s)",
+						    names[i]);
+					}
+					continue;
+				}
+				taken = true;
+				next = (i + 1) % count;
+
+				char header[64];
+				int size = snprintf(header, sizeof(header),
+				    "%zd %u\n", got, handler->priority);
+
+				handler->busy = true;
+				handler->queue = i;
+				handler->length = got;
+				handler->dispatched = now_ns();
+				if (!write_all(handler->input, header, size) ||
+				    !write_all(handler->input, handler->payload,
+				    got)) {
+					warn("write(consume handler %d)",
+					    (int)handler->pid);
+					handler_restart(idle, handler, handles,
+					    names);
+				}
+			}
+			if (result != 0)
+				break;
+			if (taken)
+				continue;
+			if (!creation.block && busy == 0)
+				break;
+		}
+
+		long long pause = until_deadline(1000000000LL);
+
+		if (pause <= 0) {
+			result = ETIMEDOUT;
+			warnc(result, "consume");
+			break;
+		}
+
+		/* wait for a completion, or a message if a handler is idle. */
+		struct timespec interval = ns_timespec(pause);
+		nfds_t watched = 0;
+
+		for (long w = 0; w < spawned; w++) {
+			waits[watched].fd = handlers[w].alive ?
+			    handlers[w].output : -1;
+			waits[watched++].events = POLLIN;
+		}
+		if (idle >= 0 && creation.block) {
+			for (long i = 0; i < count; i++) {
+				waits[watched].fd = queue_fd(handles[i]);
+				waits[watched++].events = POLLIN;
+			}
+		}
+		if (ppoll(waits, watched, &interval, NULL) <= 0)
+			continue;
+
+		for (long w = 0; w < spawned; w++) {
+			struct Handler *handler = &handlers[w];
+
+			if (handler->alive && waits[w].revents != 0 &&
+			    !handler_collect(handler)) {
+				if (handler->busy)
+					warnx("handler %d exited holding a "
+					    "message; putting it back.",
+					    (int)handler->pid);
+				handler_restart(w, handler, handles, names);
+			}
+		}
+	}
+
+	/*
+	 * let the handlers finish and exit. Handlers not alive were reaped
+	 * and reported when they died.
+	 */
+	for (long w = 0; w < spawned; w++) {
+		if (handlers[w].alive)
+			close(handlers[w].input);
+	}
+	for (long w = 0; w < spawned; w++) {
+		struct Handler *handler = &handlers[w];
+
+		if (!handler->alive)
+			continue;
+		while (handler_collect(handler))
+			;
+		close(handler->output);
+		while (waitpid(handler->pid, &handler->status, 0) < 0 &&
+		    errno == EINTR)
+			;
+		handler_report(w, handler);
+	}
+
+	for (long i = 0; i < opened; i++)
+		mq_close(handles[i]);
+	for (long w = 0; w < workers; w++)
+		free(handlers[w].payload);
+	free(waits);
+	free(handlers);
+	free(names);
+	free(handles);
+	return (result);
+}
+
+/*
+ * Drain every -q queue to standard output with --threads workers. Each
+ * worker owns a share of the queues and steals from the others when its
+ * own are empty. With -b false the workers stop once every queue is empty;
+ * otherwise they run until interrupted or the -T deadline passes.
+ */
+static int
+consume(void)
+{
+	if (exec_command != NULL)
+		return (consume_exec());
+
+	struct Consume shared = {.count = 0, .threads = threads, .msgsize = 0};
+	struct element *item;
+
+	STAILQ_FOREACH(item, &queues, links)
+		shared.count++;
+	if (shared.threads > shared.count)
+		shared.threads = shared.count;
+	/* --notify waits for every queue in one thread. */
+	if (notify)
+		shared.threads = 1;
+
+	shared.handles = calloc(shared.count, sizeof(mqd_t));
+	shared.names = calloc(shared.count, sizeof(char *));
+	if (shared.handles == NULL || shared.names == NULL)
+		err(1, "calloc(consume)");
+
+	long opened = 0;
+
+	STAILQ_FOREACH(item, &queues, links) {
+		struct mq_attr actual;
+
+		shared.names[opened] = item->text;
+		shared.handles[opened] = mq_open(item->text, O_RDONLY | O_NONBLOCK);
+		if (shared.handles[opened] == fail) {
+			shared.result = errno;
+			warnc(shared.result, "mq_open(consume %s)", item->text);
+			break;
+		}
+		opened++;
+		if (mq_getattr(shared.handles[opened - 1], &actual) != 0) {
+			shared.result = errno;
+			warnc(shared.result, "mq_attr(consume %s)", item->text);
+			break;
+		}
+		if (actual.mq_msgsize > shared.msgsize)
+			shared.msgsize = actual.mq_msgsize;
+	}
+
+	int pipes[2];
+
+	if (shared.result == 0 && pipe(pipes) != 0) {
+		shared.result = errno;
+		warnc(shared.result, "pipe(consume)");
+	}
+
+	struct Worker *workers = calloc(shared.threads, sizeof(*workers));
+
+	if (workers == NULL)
+		err(1, "calloc(consume workers)");
+
+	long started = 0;
+
+	if (shared.result == 0) {
+		fcntl(pipes[0], F_SETFL, O_NONBLOCK);
+		fcntl(pipes[1], F_SETFL, O_NONBLOCK);
+		shared.wake = pipes[0];
+		wake_fd = pipes[1];
+		pthread_mutex_init(&shared.lock, NULL);
+		catch_signals();
+
+		for (; started < shared.threads && !notify; started++) {
+			struct Worker *worker = &workers[started];
+
+			worker->shared = &shared;
+			worker->index = started;
+			worker->tally.started = now_ns();
+			int result = pthread_create(&worker->thread, NULL,
+			    consume_worker, worker);
+			if (result != 0) {
+				warnc(result, "pthread_create");
+				break;
+			}
+		}
+
+		/* queues of workers that could not start are stolen from. */
+		if (started == 0) {
+			workers[0].shared = &shared;
+			workers[0].tally.started = now_ns();
+			if (notify)
+				consume_notify(&workers[0]);
+			else
+				consume_worker(&workers[0]);
+			started = 1;
+		} else {
+			for (long i = 0; i < started; i++)
+				pthread_join(workers[i].thread, NULL);
+		}
+
+		wake_fd = -1;
+		close(pipes[1]);
+		close(pipes[0]);
+		pthread_mutex_destroy(&shared.lock);
+	}
+
+	fflush(stdout);
+	for (long i = 0; i < started; i++) {
+		char verb[32];
+
+		snprintf(verb, sizeof(verb), "consume[%ld]", i);
+		tally_report(stderr, verb, &workers[i].tally);
+		if (workers[i].stolen > 0)
+			fprintf(stderr, "%s: %llu message(s) stolen\n", verb,
+			    workers[i].stolen);
+	}
+
+	for (long i = 0; i < opened; i++)
+		mq_close(shared.handles[i]);
+	free(workers);
+	free(shared.names);
+	free(shared.handles);
+	return (shared.result);
+}
+
+/* shared state of the worker threads of one fan_out() call. */
+struct FanOut {
+	/* guards next and worst. */
+	pthread_mutex_t lock;
+	/* next queue not yet claimed by a worker. */
+	struct element *next;
+	/* last non-zero result reported by any worker. */
+	int worst;
+	/* operation applied to each queue. */
+	int (*work)(const char *);
+};
+
+static void *
+fan_out_worker(void *context)
+{
+	struct FanOut *state = context;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		struct element *item = state->next;
+		if (item != NULL)
+			state->next = STAILQ_NEXT(item, links);
+		pthread_mutex_unlock(&state->lock);
+
+		if (item == NULL)
+			break;
+
+		int result = state->work(item->text);
+
+		if (result != 0) {
+			pthread_mutex_lock(&state->lock);
+			state->worst = result;
+			pthread_mutex_unlock(&state->lock);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * apply work to every queue in list using up to 'jobs' threads.
+ * each worker claims the next unclaimed queue, so a queue that blocks
+ * only holds up its own worker and never the queues behind it.
+ * returns the last non-zero result, or zero.
+ */
+static int
+fan_out(struct tqh *list, int (*work)(const char *))
+{
+	struct FanOut state = {
+		.next = STAILQ_FIRST(list),
+		.worst = 0,
+		.work = work
+	};
+	long count = 0;
+	struct element *item;
+
+	STAILQ_FOREACH(item, list, links)
+		count++;
+	if (count > jobs)
+		count = jobs;
+
+	pthread_mutex_init(&state.lock, NULL);
+
+	pthread_t *workers = NULL;
+	long started = 0;
+
+	if (count > 1) {
+		workers = calloc(count, sizeof(pthread_t));
+		if (workers == NULL)
+			err(1, "calloc(workers)");
+		for (; started < count; started++) {
+			int result = pthread_create(&workers[started], NULL,
+			    fan_out_worker, &state);
+			if (result != 0) {
+				warnc(result, "pthread_create");
+				break;
+			}
+		}
+	}
+
+	/* run inline when sequential or when no thread could be started. */
+	if (started == 0)
+		fan_out_worker(&state);
+
+	for (long i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	pthread_mutex_destroy(&state.lock);
+	return (state.worst);
+}
+
+/*
+ * Locate the key of a message according to --key.
+ * Returns the key length; *start receives its first byte.
+ */
+static size_t
+key_extract(const char *text, size_t length, const char **start)
+{
+	size_t from = 0;
+	size_t to = length;
+
+	if (key_spec.kind == KEY_BYTES) {
+		from = (size_t)key_spec.offset < length ?
+		    (size_t)key_spec.offset : length;
+		to = length - from > (size_t)key_spec.length ?
+		    from + key_spec.length : length;
+	} else if (key_spec.kind == KEY_FIELD) {
+		long field = 0;
+
+		for (size_t i = 0; i < length && field <= key_spec.field; i++) {
+			if (text[i] == key_spec.separator) {
+				if (field == key_spec.field) {
+					to = i;
+					break;
+				}
+				field++;
+				from = i + 1;
+			}
+		}
+		if (field < key_spec.field)
+			from = to = length;
+	}
+
+	*start = text + from;
+	return (to - from);
+}
+
+/* most messages a rehash source holds back for queues not yet drained. */
+static const long rehash_hold_max = 256;
+
+/* messages a rehash source holds back until their destination is drained. */
+struct Held {
+	const char *source;
+	/* index of the --to queue this source also is, or -1. */
+	long as_target;
+	long msgsize;
+	char *slots;
+	ssize_t *lengths;
+	unsigned *priorities;
+	long *targets;
+	long count;
+	/* rehash_flush() copy of drained. */
+	bool *ready;
+};
+
+/* state shared by the rehash() workers, one per source queue. */
+static struct {
+	/* every --to queue, opened for writing. */
+	mqd_t *handles;
+	const char **names;
+	/* true for a --to queue that is also a --from queue. */
+	bool *overlap;
+	/* true once such a queue has had its own messages drained. */
+	bool *drained;
+	long count;
+	/* one per --from queue, in list order. */
+	struct Held *held;
+	long sources;
+	/* guards the progress counters and drained. */
+	pthread_mutex_t lock;
+	unsigned long long moved;
+	unsigned long long total;
+	long long reported;
+} rehashing;
+
+static struct Held *
+rehash_held(const char *queue)
+{
+	for (long i = 0; i < rehashing.sources; i++) {
+		if (rehashing.held[i].source == queue)
+			return (&rehashing.held[i]);
+	}
+	return (NULL);
+}
+
+static void
+rehash_progress(void)
+{
+	pthread_mutex_lock(&rehashing.lock);
+	rehashing.moved++;
+	if (now_ns() - rehashing.reported > 1000000000LL) {
+		rehashing.reported = now_ns();
+		fprintf(stderr, "rehash: moved %llu of %llu message(s)\n",
+		    rehashing.moved, rehashing.total);
+	}
+	pthread_mutex_unlock(&rehashing.lock);
+}
+
+/* Send one message to --to queue 'to'. Returns zero or an errno value. */
+static int
+rehash_send(long to, const char *text, size_t length, unsigned q_priority)
+{
+	int sent;
+
+	do {
+		sent = set_deadline ?
+		    mq_timedsend(rehashing.handles[to], text, length, q_priority,
+			&deadline) :
+		    mq_send(rehashing.handles[to], text, length, q_priority);
+	} while (sent != 0 && errno == EINTR && !stopping);
+
+	if (sent != 0) {
+		errno_t what = errno;
+
+		warnc(what, "mq_send(rehash %s)", rehashing.names[to]);
+		return (what);
+	}
+	rehash_progress();
+	return (0);
+}
+
+static bool
+rehash_drained(long to)
+{
+	pthread_mutex_lock(&rehashing.lock);
+	bool drained = rehashing.drained[to];
+	pthread_mutex_unlock(&rehashing.lock);
+
+	return (drained);
+}
+
+/*
+ * Send the held messages whose destination has been drained, keeping the
+ * rest in arrival order. Returns zero or an errno value.
+ */
+static int
+rehash_flush(struct Held *held)
+{
+	/* one view of drained, so no message overtakes one kept back. */
+	pthread_mutex_lock(&rehashing.lock);
+	memcpy(held->ready, rehashing.drained, rehashing.count * sizeof(bool));
+	pthread_mutex_unlock(&rehashing.lock);
+
+	long kept = 0;
+	int result = 0;
+
+	for (long i = 0; i < held->count; i++) {
+		char *text = held->slots + i * held->msgsize;
+
+		if (result == 0 && held->ready[held->targets[i]]) {
+			result = rehash_send(held->targets[i], text,
+			    held->lengths[i], held->priorities[i]);
+			if (result == 0)
+				continue;
+		}
+		if (kept != i) {
+			memcpy(held->slots + kept * held->msgsize, text,
+			    held->lengths[i]);
+			held->lengths[kept] = held->lengths[i];
+			held->priorities[kept] = held->priorities[i];
+			held->targets[kept] = held->targets[i];
+		}
+		kept++;
+	}
+	held->count = kept;
+	return (result);
+}
+
+/*
+ * First pass over source queue: move the messages present at the start to
+ * the --to queue their key hashes to. A message bound for a queue that is
+ * also a source is held back until that queue has been drained, so no
+ * source ever sees a message moved into it before its own are out. Once
+ * rehash_hold_max messages are held the source is left with the rest.
+ */
+static int
+rehash_drain(const char *queue)
+{
+	struct Held *held = rehash_held(queue);
+	mqd_t input = open_source(queue);
+
+	if (input == fail) {
+		errno_t what = errno;
+
+		warnc(what, "mq_open(rehash %s)", queue);
+		return (what);
+	}
+
+	struct mq_attr actual;
+
+	if (mq_getattr(input, &actual) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "mq_attr(rehash %s)", queue);
+		mq_close(input);
+		return (what);
+	}
+
+	pthread_mutex_lock(&rehashing.lock);
+	rehashing.total += actual.mq_curmsgs;
+	pthread_mutex_unlock(&rehashing.lock);
+
+	long snapshot = actual.mq_curmsgs;
+	bool overlapping = false;
+	char *text = malloc(actual.mq_msgsize);
+
+	if (text == NULL)
+		err(1, "malloc(rehash)");
+
+	/* only a destination that is also a source needs a hold. */
+	for (long i = 0; i < rehashing.count; i++)
+		overlapping |= rehashing.overlap[i];
+
+	long hold = !overlapping ? 0 :
+	    snapshot < rehash_hold_max ? snapshot : rehash_hold_max;
+
+	held->msgsize = actual.mq_msgsize;
+	if (hold > 0) {
+		held->slots = malloc(hold * actual.mq_msgsize);
+		held->lengths = calloc(hold, sizeof(ssize_t));
+		held->priorities = calloc(hold, sizeof(unsigned));
+		held->targets = calloc(hold, sizeof(long));
+		held->ready = calloc(rehashing.count, sizeof(bool));
+		if (held->slots == NULL || held->lengths == NULL ||
+		    held->priorities == NULL || held->targets == NULL ||
+		    held->ready == NULL)
+			err(1, "malloc(rehash)");
+	}
+
+	int result = 0;
+	long n = 0;
+
+	for (; n < snapshot && !stopping && result == 0; n++) {
+		unsigned q_priority = 0;
+		ssize_t got = mq_receive(input, text, held->msgsize, &q_priority);
+
+		if (got < 0) {
+			/* someone else drained it first. */
+			if (errno != EAGAIN) {
+				result = errno;
+				warnc(result, "mq_receive(rehash %s)", queue);
+			}
+			n = snapshot;
+			break;
+		}
+
+		const char *start = NULL;
+		size_t length = key_extract(text, got, &start);
+		long to = hash_key(start, length) % rehashing.count;
+
+		if (!rehashing.overlap[to]) {
+			result = rehash_send(to, text, got, q_priority);
+			if (result != 0)
+				hand_back(input, queue, text, got, q_priority);
+			continue;
+		}
+
+		if (held->count == hold)
+			result = rehash_flush(held);
+		if (result == 0 && held->count == hold) {
+			warnx("%ld message(s) held for queues not yet drained; "
+			    "%s keeps the rest, rehash again to move them.",
+			    hold, queue);
+			result = ENOBUFS;
+		}
+		if (result != 0) {
+			hand_back(input, queue, text, got, q_priority);
+			continue;
+		}
+
+		char *slot = held->slots + held->count * held->msgsize;
+
+		memcpy(slot, text, got);
+		held->lengths[held->count] = got;
+		held->priorities[held->count] = q_priority;
+		held->targets[held->count] = to;
+		held->count++;
+		if (rehash_drained(to))
+			result = rehash_flush(held);
+	}
+
+	/* every message the source started with is out. */
+	if (n == snapshot && result == 0 && held->as_target >= 0) {
+		pthread_mutex_lock(&rehashing.lock);
+		rehashing.drained[held->as_target] = true;
+		pthread_mutex_unlock(&rehashing.lock);
+	}
+
+	free(text);
+	mq_close(input);
+	return (result);
+}
+
+/* Second pass: deliver what rehash_drain() held back, in arrival order. */
+static int
+rehash_release(const char *queue)
+{
+	struct Held *held = rehash_held(queue);
+	int result = 0;
+
+	for (long i = 0; i < held->count; i++) {
+		const char *text = held->slots + i * held->msgsize;
+
+		if (result == 0)
+			result = rehash_send(held->targets[i], text,
+			    held->lengths[i], held->priorities[i]);
+		if (result != 0)
+			warnx("lost %zd byte message held from %s",
+			    held->lengths[i], queue);
+	}
+
+	free(held->ready);
+	free(held->targets);
+	free(held->priorities);
+	free(held->lengths);
+	free(held->slots);
+	return (result);
+}
+
+/*
+ * Move the messages of every --from queue to the --to queue their --key
+ * hashes to, creating missing destinations like the first source.
+ * sources are drained concurrently, one worker each, then whatever was
+ * still held back for queues that are both source and destination is
+ * delivered.
+ */
+static int
+rehash(void)
+{
+	struct element *item;
+
+	rehashing.count = 0;
+	STAILQ_FOREACH(item, &targets, links)
+		rehashing.count++;
+
+	rehashing.sources = 0;
+	STAILQ_FOREACH(item, &queues, links)
+		rehashing.sources++;
+
+	rehashing.handles = calloc(rehashing.count, sizeof(mqd_t));
+	rehashing.names = calloc(rehashing.count, sizeof(char *));
+	rehashing.overlap = calloc(rehashing.count, sizeof(bool));
+	rehashing.drained = calloc(rehashing.count, sizeof(bool));
+	rehashing.held = calloc(rehashing.sources, sizeof(struct Held));
+	if (rehashing.handles == NULL || rehashing.names == NULL ||
+	    rehashing.overlap == NULL || rehashing.drained == NULL ||
+	    rehashing.held == NULL)
+		err(1, "calloc(rehash)");
+
+	long index = 0;
+
+	STAILQ_FOREACH(item, &queues, links) {
+		rehashing.held[index].source = item->text;
+		rehashing.held[index++].as_target = -1;
+	}
+
+	/* new destinations copy the geometry of the first source. */
+	if (creation.size <= 0 || creation.depth <= 0) {
+		const char *first = STAILQ_FIRST(&queues)->text;
+		mqd_t handle = mq_open(first, O_RDONLY);
+		struct mq_attr actual;
+
+		if (handle == fail || mq_getattr(handle, &actual) != 0) {
+			errno_t what = errno;
+
+			warnc(what, "mq_open(rehash %s)", first);
+			if (handle != fail)
+				mq_close(handle);
+			return (what);
+		}
+		mq_close(handle);
+		if (creation.size <= 0)
+			creation.size = actual.mq_msgsize;
+		if (creation.depth <= 0)
+			creation.depth = actual.mq_maxmsg;
+	}
+
+	int result = 0;
+	long opened = 0;
+
+	STAILQ_FOREACH(item, &targets, links) {
+		const char *name = item->text;
+
+		rehashing.names[opened] = name;
+		for (long i = 0; i < rehashing.sources; i++) {
+			if (strcmp(rehashing.held[i].source, name) == 0) {
+				rehashing.overlap[opened] = true;
+				rehashing.held[i].as_target = opened;
+			}
+		}
+		result = create(name, creation);
+		if (result != 0)
+			break;
+		rehashing.handles[opened] = mq_open(name,
+		    O_WRONLY | (creation.block ? 0 : O_NONBLOCK));
+		if (rehashing.handles[opened] == fail) {
+			result = errno;
+			warnc(result, "mq_open(rehash %s)", name);
+			break;
+		}
+		opened++;
+	}
+
+	if (result == 0) {
+		if (jobs < rehashing.sources)
+			jobs = rehashing.sources;
+
+		pthread_mutex_init(&rehashing.lock, NULL);
+		rehashing.reported = now_ns();
+		catch_signals();
+		result = fan_out(&queues, rehash_drain);
+
+		int released = fan_out(&queues, rehash_release);
+
+		if (released != 0)
+			result = released;
+		pthread_mutex_destroy(&rehashing.lock);
+
+		fprintf(stderr, "rehash: moved %llu of %llu message(s)\n",
+		    rehashing.moved, rehashing.total);
+	}
+
+	for (long i = 0; i < opened; i++)
+		mq_close(rehashing.handles[i]);
+	free(rehashing.held);
+	free(rehashing.drained);
+	free(rehashing.overlap);
+	free(rehashing.names);
+	free(rehashing.handles);
+	return (result);
+}
+
+/*
+ * Traffic logs.
+ *
+ * A log starts with a LogHeader and one LogQueue per recorded queue,
+ * followed by records, each a LogRecord header then the payload padded to a
+ * multiple of eight bytes. A cleanly closed log ends with a sparse time
+ * index, one LogIndex per log_stride bytes of records, and a LogFooter.
+ * A log cut short has no footer and is read by scanning its records.
+ * Every field is in host byte order.
+ */
+
+static const char log_magic[8] = "PMQLOG01";
+static const char log_index_magic[8] = "PMQIDX01";
+/* log bytes between sparse index entries. */
+static const uint64_t log_stride = 1 << 20;
+/* size of the record write buffer. */
+static const size_t log_buffer_size = 4 << 20;
+
+struct LogHeader {
+	char magic[8];
+	/* number of LogQueue entries that follow. */
+	uint32_t queues;
+	uint32_t reserved;
+	/* CLOCK_REALTIME nanoseconds when recording started. */
+	int64_t started;
+};
+
+struct LogQueue {
+	int64_t maxmsg;
+	int64_t msgsize;
+	char name[240];
+};
+
+struct LogRecord {
+	/* CLOCK_REALTIME nanoseconds the message was received. */
+	int64_t timestamp;
+	/* payload bytes following this header. */
+	uint32_t length;
+	uint32_t priority;
+	/* LogQueue entry of the queue the message came from. */
+	uint32_t queue;
+	uint32_t reserved;
+};
+
+struct LogIndex {
+	int64_t timestamp;
+	/* file offset of the first record at or after timestamp. */
+	uint64_t offset;
+};
+
+struct LogFooter {
+	char magic[8];
+	/* file offset of the first LogIndex. */
+	uint64_t index;
+	uint64_t entries;
+	uint64_t records;
+};
+
+struct LogWriter {
+	int fd;
+	/* page aligned staging buffer. */
+	char *buffer;
+	size_t used;
+	/* file offset of buffer[0]. */
+	uint64_t offset;
+	/* file offset due the next index entry. */
+	uint64_t next_index;
+	struct LogIndex *index;
+	size_t entries;
+	size_t capacity;
+	uint64_t records;
+};
+
+static size_t
+log_padded(size_t length)
+{
+	return ((length + 7) & ~(size_t)7);
+}
+
+/* write out the staging buffer. returns zero or an errno value. */
+static int
+log_flush(struct LogWriter *writer)
+{
+	if (!write_all(writer->fd, writer->buffer, writer->used))
+		return (errno);
+	writer->offset += writer->used;
+	writer->used = 0;
+	return (0);
+}
+
+/*
+ * Receive one message from handle straight into the staging buffer.
+ * Returns true if a message was recorded; false with *result set to zero if
+ * the queue is empty, or to an errno value.
+ */
+static bool
+log_receive(struct LogWriter *writer, mqd_t handle, uint32_t queue,
+    long msgsize, struct Tally *tally, int *result)
+{
+	*result = 0;
+	if (log_buffer_size - writer->used <
+	    sizeof(struct LogRecord) + log_padded(msgsize)) {
+		*result = log_flush(writer);
+		if (*result != 0)
+			return (false);
+	}
+
+	char *slot = writer->buffer + writer->used;
+	unsigned q_priority = 0;
+	ssize_t got = mq_receive(handle, slot + sizeof(struct LogRecord),
+	    msgsize, &q_priority);
+
+	if (got < 0) {
+		if (errno != EAGAIN)
+			*result = errno;
+		return (false);
+	}
+
+	struct LogRecord record = {
+		.timestamp = now_ns(),
+		.length = got,
+		.priority = q_priority,
+		.queue = queue
+	};
+	uint64_t position = writer->offset + writer->used;
+
+	memcpy(slot, &record, sizeof(record));
+	memset(slot + sizeof(record) + got, 0, log_padded(got) - got);
+	writer->used += sizeof(record) + log_padded(got);
+	writer->records++;
+	tally->messages++;
+	tally->bytes += got;
+
+	if (position >= writer->next_index) {
+		if (writer->entries == writer->capacity) {
+			writer->capacity = writer->capacity * 2 + 64;
+			writer->index = realloc(writer->index,
+			    writer->capacity * sizeof(*writer->index));
+			if (writer->index == NULL)
+				err(1, "realloc(record index)");
+		}
+		writer->index[writer->entries].timestamp = record.timestamp;
+		writer->index[writer->entries++].offset = position;
+		writer->next_index = position + log_stride;
+	}
+	return (true);
+}
+
+/* append the sparse index and footer. returns zero or an errno value. */
+static int
+log_close(struct LogWriter *writer)
+{
+	int result = log_flush(writer);
+
+	if (result != 0)
+		return (result);
+
+	struct LogFooter footer = {
+		.index = writer->offset,
+		.entries = writer->entries,
+		.records = writer->records
+	};
+
+	memcpy(footer.magic, log_index_magic, sizeof(footer.magic));
+	if (!write_all(writer->fd, (const char *)writer->index,
+	    writer->entries * sizeof(*writer->index)) ||
+	    !write_all(writer->fd, (const char *)&footer, sizeof(footer)) ||
+	    fsync(writer->fd) != 0)
+		return (errno);
+	return (0);
+}
+
+/*
+ * Record every -q queue to the -f log. With -b false recording stops once
+ * every queue is empty; otherwise it tails the queues until interrupted or
+ * the -T deadline passes. Messages are received directly into a large
+ * page aligned buffer that is written out when full or when the queues
+ * go idle.
+ */
+static int
+record(void)
+{
+	long count = 0;
+	struct element *item;
+
+	STAILQ_FOREACH(item, &queues, links)
+		count++;
+
+	mqd_t *handles = calloc(count, sizeof(mqd_t));
+	struct pollfd *waits = calloc(count, sizeof(struct pollfd));
+	struct LogWriter writer = {.fd = -1};
+
+	if (handles == NULL || waits == NULL)
+		err(1, "calloc(record)");
+	if (posix_memalign((void **)&writer.buffer, getpagesize(),
+	    log_buffer_size) != 0)
+		err(1, "posix_memalign(record)");
+
+	int result = 0;
+	long opened = 0;
+	long msgsize = 0;
+	struct LogHeader header = {.queues = count, .started = now_ns()};
+
+	memcpy(header.magic, log_magic, sizeof(header.magic));
+	memcpy(writer.buffer, &header, sizeof(header));
+	writer.used = sizeof(header);
+
+	STAILQ_FOREACH(item, &queues, links) {
+		struct mq_attr actual;
+		struct LogQueue entry = {0};
+
+		handles[opened] = mq_open(item->text, O_RDONLY | O_NONBLOCK);
+		if (handles[opened] == fail) {
+			result = errno;
+			warnc(result, "mq_open(record %s)", item->text);
+			break;
+		}
+		waits[opened].fd = queue_fd(handles[opened]);
+		waits[opened].events = POLLIN;
+		opened++;
+		if (mq_getattr(handles[opened - 1], &actual) != 0) {
+			result = errno;
+			warnc(result, "mq_attr(record %s)", item->text);
+			break;
+		}
+		if (actual.mq_msgsize > msgsize)
+			msgsize = actual.mq_msgsize;
+
+		entry.maxmsg = actual.mq_maxmsg;
+		entry.msgsize = actual.mq_msgsize;
+		strlcpy(entry.name, item->text, sizeof(entry.name));
+		memcpy(writer.buffer + writer.used, &entry, sizeof(entry));
+		writer.used += sizeof(entry);
+	}
+
+	if (result == 0 && writer.used + sizeof(struct LogRecord) +
+	    log_padded(msgsize) > log_buffer_size) {
+		result = EMSGSIZE;
+		warnc(result, "record");
+	}
+
+	if (result == 0) {
+		writer.fd = open(log_path,
+		    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+		if (writer.fd < 0) {
+			result = errno;
+			warnc(result, "open(record %s)", log_path);
+		}
+	}
+
+	struct Tally tally = {.started = now_ns()};
+
+	if (result == 0)
+		catch_signals();
+	while (result == 0 && !stopping) {
+		bool busy = false;
+
+		for (long i = 0; i < count && result == 0; i++)
+			busy |= log_receive(&writer, handles[i], i, msgsize,
+			    &tally, &result);
+		if (result != 0) {
+			warnc(result, "record");
+			break;
+		}
+		if (busy)
+			continue;
+
+		/* the queues are idle, so make the log current. */
+		result = log_flush(&writer);
+		if (result != 0) {
+			warnc(result, "write(record %s)", log_path);
+			break;
+		}
+		if (!creation.block)
+			break;
+
+		long long pause = until_deadline(1000000000LL);
+
+		if (pause <= 0) {
+			result = ETIMEDOUT;
+			warnc(result, "record");
+			break;
+		}
+
+		struct timespec interval = ns_timespec(pause);
+
+		ppoll(waits, count, &interval, NULL);
+	}
+
+	if (writer.fd >= 0) {
+		int closing = log_close(&writer);
+
+		if (closing != 0) {
+			warnc(closing, "write(record %s)", log_path);
+			if (result == 0)
+				result = closing;
+		}
+		close(writer.fd);
+		tally_report(stderr, "record", &tally);
+	}
+
+	for (long i = 0; i < opened; i++)
+		mq_close(handles[i]);
+	free(writer.index);
+	free(writer.buffer);
+	free(waits);
+	free(handles);
+	return (result);
+}
+
+/* nanoseconds of the final stretch before a replay send spent spinning. */
+static const long long replay_spin_ns = 200000;
+
+static long long
+monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec * 1000000000LL + now.tv_nsec);
+}
+
+/* sleep until close to the CLOCK_MONOTONIC time due, then spin. */
+static void
+replay_pace(long long due)
+{
+	long long early = due - replay_spin_ns;
+
+	if (monotonic_ns() < early) {
+		struct timespec wake = ns_timespec(early);
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake,
+		    NULL) == EINTR && !stopping)
+			;
+	}
+	while (monotonic_ns() < due && !stopping)
+		;
+}
+
+/*
+ * Find where replay begins: the first record at or after skip seconds into
+ * the log. The sparse index, when present, narrows the scan to one stride.
+ */
+static size_t
+replay_seek(const char *map, size_t begin, size_t end,
+    const struct LogIndex *index, uint64_t entries, int64_t from)
+{
+	size_t offset = begin;
+	uint64_t low = 0;
+	uint64_t high = entries;
+
+	/* last index entry not after from. */
+	while (low < high) {
+		uint64_t middle = (low + high) / 2;
+
+		if (index[middle].timestamp <= from)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (low > 0 && index[low - 1].offset >= begin &&
+	    index[low - 1].offset < end)
+		offset = index[low - 1].offset;
+
+	while (offset + sizeof(struct LogRecord) <= end) {
+		struct LogRecord record;
+
+		memcpy(&record, map + offset, sizeof(record));
+		if (record.timestamp >= from)
+			break;
+		offset += sizeof(record) + log_padded(record.length);
+	}
+	return (offset);
+}
+
+/*
+ * Send the records of the -f log to the -q queue over one descriptor, at
+ * their recorded spacing divided by --speed, or back to back with
+ * --speed max. Reports how far sends landed from their intended times.
+ */
+static int
+replay(const char *queue)
+{
+	int fd = open(log_path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		errno_t what = errno;
+
+		warnc(what, "open(replay %s)", log_path);
+		return (what);
+	}
+
+	struct stat status;
+
+	if (fstat(fd, &status) != 0) {
+		errno_t what = errno;
+
+		warnc(what, "fstat(replay)");
+		close(fd);
+		return (what);
+	}
+
+	size_t size = status.st_size;
+	struct LogHeader header;
+
+	if (size < sizeof(header)) {
+		warnx("%s is not a traffic log.", log_path);
+		close(fd);
+		return (EINVAL);
+	}
+
+	char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno_t what = errno;
+
+		warnc(what, "mmap(replay)");
+		return (what);
+	}
+	posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+	memcpy(&header, map, sizeof(header));
+
+	size_t begin = sizeof(header) +
+	    (size_t)header.queues * sizeof(struct LogQueue);
+
+	if (memcmp(header.magic, log_magic, sizeof(header.magic)) != 0 ||
+	    begin > size) {
+		warnx("%s is not a traffic log.", log_path);
+		munmap(map, size);
+		return (EINVAL);
+	}
+
+	/* a log cut short has no footer; scan it to the last whole record. */
+	size_t end = size;
+	const struct LogIndex *index = NULL;
+	struct LogFooter footer = {.entries = 0};
+
+	if (size >= begin + sizeof(footer)) {
+		memcpy(&footer, map + size - sizeof(footer), sizeof(footer));
+		if (memcmp(footer.magic, log_index_magic,
+		    sizeof(footer.magic)) == 0 && footer.index >= begin &&
+		    footer.index + footer.entries * sizeof(*index) +
+		    sizeof(footer) == size) {
+			end = footer.index;
+			index = (const struct LogIndex *)(map + footer.index);
+		} else {
+			footer.entries = 0;
+		}
+	}
+
+	size_t offset = replay_seek(map, begin, end, index, footer.entries,
+	    header.started + (int64_t)(skip * 1e9));
+
+	mqd_t handle = mq_open(queue, O_WRONLY |
+	    (creation.block ? 0 : O_NONBLOCK));
+	int result = 0;
+
+	if (handle == fail) {
+		result = errno;
+		warnc(result, "mq_open(replay %s)", queue);
+		munmap(map, size);
+		return (result);
+	}
+
+	struct Tally tally = {.started = now_ns()};
+	long long first = 0;
+	long long epoch = 0;
+	long long error_sum = 0;
+	long long error_worst = 0;
+
+	catch_signals();
+	while (offset + sizeof(struct LogRecord) <= end && !stopping) {
+		struct LogRecord record;
+
+		memcpy(&record, map + offset, sizeof(record));
+		if (offset + sizeof(record) + record.length > end) {
+			warnx("%s ends in a partial record.", log_path);
+			break;
+		}
+
+		const char *text = map + offset + sizeof(record);
+		long long due = 0;
+
+		if (tally.messages == 0) {
+			first = record.timestamp;
+			epoch = monotonic_ns();
+		}
+		if (speed > 0) {
+			due = epoch + (long long)((record.timestamp - first) /
+			    speed);
+			replay_pace(due);
+		}
+
+		int sent = set_deadline ?
+		    mq_timedsend(handle, text, record.length, record.priority,
+		    &deadline) :
+		    mq_send(handle, text, record.length, record.priority);
+
+		if (sent != 0) {
+			result = errno;
+			warnc(result, "mq_send(replay %s)", queue);
+			break;
+		}
+		if (speed > 0) {
+			long long late = monotonic_ns() - due;
+
+			error_sum += late;
+			if (late > error_worst)
+				error_worst = late;
+		}
+		tally.messages++;
+		tally.bytes += record.length;
+		offset += sizeof(record) + log_padded(record.length);
+	}
+
+	tally_report(stderr, "replay", &tally);
+	if (speed > 0 && tally.messages > 0)
+		fprintf(stderr, "replay: timing error mean %.3f us, "
+		    "worst %.3f us\n", error_sum / 1e3 / tally.messages,
+		    error_worst / 1e3);
+
+	mq_close(handle);
+	munmap(map, size);
+	return (result);
+}
+
+/*
+ * Delayed delivery.
+ *
+ * Pending messages live in a hierarchical timer wheel of wheel_levels
+ * levels of 64 slots. A timer sits at the level of the highest six bit
+ * group in which its due tick differs from the current tick, so level L
+ * slot s holds the timers of the s-th 64^L tick block of the current
+ * 64^(L+1) block. One occupancy bit per slot turns finding the next expiry
+ * into a find-first-set. Entering an occupied block files its timers again
+ * at lower levels. Timers come from a chunked arena and are linked by index.
+ */
+
+/* eleven levels of six bits cover every 64 bit tick. */
+enum { wheel_levels = 11 };
+
+static const uint32_t timer_none = UINT32_MAX;
+/* timers per arena chunk. */
+static const uint32_t timer_chunk = 65536;
+/* most arena chunks, keeping every index below timer_none. */
+static const uint32_t timer_chunks_max = 65535;
+/* longest schedule input line. */
+static const size_t schedule_line_max = 65536;
+
+struct Timer {
+	/* tick the message is due. */
+	uint64_t due;
+	/* next timer in the same slot, parked list or free list. */
+	uint32_t next;
+	/* index into the scheduler's destinations. */
+	uint32_t target;
+	uint32_t priority;
+	uint32_t length;
+	char *text;
+};
+
+struct Wheel {
+	/* current tick. */
+	uint64_t now;
+	uint64_t occupied[wheel_levels];
+	/* first timer of each slot. */
+	uint32_t slots[wheel_levels][64];
+	struct Timer **chunks;
+	uint32_t chunk_count;
+	/* timers ever handed out of the chunks. */
+	uint32_t used;
+	uint32_t free;
+	unsigned long long pending;
+};
+
+struct Destination {
+	char *name;
+	mqd_t handle;
+	/* due timers waiting, in order, for the queue to have room. */
+	uint32_t parked;
+	uint32_t parked_tail;
+};
+
+struct Scheduler {
+	struct Wheel wheel;
+	struct Destination *destinations;
+	uint32_t destination_count;
+	/* CLOCK_REALTIME nanoseconds of tick zero. */
+	long long origin;
+	long long tick_ns;
+	struct Tally tally;
+	unsigned long long deferred;
+	long long late_sum;
+	long long late_worst;
+};
+
+static struct Timer *
+timer_at(struct Wheel *wheel, uint32_t id)
+{
+	return (&wheel->chunks[id / timer_chunk][id % timer_chunk]);
+}
+
+/* returns a timer index, or timer_none when the arena is exhausted. */
+static uint32_t
+timer_alloc(struct Wheel *wheel)
+{
+	uint32_t id = wheel->free;
+
+	if (id != timer_none) {
+		wheel->free = timer_at(wheel, id)->next;
+		return (id);
+	}
+	if (wheel->used == wheel->chunk_count * timer_chunk) {
+		if (wheel->chunk_count == timer_chunks_max)
+			return (timer_none);
+		wheel->chunks = realloc(wheel->chunks,
+		    (wheel->chunk_count + 1) * sizeof(*wheel->chunks));
+		if (wheel->chunks == NULL)
+			err(1, "realloc(schedule)");
+		wheel->chunks[wheel->chunk_count] =
+		    malloc(timer_chunk * sizeof(struct Timer));
+		if (wheel->chunks[wheel->chunk_count] == NULL)
+			err(1, "malloc(schedule)");
+		wheel->chunk_count++;
+	}
+	return (wheel->used++);
+}
+
+static void
+timer_free(struct Wheel *wheel, uint32_t id)
+{
+	struct Timer *timer = timer_at(wheel, id);
+
+	free(timer->text);
+	timer->text = NULL;
+	timer->next = wheel->free;
+	wheel->free = id;
+}
+
+/* file a timer due after the current tick. */
+static void
+wheel_insert(struct Wheel *wheel, uint32_t id)
+{
+	struct Timer *timer = timer_at(wheel, id);
+	int level = (flsll(timer->due ^ wheel->now) - 1) / 6;
+	int slot = (timer->due >> (6 * level)) & 63;
+
+	timer->next = wheel->slots[level][slot];
+	wheel->slots[level][slot] = id;
+	wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+/*
+ * Tick at which the earliest occupied slot falls due, or UINT64_MAX if the
+ * wheel is empty. Occupied slots of a level always lie beyond the current
+ * tick, and every slot of a level falls due before any slot of the level
+ * above, so the lowest occupied slot of the lowest occupied level wins.
+ */
+static uint64_t
+wheel_next(const struct Wheel *wheel, int *level, int *slot)
+{
+	for (int l = 0; l < wheel_levels; l++) {
+		if (wheel->occupied[l] == 0)
+			continue;
+
+		int shift = 6 * (l + 1);
+		uint64_t block = shift >= 64 ? 0 :
+		    wheel->now & ~(((uint64_t)1 << shift) - 1);
+
+		*level = l;
+		*slot = ffsll(wheel->occupied[l]) - 1;
+		return (block | (uint64_t)*slot << (6 * l));
+	}
+	return (UINT64_MAX);
+}
+
+/*
+ * Advance to tick target, appending the timers due by then to the *expired
+ * list in due order.
+ */
+static void
+wheel_advance(struct Wheel *wheel, uint64_t target, uint32_t *expired)
+{
+	uint32_t *tail = expired;
+	int level = 0;
+	int slot = 0;
+	uint64_t at;
+
+	while ((at = wheel_next(wheel, &level, &slot)) <= target) {
+		uint32_t id = wheel->slots[level][slot];
+
+		wheel->slots[level][slot] = timer_none;
+		wheel->occupied[level] &= ~((uint64_t)1 << slot);
+		wheel->now = at;
+		while (id != timer_none) {
+			struct Timer *timer = timer_at(wheel, id);
+			uint32_t next = timer->next;
+
+			if (timer->due <= at) {
+				timer->next = timer_none;
+				*tail = id;
+				tail = &timer->next;
+			} else {
+				wheel_insert(wheel, id);
+			}
+			id = next;
+		}
+	}
+	if (target > wheel->now)
+		wheel->now = target;
+}
+
+/* first tick at or after CLOCK_REALTIME nanoseconds ns. */
+static uint64_t
+schedule_tick(const struct Scheduler *state, long long ns)
+{
+	if (ns <= state->origin)
+		return (0);
+	return ((ns - state->origin + state->tick_ns - 1) / state->tick_ns);
+}
+
+/*
+ * Parse a delivery time: seconds since the epoch, or +seconds from now,
+ * either with up to nine decimal places.
+ */
+static bool
+parse_instant(const char *text, long long *ns)
+{
+	bool relative = *text == '+';
+	const char *cursor = relative ? text + 1 : text;
+	const char *digits = cursor;
+	long long seconds = 0;
+	long long fraction = 0;
+	long long scale = 1000000000LL;
+
+	for (; isdigit((unsigned char)*cursor); cursor++) {
+		if (seconds > LLONG_MAX / 1000000000LL / 10)
+			return (false);
+		seconds = seconds * 10 + (*cursor - '0');
+	}
+	if (cursor == digits)
+		return (false);
+	if (*cursor == '.') {
+		for (cursor++; isdigit((unsigned char)*cursor); cursor++) {
+			if (scale > 1) {
+				scale /= 10;
+				fraction += (*cursor - '0') * scale;
+			}
+		}
+	}
+	if (*cursor != 0)
+		return (false);
+	*ns = seconds * 1000000000LL + fraction + (relative ? now_ns() : 0);
+	return (true);
+}
+
+static uint32_t
+schedule_destination(struct Scheduler *state, const char *name)
+{
+	for (uint32_t i = 0; i < state->destination_count; i++) {
+		if (strcmp(state->destinations[i].name, name) == 0)
+			return (i);
+	}
+
+	struct Destination *grown = realloc(state->destinations,
+	    (state->destination_count + 1) * sizeof(*grown));
+
+	if (grown == NULL)
+		err(1, "realloc(schedule)");
+	state->destinations = grown;
+	grown[state->destination_count].name = strdup(name);
+	if (grown[state->destination_count].name == NULL)
+		err(1, "strdup(schedule)");
+	grown[state->destination_count].handle = fail;
+	grown[state->destination_count].parked = timer_none;
+	grown[state->destination_count].parked_tail = timer_none;
+	return (state->destination_count++);
+}
+
+/* send a due timer, returning false if its queue is full. */
+static bool
+schedule_send(struct Scheduler *state, uint32_t id)
+{
+	struct Wheel *wheel = &state->wheel;
+	struct Timer *timer = timer_at(wheel, id);
+	struct Destination *destination = &state->destinations[timer->target];
+
+	if (mq_send(destination->handle, timer->text, timer->length,
+	    timer->priority) != 0) {
+		if (errno == EAGAIN)
+			return (false);
+		warn("mq_send(schedule %s)", destination->name);
+	} else {
+		long long late = now_ns() -
+		    (state->origin + (long long)timer->due * state->tick_ns);
+
+		state->tally.messages++;
+		state->tally.bytes += timer->length;
+		state->late_sum += late;
+		if (late > state->late_worst)
+			state->late_worst = late;
+	}
+	wheel->pending--;
+	timer_free(wheel, id);
+	return (true);
+}
+
+/*
+ * Deliver a due timer. A full queue parks the timer behind any already
+ * waiting for that queue, so the queue keeps due order and the others are
+ * not held up; schedule() polls it for room.
+ */
+static void
+schedule_deliver(struct Scheduler *state, uint32_t id)
+{
+	struct Wheel *wheel = &state->wheel;
+	struct Timer *timer = timer_at(wheel, id);
+	struct Destination *destination = &state->destinations[timer->target];
+
+	if (destination->handle == fail) {
+		destination->handle = mq_open(destination->name,
+		    O_WRONLY | O_NONBLOCK);
+		if (destination->handle == fail) {
+			warn("mq_open(schedule %s)", destination->name);
+			wheel->pending--;
+			timer_free(wheel, id);
+			return;
+		}
+	}
+	if (destination->parked == timer_none && schedule_send(state, id))
+		return;
+
+	timer->next = timer_none;
+	if (destination->parked == timer_none)
+		destination->parked = id;
+	else
+		timer_at(wheel, destination->parked_tail)->next = id;
+	destination->parked_tail = id;
+	state->deferred++;
 }
 
-/* queue: name of queue to be removed. */
-static int
-rm(const char *queue)
+/* send the timers parked on a destination until its queue fills again. */
+static void
+schedule_unpark(struct Scheduler *state, struct Destination *destination)
 {
-	int result = mq_unlink(queue);
-
-	if (result != 0) {
-		errno_t what = errno;
+	while (destination->parked != timer_none) {
+		uint32_t id = destination->parked;
+		uint32_t next = timer_at(&state->wheel, id)->next;
 
-		warnc(what, "mq_unlink");
-		return (what);
+		if (!schedule_send(state, id))
+			return;
+		destination->parked = next;
 	}
-
-	return (result);
 }
 
-/* Return the display character for non-zero mode. */
-static char
-dual(mode_t mode, char display)
+/* accept one "AT QUEUE PRIORITY TEXT" line. */
+static void
+schedule_line(struct Scheduler *state, char *line)
 {
-	return (mode != 0 ? display : '-');
-}
+	char *fields[3] = {line, NULL, NULL};
+	char *cursor = strchr(line, ' ');
 
-/* Select one of four display characters based on mode and modifier. */
-static char
-quad(mode_t mode, mode_t modifier)
-{
-	static const char display[] = "-xSs";
-	unsigned index = 0;
-	if (mode != 0)
-		index += 1;
-	if (modifier)
-		index += 2;
-	return (display[index]);
+	if (cursor != NULL) {
+		fields[1] = cursor + 1;
+		fields[2] = strchr(fields[1], ' ');
+	}
+	if (fields[2] == NULL) {
+		warnx("bad schedule line [%s] ignored.", line);
+		return;
+	}
+	fields[2]++;
+	cursor = strchr(fields[2], ' ');
+	if (cursor == NULL)
+		cursor = fields[2] + strlen(fields[2]);
+	else
+		*cursor++ = 0;
+	fields[1][-1] = 0;
+	fields[2][-1] = 0;
+
+	long long at = 0;
+	char *end = NULL;
+	unsigned long q_priority = strtoul(fields[2], &end, 10);
+
+	if (!parse_instant(fields[0], &at)) {
+		warnx("bad schedule time [%s] ignored.", fields[0]);
+		return;
+	}
+	if (end == fields[2] || *end != 0 || q_priority >= MQ_PRIO_MAX) {
+		warnx("bad schedule priority [%s] ignored.", fields[2]);
+		return;
+	}
+	if (!sane_queue(fields[1]))
+		return;
+	if (shmq_named(fields[1])) {
+		warnx("schedule does not take shm: queue [%s]; line ignored.",
+		    fields[1]);
+		return;
+	}
+
+	struct Wheel *wheel = &state->wheel;
+	uint32_t id = timer_alloc(wheel);
+
+	if (id == timer_none) {
+		warnx("too many scheduled messages; [%s] ignored.", cursor);
+		return;
+	}
+
+	struct Timer *timer = timer_at(wheel, id);
+
+	timer->due = schedule_tick(state, at);
+	timer->target = schedule_destination(state, fields[1]);
+	timer->priority = q_priority;
+	timer->length = strlen(cursor);
+	timer->text = strdup(cursor);
+	if (timer->text == NULL)
+		err(1, "strdup(schedule)");
+	wheel->pending++;
+
+	if (timer->due <= wheel->now)
+		schedule_deliver(state, id);
+	else
+		wheel_insert(wheel, id);
 }
 
-/* queue: name of queue to be inspected. */
+/*
+ * Hold messages read as "AT QUEUE PRIORITY TEXT" lines from standard input,
+ * or one per message from the -q control queue, and send each when its
+ * time comes. Runs until the input ends and every message is delivered,
+ * until interrupted, or until the -T deadline passes.
+ */
 static int
-info(const char *queue)
+schedule(void)
 {
-	mqd_t handle = mq_open(queue, O_RDONLY);
+	struct Scheduler state = {
+		.wheel = {.free = timer_none},
+		.origin = now_ns(),
+		.tick_ns = tick_us * 1000LL,
+		.tally = {.started = now_ns()}
+	};
+	struct Wheel *wheel = &state.wheel;
+	const char *control_name = STAILQ_EMPTY(&queues) ? NULL :
+	    STAILQ_FIRST(&queues)->text;
+	mqd_t control = fail;
+	size_t size = schedule_line_max;
+	int result = 0;
+
+	memset(wheel->slots, 0xff, sizeof(wheel->slots));
+	if (control_name != NULL) {
+		struct mq_attr actual;
+
+		control = mq_open(control_name, O_RDONLY | O_NONBLOCK);
+		if (control == fail || mq_getattr(control, &actual) != 0) {
+			result = errno;
+			warnc(result, "mq_open(schedule %s)", control_name);
+			if (control != fail)
+				mq_close(control);
+			return (result);
+		}
+		size = actual.mq_msgsize;
+	}
 
-	if (handle == fail) {
-		errno_t what = errno;
+	char *input = malloc(size + 1);
+	size_t used = 0;
+	bool open_input = true;
+	bool skipping = false;
+	int input_fd = control == fail ? STDIN_FILENO : queue_fd(control);
+	/* the input, then each destination with parked timers. */
+	struct pollfd *waits = NULL;
+	uint32_t *blocked = NULL;
+	uint32_t wait_capacity = 0;
+
+	if (input == NULL)
+		err(1, "malloc(schedule)");
+
+	catch_signals();
+	while (!stopping) {
+		uint32_t expired = timer_none;
+
+		wheel_advance(wheel, schedule_tick(&state, now_ns()), &expired);
+		while (expired != timer_none) {
+			uint32_t next = timer_at(wheel, expired)->next;
+
+			schedule_deliver(&state, expired);
+			expired = next;
+		}
+		if (!open_input && wheel->pending == 0)
+			break;
+
+		int level = 0;
+		int slot = 0;
+		uint64_t next = wheel_next(wheel, &level, &slot);
+		long long wait_ns = 1000000000LL;
+
+		if (next != UINT64_MAX) {
+			long long at = state.origin +
+			    (long long)next * state.tick_ns;
+			long long due = at - now_ns();
+
+			/* sleeping would overshoot; spin to the tick instead. */
+			if (due <= replay_spin_ns) {
+				while (now_ns() < at && !stopping)
+					;
+				continue;
+			}
+			if (due - replay_spin_ns < wait_ns)
+				wait_ns = due - replay_spin_ns;
+		}
 
-		warnc(what, "mq_open(info)");
-		return (what);
-	}
+		long long pause = until_deadline(wait_ns);
 
-	struct mq_attr actual;
+		if (pause <= 0) {
+			result = ETIMEDOUT;
+			warnc(result, "schedule");
+			break;
+		}
 
-	int result = mq_getattr(handle, &actual);
-	if (result != 0) {
-		errno_t what = errno;
+		struct timespec interval = ns_timespec(pause);
 
-		warnc(what, "mq_getattr(info)");
-		return (what);
-	}
+		if (wait_capacity < state.destination_count + 1) {
+			wait_capacity = state.destination_count + 1;
+			waits = realloc(waits, wait_capacity * sizeof(*waits));
+			blocked = realloc(blocked,
+			    wait_capacity * sizeof(*blocked));
+			if (waits == NULL || blocked == NULL)
+				err(1, "realloc(schedule)");
+		}
 
-	fprintf(stdout,
-	    "queue: '%s'\nQSIZE: %lu\nMSGSIZE: %ld\nMAXMSG: %ld\n"
-	    "CURMSG: %ld\nflags: %03ld\n",
-	    queue, actual.mq_msgsize * actual.mq_curmsgs, actual.mq_msgsize,
-	    actual.mq_maxmsg, actual.mq_curmsgs, actual.mq_flags);
-#ifdef __FreeBSD__
+		nfds_t count = 1;
+
+		waits[0].fd = open_input ? input_fd : -1;
+		waits[0].events = POLLIN;
+		waits[0].revents = 0;
+		for (uint32_t i = 0; i < state.destination_count; i++) {
+			if (state.destinations[i].parked == timer_none)
+				continue;
+			blocked[count] = i;
+			waits[count].fd =
+			    queue_fd(state.destinations[i].handle);
+			waits[count].events = POLLOUT;
+			waits[count].revents = 0;
+			count++;
+		}
 
-	int fd = mq_getfd_np(handle);
-	struct stat status;
+		int ready = ppoll(waits, count, &interval, NULL);
 
-	result = fstat(fd, &status);
-	if (result != 0) {
-		warn("fstat(info)");
-	} else {
-		mode_t mode = status.st_mode;
+		for (nfds_t i = 1; ready > 0 && i < count; i++) {
+			if (waits[i].revents != 0)
+				schedule_unpark(&state,
+				    &state.destinations[blocked[i]]);
+		}
+		if (!open_input)
+			continue;
+
+		if (control != fail) {
+			/* one line per control message. */
+			ssize_t got;
+
+			while ((got = mq_receive(control, input, size,
+			    NULL)) >= 0) {
+				if (got > 0 && input[got - 1] == '\n')
+					got--;
+				input[got] = 0;
+				schedule_line(&state, input);
+			}
+			if (errno != EAGAIN) {
+				result = errno;
+				warnc(result, "mq_receive(schedule %s)",
+				    control_name);
+				break;
+			}
+			if (!creation.block)
+				open_input = false;
+			continue;
+		}
+		if (ready <= 0 || waits[0].revents == 0)
+			continue;
 
-		fprintf(stdout, "UID: %u\nGID: %u\n", status.st_uid, status.st_gid);
-		fprintf(stdout, "MODE: %c%c%c%c%c%c%c%c%c%c\n",
-		    dual(mode & S_ISVTX, 's'),
-		    dual(mode & S_IRUSR, 'r'),
-		    dual(mode & S_IWUSR, 'w'),
-		    quad(mode & S_IXUSR, mode & S_ISUID),
-		    dual(mode & S_IRGRP, 'r'),
-		    dual(mode & S_IWGRP, 'w'),
-		    quad(mode & S_IXGRP, mode & S_ISGID),
-		    dual(mode & S_IROTH, 'r'),
-		    dual(mode & S_IWOTH, 'w'),
-		    dual(mode & S_IXOTH, 'x'));
+		ssize_t got = read(STDIN_FILENO, input + used, size - used);
+
+		if (got < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			result = errno;
+			warnc(result, "read(schedule)");
+			break;
+		}
+		if (got == 0) {
+			/* a final line need not end in a newline. */
+			open_input = false;
+			input[used] = 0;
+			if (used > 0 && !skipping)
+				schedule_line(&state, input);
+			used = 0;
+			continue;
+		}
+		used += got;
+
+		char *line = input;
+		char *end;
+
+		while ((end = memchr(line, '\n', input + used - line)) != NULL) {
+			*end = 0;
+			if (!skipping && end > line)
+				schedule_line(&state, line);
+			skipping = false;
+			line = end + 1;
+		}
+		used -= line - input;
+		memmove(input, line, used);
+		if (used == size) {
+			warnx("schedule line longer than %zu bytes ignored.",
+			    size);
+			skipping = true;
+			used = 0;
+		}
 	}
-#endif /* __FreeBSD__ */
 
-	return (mq_close(handle));
+	if (wheel->pending > 0)
+		warnx("%llu scheduled message(s) discarded.", wheel->pending);
+
+	tally_report(stderr, "schedule", &state.tally);
+	if (state.tally.messages > 0)
+		fprintf(stderr, "schedule: lateness mean %.3f us, worst %.3f us, "
+		    "%llu deferral(s)\n",
+		    state.late_sum / 1e3 / state.tally.messages,
+		    state.late_worst / 1e3, state.deferred);
+
+	for (uint32_t i = 0; i < state.destination_count; i++) {
+		if (state.destinations[i].handle != fail)
+			mq_close(state.destinations[i].handle);
+		free(state.destinations[i].name);
+	}
+	for (uint32_t i = 0; i < wheel->chunk_count; i++) {
+		for (uint32_t j = 0; j < timer_chunk &&
+		    i * timer_chunk + j < wheel->used; j++)
+			free(wheel->chunks[i][j].text);
+		free(wheel->chunks[i]);
+	}
+	if (control != fail)
+		mq_close(control);
+	free(wheel->chunks);
+	free(state.destinations);
+	free(waits);
+	free(blocked);
+	free(input);
+	return (result);
 }
 
-/* queue: name of queue to drain one message. */
-static int
-recv(const char *queue)
+/* Benchmark */
+
+/* a consumer that gave up sets delivered to this. */
+static const unsigned long long bench_abandoned = ULLONG_MAX;
+
+/* one side of a bench run: a producer or a consumer of the same queue. */
+struct BenchSide {
+	struct Endpoint endpoint;
+	char *buffer;
+	size_t size;
+	unsigned long long done;
+	int result;
+	/* messages the consumer has taken, shared by both sides. */
+	_Atomic unsigned long long *delivered;
+	/* --pattern latency: nanoseconds each message spent in the queue. */
+	long long *samples;
+};
+
+static void *
+bench_produce(void *context)
 {
-	mqd_t handle = mq_open(queue, O_RDONLY);
+	struct BenchSide *side = context;
 
-	if (handle == fail) {
-		errno_t what = errno;
+	for (; side->done < (unsigned long long)bench_messages && !stopping;
+	    side->done++) {
+		if (bench_latency) {
+			unsigned long long seen;
 
-		warnc(what, "mq_open(recv)");
-		return (what);
-	}
+			/* one in flight: wait for the last to arrive. */
+			while ((seen = atomic_load(side->delivered)) < side->done)
+				sched_yield();
+			if (seen == bench_abandoned)
+				break;
 
-	struct mq_attr actual;
+			long long stamp = monotonic_ns();
 
-	int result = mq_getattr(handle, &actual);
+			memcpy(side->buffer, &stamp, sizeof(stamp));
+		}
+		if (endpoint_send(&side->endpoint, side->buffer, side->size,
+		    side->done % 4) != 0) {
+			if (errno == EINTR)
+				continue;
+			side->result = errno;
+			warnc(side->result, "send(bench)");
+			break;
+		}
+	}
+	return (NULL);
+}
 
-	if (result != 0) {
-		errno_t what = errno;
+static void *
+bench_consume(void *context)
+{
+	struct BenchSide *side = context;
+
+	while (side->done < (unsigned long long)bench_messages && !stopping) {
+		ssize_t got = endpoint_receive(&side->endpoint, side->buffer,
+		    side->size, NULL);
+
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			side->result = errno;
+			warnc(side->result, "receive(bench)");
+			break;
+		}
+		if (bench_latency) {
+			long long stamp;
 
-		warnc(what, "mq_attr(recv)");
-		mq_close(handle);
-		return (what);
+			memcpy(&stamp, side->buffer, sizeof(stamp));
+			side->samples[side->done] = monotonic_ns() - stamp;
+		}
+		atomic_store(side->delivered, ++side->done);
 	}
+	if (side->done < (unsigned long long)bench_messages)
+		atomic_store(side->delivered, bench_abandoned);
+	return (NULL);
+}
 
-	char *text = malloc(actual.mq_msgsize + 1);
-	unsigned q_priority = 0;
-
-	memset(text, 0, actual.mq_msgsize + 1);
-	result = mq_receive(handle, text, actual.mq_msgsize, &q_priority);
-	if (result < 0) {
-		errno_t what = errno;
+static int
+compare_ns(const void *left, const void *right)
+{
+	long long a = *(const long long *)left;
+	long long b = *(const long long *)right;
 
-		warnc(what, "mq_receive");
-		mq_close(handle);
-		return (what);
-	}
+	return ((a > b) - (a < b));
+}
 
-	fprintf(stdout, "[%u]: %-*.*s\n", q_priority, result, result, text);
-	return (mq_close(handle));
+/* print percentiles of the --pattern latency samples in microseconds. */
+static void
+bench_percentiles(const char *queue, long long *samples,
+    unsigned long long count)
+{
+	static const double points[] = {0.5, 0.9, 0.99, 0.999};
+
+	qsort(samples, count, sizeof(*samples), compare_ns);
+	fprintf(stdout, "%s: latency min %.2f", queue, samples[0] / 1e3);
+	for (size_t i = 0; i < sizeof(points) / sizeof(points[0]); i++)
+		fprintf(stdout, ", p%g %.2f", points[i] * 100,
+		    samples[(size_t)(points[i] * (count - 1))] / 1e3);
+	fprintf(stdout, ", max %.2f us\n", samples[count - 1] / 1e3);
 }
 
 /*
- * queue: name of queue to send one message.
- * text: message text.
- * q_priority: message priority in range of 0 to 63.
+ * Push -n messages of -s bytes through queue with one producer and one
+ * consumer thread, each with its own handle, and report the throughput.
+ * With --pattern latency the producer waits for each message to arrive
+ * before sending the next, and the time each one took is reported too.
  */
 static int
-send(const char *queue, const char *text, unsigned q_priority)
+bench(const char *queue)
 {
-	mqd_t handle = mq_open(queue, O_WRONLY);
-
-	if (handle == fail) {
-		errno_t what = errno;
-
-		warnc(what, "mq_open(send)");
-		return (what);
-	}
-
+	struct BenchSide producer = {0}, consumer = {0};
 	struct mq_attr actual;
+	int result = endpoint_open(&producer.endpoint, queue, O_WRONLY, 0, NULL);
 
-	int result = mq_getattr(handle, &actual);
-
+	if (result == 0)
+		result = endpoint_open(&consumer.endpoint, queue, O_RDONLY, 0,
+		    NULL);
+	if (result == 0 && endpoint_getattr(&consumer.endpoint, &actual) != 0)
+		result = errno;
 	if (result != 0) {
-		errno_t what = errno;
-
-		warnc(what, "mq_attr(send)");
-		mq_close(handle);
-		return (what);
+		warnc(result, "%s_open(bench %s)",
+		    producer.endpoint.transport->name, queue);
+		endpoint_close(&producer.endpoint);
+		endpoint_close(&consumer.endpoint);
+		return (result);
 	}
 
-	int size = strlen(text);
-
-	if (size > actual.mq_msgsize) {
-		warnx("truncating message to %ld characters.\n", actual.mq_msgsize);
-		size = actual.mq_msgsize;
+	producer.size = creation.size > 0 ? creation.size : actual.mq_msgsize;
+	if (producer.size > (size_t)actual.mq_msgsize) {
+		warnx("bench: %s holds at most %ld byte messages.", queue,
+		    actual.mq_msgsize);
+		producer.size = actual.mq_msgsize;
+	}
+	if (bench_latency && producer.size < sizeof(long long)) {
+		if (actual.mq_msgsize < (long)sizeof(long long)) {
+			warnx("bench: %s messages cannot hold a timestamp.",
+			    queue);
+			endpoint_close(&producer.endpoint);
+			endpoint_close(&consumer.endpoint);
+			return (EMSGSIZE);
+		}
+		producer.size = sizeof(long long);
+	}
+	consumer.size = actual.mq_msgsize;
+	producer.buffer = calloc(1, producer.size + 1);
+	consumer.buffer = malloc(consumer.size);
+	if (producer.buffer == NULL || consumer.buffer == NULL)
+		err(1, "malloc(bench)");
+	if (bench_latency) {
+		consumer.samples = malloc(bench_messages * sizeof(long long));
+		if (consumer.samples == NULL)
+			err(1, "malloc(bench)");
 	}
 
-	result = mq_send(handle, text, size, q_priority);
+	_Atomic unsigned long long delivered = 0;
 
-	if (result != 0) {
-		errno_t what = errno;
+	producer.delivered = consumer.delivered = &delivered;
 
-		warnc(what, "mq_send");
-		mq_close(handle);
-		return (what);
+	struct Tally tally = {.messages = 0, .bytes = 0, .started = now_ns()};
+	pthread_t pair[2];
+
+	result = pthread_create(&pair[0], NULL, bench_consume, &consumer);
+	if (result == 0) {
+		result = pthread_create(&pair[1], NULL, bench_produce,
+		    &producer);
+		if (result != 0) {
+			/* nothing is coming. */
+			warnc(result, "pthread_create");
+			pthread_cancel(pair[0]);
+		} else {
+			pthread_join(pair[1], NULL);
+		}
+		pthread_join(pair[0], NULL);
+	} else {
+		warnc(result, "pthread_create");
 	}
 
-	return (mq_close(handle));
+	tally.messages = consumer.done;
+	tally.bytes = consumer.done * producer.size;
+	tally_report(stdout, queue, &tally);
+	if (consumer.done > 0)
+		fprintf(stdout, "%s: %.1f ns/msg\n", queue,
+		    (double)(now_ns() - tally.started) / consumer.done);
+	if (consumer.done > 0 && bench_latency)
+		bench_percentiles(queue, consumer.samples, consumer.done);
+
+	if (result == 0)
+		result = producer.result != 0 ? producer.result :
+		    consumer.result;
+	free(producer.buffer);
+	free(consumer.buffer);
+	free(consumer.samples);
+	endpoint_close(&producer.endpoint);
+	endpoint_close(&consumer.endpoint);
+	return (result);
 }
 
 static void
 usage(FILE *file)
 {
 	fprintf(file,
-	    "usage:\n\tposixmqcontrol [rm|info|recv] -q <queue>\n"
+	    "usage:\n\tposixmqcontrol [rm|info] -q <queue> "
+	    "[ --shards <count> ]\n"
+	    "\tposixmqcontrol recv -q <queue> ... [ -T <timeout> ] "
+	    "[ --reassemble <bool> ] [ --unbatch <bool> ]\n"
 	    "\tposixmqcontrol create -q <queue> -s <maxsize> -d <maxdepth> "
 	    "[ -m <mode> ] [ -b <block> ] [-u <uid> ] [ -g <gid> ]\n"
+	    "\t\t[ --shards <count> ] [ --type mpmc|spsc ]\n"
 	    "\tposixmqcontrol send -q <queue> -c <content> "
-	    "[-p <priority> ]\n");
+	    "[-p <priority> ] [ -j <jobs> ] [ -T <timeout> ]\n"
+	    "\t\t[ -b <block> ] [ --spin <count> ] [ --backoff <usec> ] "
+	    "[ --max-wait <seconds> ] [ --spill-dir <dir> ]\n"
+	    "\t\t[ --shards <count> --key <key> ] "
+	    "[ --content-file <path> ]\n"
+	    "\t\t[ --large never|auto|always ] [ --fragment <bool> ] "
+	    "[ --batch <bool> [ --linger <usec> ] ]\n"
+	    "\tposixmqcontrol respill -q <queue> --spill-dir <dir> "
+	    "[ -b <block> ] [ -T <timeout> ] [ -j <jobs> ]\n"
+	    "\tposixmqcontrol relay -q <source> -t <target> "
+	    "[ -b <block> ] [ -T <timeout> ]\n"
+	    "\tposixmqcontrol tee -q <source> -t <target> ... "
+	    "[ --backlog <depth> ] [ --policy block|drop|spill ]\n"
+	    "\t\t[ --spill-dir <dir> ] [ -b <block> ] [ -T <timeout> ]\n"
+	    "\tposixmqcontrol merge -q <source> ... -t <target> "
+	    "[ -b <block> ] [ -T <timeout> ]\n"
+	    "\tposixmqcontrol route -q <source> -r <kind:match=/queue> ... "
+	    "--default <queue>\n"
+	    "\t\t[ -b <block> ] [ -T <timeout> ]\n"
+	    "\tposixmqcontrol consume -q <queue> ... [ --shards <count> ] "
+	    "[ --threads <count> ]\n"
+	    "\t\t[ --exec <command> [ --workers <count> ] ] "
+	    "[ --notify <bool> ] [ -b <block> ] [ -T <timeout> ]\n"
+	    "\tposixmqcontrol rehash --from <queue> ... --to <queue> ... "
+	    "--key <spec>\n"
+	    "\t\t[ -s <maxsize> ] [ -d <maxdepth> ] [ -m <mode> ] "
+	    "[ -b <block> ] [ -T <timeout> ]\n"
+	    "\tposixmqcontrol record -q <queue> ... -f <file> "
+	    "[ -b <block> ] [ -T <timeout> ]\n"
+	    "\tposixmqcontrol replay -f <file> -q <queue> "
+	    "[ --speed <factor>|max ] [ --skip <seconds> ]\n"
+	    "\t\t[ -b <block> ] [ -T <timeout> ]\n"
+	    "\tposixmqcontrol schedule [ -q <control> ] [ --tick <usec> ] "
+	    "[ -b <block> ] [ -T <timeout> ]\n"
+	    "\tposixmqcontrol bench -q <queue> ... [ -n <messages> ] "
+	    "[ -s <size> ]\n"
+	    "\t\t[ --pattern throughput|latency ] [ -T <timeout> ]\n"
+	    "\tposixmqcontrol purge -q <queue> ... [ --shards <count> ] "
+	    "[ -j <jobs> ]\n"
+	    "\tposixmqcontrol wait -q <queue> "
+	    "--until empty|nonempty|below:<count>|above:<count>\n"
+	    "\t\t[ -T <timeout> ]\n");
 }
 
 /* end of SUBCOMMANDS */
 
 #define _countof(arg) ((sizeof(arg)) / (sizeof((arg)[0])))
 
+/*
+ * exit status for an expired -T timeout, as timeout(1) uses. No sysexits
+ * code is free of other meanings: EX_TEMPFAIL already reports ENOTSUP.
+ */
+#define EX_TIMEOUT 124
+
 /* convert an errno style error code to a sysexits code. */
 static int
 grace(int err_number)
@@ -729,6 +7527,8 @@ grace(int err_number)
 		{ENODEV, EX_IOERR},
 		{ENOTSUP, EX_TEMPFAIL},
 		{EAGAIN, EX_IOERR},
+		/* a -T timeout expired. */
+		{ETIMEDOUT, EX_TIMEOUT},
 		{EPERM, EX_NOPERM},
 		{EACCES, EX_NOPERM},
 		{0, EX_OK}
@@ -754,6 +7554,44 @@ static const struct Option option_single_queue = {
 	.pattern = names_queue,
 	.parse = parse_single_queue,
 	.validate = validate_single_queue};
+static const char *names_source[] = {"-q", "--queue", "--from", NULL};
+static const struct Option option_source = {
+	.pattern = names_source,
+	.parse = parse_single_queue,
+	.validate = validate_single_queue};
+static const char *names_target[] = {"-t", "--to", NULL};
+static const struct Option option_single_target = {
+	.pattern = names_target,
+	.parse = parse_target,
+	.validate = validate_single_target};
+static const struct Option option_sources = {
+	.pattern = names_source,
+	.parse = parse_queue,
+	.validate = validate_queue};
+static const struct Option option_targets = {
+	.pattern = names_target,
+	.parse = parse_target,
+	.validate = validate_targets};
+static const char *names_rule[] = {"-r", "--rule", NULL};
+static const struct Option option_rule = {
+	.pattern = names_rule,
+	.parse = parse_rule,
+	.validate = validate_rules};
+static const char *names_default[] = {"--default", NULL};
+static const struct Option option_default = {
+	.pattern = names_default,
+	.parse = parse_default,
+	.validate = validate_default};
+static const char *names_backlog[] = {"--backlog", NULL};
+static const struct Option option_backlog = {
+	.pattern = names_backlog,
+	.parse = parse_backlog,
+	.validate = validate_backlog};
+static const char *names_policy[] = {"--policy", NULL};
+static const struct Option option_policy = {
+	.pattern = names_policy,
+	.parse = parse_policy,
+	.validate = validate_policy};
 static const char *names_depth[] = {"-d", "--depth", "--maxmsg", NULL};
 static const struct Option option_depth = {
 	.pattern = names_depth,
@@ -780,6 +7618,158 @@ static const struct Option option_priority = {
 	.pattern = names_priority,
 	.parse = parse_priority,
 	.validate = validate_always_true};
+static const char *names_jobs[] = {"-j", "--jobs", "--parallel", NULL};
+static const struct Option option_jobs = {
+	.pattern = names_jobs,
+	.parse = parse_jobs,
+	.validate = validate_jobs};
+static const char *names_timeout[] = {"-T", "--timeout", NULL};
+static const struct Option option_timeout = {
+	.pattern = names_timeout,
+	.parse = parse_timeout,
+	.validate = validate_always_true};
+static const char *names_spin[] = {"--spin", NULL};
+static const struct Option option_spin = {
+	.pattern = names_spin,
+	.parse = parse_spin,
+	.validate = validate_retry};
+static const char *names_backoff[] = {"--backoff", NULL};
+static const struct Option option_backoff = {
+	.pattern = names_backoff,
+	.parse = parse_backoff,
+	.validate = validate_always_true};
+static const char *names_max_wait[] = {"--max-wait", NULL};
+static const struct Option option_max_wait = {
+	.pattern = names_max_wait,
+	.parse = parse_max_wait,
+	.validate = validate_always_true};
+static const char *names_spill_dir[] = {"--spill-dir", NULL};
+static const struct Option option_spill_dir = {
+	.pattern = names_spill_dir,
+	.parse = parse_spill_dir,
+	.validate = validate_always_true};
+static const struct Option option_required_spill_dir = {
+	.pattern = names_spill_dir,
+	.parse = parse_spill_dir,
+	.validate = validate_spill_dir};
+static const char *names_shards[] = {"--shards", NULL};
+static const struct Option option_shards = {
+	.pattern = names_shards,
+	.parse = parse_shards,
+	.validate = validate_shards};
+static const char *names_key[] = {"-k", "--key", NULL};
+static const struct Option option_key = {
+	.pattern = names_key,
+	.parse = parse_key,
+	.validate = validate_key};
+static const char *names_threads[] = {"--threads", NULL};
+static const struct Option option_threads = {
+	.pattern = names_threads,
+	.parse = parse_threads,
+	.validate = validate_threads};
+static const struct Option option_key_spec = {
+	.pattern = names_key,
+	.parse = parse_key_spec,
+	.validate = validate_key_spec};
+static const char *names_exec[] = {"-e", "--exec", NULL};
+static const struct Option option_exec = {
+	.pattern = names_exec,
+	.parse = parse_exec,
+	.validate = validate_always_true};
+static const char *names_notify[] = {"--notify", NULL};
+static const struct Option option_notify = {
+	.pattern = names_notify,
+	.parse = parse_notify,
+	.validate = validate_notify};
+static const char *names_workers[] = {"--workers", NULL};
+static const struct Option option_workers = {
+	.pattern = names_workers,
+	.parse = parse_workers,
+	.validate = validate_workers};
+static const char *names_file[] = {"-f", "--file", NULL};
+static const struct Option option_file = {
+	.pattern = names_file,
+	.parse = parse_file,
+	.validate = validate_file};
+static const char *names_speed[] = {"--speed", NULL};
+static const struct Option option_speed = {
+	.pattern = names_speed,
+	.parse = parse_speed,
+	.validate = validate_always_true};
+static const char *names_skip[] = {"--skip", NULL};
+static const struct Option option_skip = {
+	.pattern = names_skip,
+	.parse = parse_skip,
+	.validate = validate_always_true};
+static const char *names_control[] = {"-q", "--queue", "--control", NULL};
+static const struct Option option_control = {
+	.pattern = names_control,
+	.parse = parse_single_queue,
+	.validate = validate_always_true};
+static const char *names_tick[] = {"--tick", NULL};
+static const struct Option option_tick = {
+	.pattern = names_tick,
+	.parse = parse_tick,
+	.validate = validate_tick};
+static const char *names_messages[] = {"-n", "--messages", NULL};
+static const struct Option option_messages = {
+	.pattern = names_messages,
+	.parse = parse_messages,
+	.validate = validate_messages};
+static const char *names_until[] = {"--until", NULL};
+static const struct Option option_until = {
+	.pattern = names_until,
+	.parse = parse_until,
+	.validate = validate_until};
+static const char *names_pattern[] = {"--pattern", NULL};
+static const struct Option option_pattern = {
+	.pattern = names_pattern,
+	.parse = parse_pattern,
+	.validate = validate_always_true};
+static const struct Option option_message_size = {
+	.pattern = names_size,
+	.parse = parse_size,
+	.validate = validate_always_true};
+static const char *names_content_file[] = {"--content-file", NULL};
+static const struct Option option_content_file = {
+	.pattern = names_content_file,
+	.parse = parse_content_file,
+	.validate = validate_always_true};
+static const char *names_large[] = {"--large", NULL};
+static const struct Option option_large = {
+	.pattern = names_large,
+	.parse = parse_large,
+	.validate = validate_large};
+static const char *names_fragment[] = {"--fragment", NULL};
+static const struct Option option_fragment = {
+	.pattern = names_fragment,
+	.parse = parse_fragment,
+	.validate = validate_fragment};
+static const char *names_reassemble[] = {"--reassemble", NULL};
+static const struct Option option_reassemble = {
+	.pattern = names_reassemble,
+	.parse = parse_reassemble,
+	.validate = validate_always_true};
+static const char *names_batch[] = {"--batch", NULL};
+static const struct Option option_batch = {
+	.pattern = names_batch,
+	.parse = parse_batch,
+	.validate = validate_batch};
+static const char *names_linger[] = {"--linger", NULL};
+static const struct Option option_linger = {
+	.pattern = names_linger,
+	.parse = parse_linger,
+	.validate = validate_linger};
+static const char *names_unbatch[] = {"--unbatch", NULL};
+static const struct Option option_unbatch = {
+	.pattern = names_unbatch,
+	.parse = parse_unbatch,
+	.validate = validate_always_true};
+static const char *names_type[] = {"--type", NULL};
+static const struct Option option_type = {
+	.pattern = names_type,
+	.parse = parse_type,
+	.validate = validate_type};
 static const char *names_mode[] = {"-m", "--mode", NULL};
 static const struct Option option_mode = {
 	.pattern = names_mode,
@@ -800,22 +7790,67 @@ static const struct Option option_user = {
 #ifdef __FreeBSD__
 static const struct Option *create_options[] = {
 	&option_queue, &option_depth, &option_size, &option_block,
-	&option_mode, &option_group, &option_user, NULL};
+	&option_mode, &option_group, &option_user, &option_shards,
+	&option_type, NULL};
 #else  /* !__FreeBSD__ */
 static const struct Option *create_options[] = {
 	&option_queue, &option_depth, &option_size, &option_block,
-	&option_mode, NULL};
+	&option_mode, &option_shards, &option_type, NULL};
 #endif /* __FreeBSD__ */
-static const struct Option *info_options[] = {&option_queue, NULL};
-static const struct Option *unlink_options[] = {&option_queue, NULL};
-static const struct Option *recv_options[] = {&option_single_queue, NULL};
+static const struct Option *info_options[] = {
+	&option_queue, &option_shards, NULL};
+static const struct Option *unlink_options[] = {
+	&option_queue, &option_shards, NULL};
+static const struct Option *recv_options[] = {
+	&option_queue, &option_timeout, &option_reassemble,
+	&option_unbatch, NULL};
 static const struct Option *send_options[] = {
-	&option_queue, &option_content, &option_priority, NULL};
+	&option_queue, &option_content, &option_priority, &option_jobs,
+	&option_timeout, &option_block, &option_spin, &option_backoff,
+	&option_max_wait, &option_spill_dir, &option_shards, &option_key,
+	&option_content_file, &option_large, &option_fragment, &option_batch,
+	&option_linger, NULL};
+static const struct Option *relay_options[] = {
+	&option_source, &option_single_target, &option_block, &option_timeout,
+	NULL};
+static const struct Option *tee_options[] = {
+	&option_source, &option_targets, &option_backlog, &option_policy,
+	&option_spill_dir, &option_block, &option_timeout, NULL};
+static const struct Option *merge_options[] = {
+	&option_sources, &option_single_target, &option_block, &option_timeout,
+	NULL};
+static const struct Option *route_options[] = {
+	&option_source, &option_rule, &option_default, &option_block,
+	&option_timeout, NULL};
+static const struct Option *consume_options[] = {
+	&option_queue, &option_shards, &option_threads, &option_exec,
+	&option_workers, &option_notify, &option_block, &option_timeout, NULL};
+static const struct Option *rehash_options[] = {
+	&option_sources, &option_targets, &option_key_spec, &option_size,
+	&option_depth, &option_mode, &option_block, &option_timeout, NULL};
+static const struct Option *record_options[] = {
+	&option_queue, &option_file, &option_block, &option_timeout, NULL};
+static const struct Option *replay_options[] = {
+	&option_file, &option_single_queue, &option_speed, &option_skip,
+	&option_block, &option_timeout, NULL};
+static const struct Option *schedule_options[] = {
+	&option_control, &option_tick, &option_block, &option_timeout, NULL};
+static const struct Option *purge_options[] = {
+	&option_queue, &option_shards, &option_jobs, NULL};
+static const struct Option *wait_options[] = {
+	&option_single_queue, &option_until, &option_timeout, NULL};
+static const struct Option *bench_options[] = {
+	&option_queue, &option_messages, &option_message_size, &option_pattern,
+	&option_timeout, NULL};
+static const struct Option *respill_options[] = {
+	&option_queue, &option_required_spill_dir, &option_block,
+	&option_timeout, &option_jobs, NULL};
 
 int
 main(int argc, const char *argv[])
 {
 	STAILQ_INIT(&queues);
+	STAILQ_INIT(&targets);
 	STAILQ_INIT(&contents);
 
 	if (argc > 1) {
@@ -828,6 +7863,9 @@ main(int argc, const char *argv[])
 				int worst = 0;
 				struct element *itq;
 
+				if (shards > 0)
+					shard_queues(-1);
+
 				STAILQ_FOREACH(itq, &queues, links) {
 					const char *queue = itq->text;
 
@@ -848,7 +7886,8 @@ main(int argc, const char *argv[])
 
 				STAILQ_FOREACH(itq, &queues, links) {
 					const char *queue = itq->text;
-					int result = info(queue);
+					int result = shards > 0 ?
+					    info_group(queue) : info(queue);
 
 					if (result != 0)
 						worst = result;
@@ -861,31 +7900,152 @@ main(int argc, const char *argv[])
 		} else if (strcmp("send", verb) == 0) {
 			parse_options(index, argc, argv, send_options);
 			if (validate_options(send_options)) {
+				if (shards > 0)
+					shard_queues(hash_key(key, strlen(key)) %
+					    shards);
+
+				int worst = send_streaming() ? send_stream() :
+				    fan_out(&queues, send_contents);
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("relay", verb) == 0) {
+			parse_options(index, argc, argv, relay_options);
+			if (validate_options(relay_options) &&
+			    kernel_only("relay")) {
+				int worst = relay(STAILQ_FIRST(&queues)->text,
+				    STAILQ_FIRST(&targets)->text);
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("tee", verb) == 0) {
+			parse_options(index, argc, argv, tee_options);
+			if (validate_options(tee_options) &&
+			    kernel_only("tee")) {
+				int worst = tee_queue(STAILQ_FIRST(&queues)->text);
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("merge", verb) == 0) {
+			parse_options(index, argc, argv, merge_options);
+			if (validate_options(merge_options) &&
+			    kernel_only("merge")) {
+				int worst = merge(STAILQ_FIRST(&targets)->text);
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("route", verb) == 0) {
+			parse_options(index, argc, argv, route_options);
+			if (validate_options(route_options) &&
+			    kernel_only("route")) {
+				int worst = route(STAILQ_FIRST(&queues)->text);
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("consume", verb) == 0) {
+			parse_options(index, argc, argv, consume_options);
+			if (validate_options(consume_options) &&
+			    kernel_only("consume")) {
+				if (shards > 0)
+					shard_queues(-1);
+
+				int worst = consume();
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("rehash", verb) == 0) {
+			parse_options(index, argc, argv, rehash_options);
+			if (validate_options(rehash_options) &&
+			    kernel_only("rehash")) {
+				int worst = rehash();
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("record", verb) == 0) {
+			parse_options(index, argc, argv, record_options);
+			if (validate_options(record_options) &&
+			    kernel_only("record")) {
+				int worst = record();
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("replay", verb) == 0) {
+			parse_options(index, argc, argv, replay_options);
+			if (validate_options(replay_options) &&
+			    kernel_only("replay")) {
+				int worst = replay(STAILQ_FIRST(&queues)->text);
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("schedule", verb) == 0) {
+			parse_options(index, argc, argv, schedule_options);
+			if (validate_options(schedule_options) &&
+			    kernel_only("schedule")) {
+				int worst = schedule();
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("bench", verb) == 0) {
+			parse_options(index, argc, argv, bench_options);
+			if (validate_options(bench_options)) {
 				int worst = 0;
 				struct element *itq;
 
 				STAILQ_FOREACH(itq, &queues, links) {
-					const char *queue = itq->text;
-					struct element *itc;
+					int result = bench(itq->text);
 
-					STAILQ_FOREACH(itc, &contents, links) {
-						const char *content = itc->text;
-						int result = send(queue, content, priority);
-
-						if (result != 0)
-							worst = result;
-					}
+					if (result != 0)
+						worst = result;
 				}
 
 				return (grace(worst));
 			}
 			return (EX_USAGE);
+		} else if (strcmp("purge", verb) == 0) {
+			parse_options(index, argc, argv, purge_options);
+			if (validate_options(purge_options)) {
+				if (shards > 0)
+					shard_queues(-1);
+
+				int worst = fan_out(&queues, purge);
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("wait", verb) == 0) {
+			parse_options(index, argc, argv, wait_options);
+			if (validate_options(wait_options)) {
+				const char *queue = STAILQ_FIRST(&queues)->text;
+				int worst = wait_depth(queue);
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
+		} else if (strcmp("respill", verb) == 0) {
+			parse_options(index, argc, argv, respill_options);
+			if (validate_options(respill_options)) {
+				int worst = fan_out(&queues, respill);
+
+				return (grace(worst));
+			}
+			return (EX_USAGE);
 		} else if (strcmp("recv", verb) == 0 ||
 		    strcmp("receive", verb) == 0) {
 			parse_options(index, argc, argv, recv_options);
 			if (validate_options(recv_options)) {
-				const char *queue = STAILQ_FIRST(&queues)->text;
-				int worst = recv(queue);
+				struct element *first = STAILQ_FIRST(&queues);
+				int worst = STAILQ_NEXT(first, links) == NULL ?
+				    recv(first->text) : recv_any();
 
 				return (grace(worst));
 			}
@@ -898,6 +8058,9 @@ main(int argc, const char *argv[])
 				int worst = 0;
 				struct element *itq;
 
+				if (shards > 0)
+					shard_queues(-1);
+
 				STAILQ_FOREACH(itq, &queues, links) {
 					const char *queue = itq->text;
 					int result = rm(queue);
@@ -0,0 +1,73 @@
+#!/bin/sh
+# exercises send --batch and --linger, and recv --unbatch.
+
+subject='./build/posixmqcontrol'
+topic='/test123batch'
+
+${subject} info -q "$topic"
+if [ $? == 0 ]; then
+  echo "sorry, $topic exists."
+  exit 1
+fi
+
+${subject} create -q "$topic" -s 64 -d 8
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+# a batch is sent over one descriptor; it cannot also spill.
+${subject} send -q "$topic" -c - --batch true --spill-dir /tmp < /dev/null
+if [ $? != 64 ]; then
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+# three short lines travel as one message.
+printf 'one\ntwo\nthree\n' | \
+  ${subject} send -q "$topic" -c - -p 6 --batch true 2>/dev/null
+if [ $? != 0 ]; then
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+EXPECTED='CURMSG: 1'
+ACTUAL=$( ${subject} info -q "$topic" | grep CURMSG )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+EXPECTED='[6]: one
+[6]: two
+[6]: three'
+ACTUAL=$( ${subject} recv -q "$topic" --unbatch true -T 1 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+# a record that waits past --linger goes out without the next one.
+( echo early; sleep 1; echo late ) | \
+  ${subject} send -q "$topic" -c - --batch true --linger 1000 2>/dev/null
+if [ $? != 0 ]; then
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+EXPECTED='CURMSG: 2'
+ACTUAL=$( ${subject} info -q "$topic" | grep CURMSG )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+${subject} rm -q "$topic"
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
@@ -0,0 +1,114 @@
+#!/bin/sh
+# exercises consume -e: framed delivery to two handlers, a message put
+# back by a handler that dies holding it, and a handler that exits at once.
+
+subject='./build/posixmqcontrol'
+topic='/test123exec'
+scratch=$( mktemp -d )
+
+${subject} info -q "$topic"
+if [ $? == 0 ]; then
+  echo "sorry, $topic exists."
+  exit 1
+fi
+
+cleanup() {
+  rm -rf "$scratch"
+  ${subject} rm -q "$topic"
+}
+
+${subject} create -q "$topic" -s 64 -d 8
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+# reads "length priority", then exactly length bytes; the first handler to
+# see 'die' exits without answering.
+cat > "$scratch/handler" <<EOF
+while read length priority; do
+  body=\$( dd bs=1 count=\$length 2>/dev/null )
+  if [ "\$body" = 'die' ] && mkdir "$scratch/died" 2>/dev/null; then
+    exit 3
+  fi
+  echo "[\$priority] \$body"
+done
+EOF
+
+${subject} send -q "$topic" -c 'one' -p 5 && \
+${subject} send -q "$topic" -c 'two words' -p 4 && \
+${subject} send -q "$topic" -c 'three' -p 3
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+EXPECTED='[3] three
+[4] two words
+[5] one'
+ACTUAL=$( ${subject} consume -q "$topic" -e "sh $scratch/handler" \
+  --workers 2 -b false -T 10 2> "$scratch/stderr" )
+code=$?
+ACTUAL=$( echo "$ACTUAL" | sort )
+if [ "$ACTUAL" != "$EXPECTED" ] || [ $code != 0 ] || \
+  [ $( grep -c 'handler [01] pid .* exit 0' "$scratch/stderr" ) != 2 ]; then
+  echo "$ACTUAL"
+  cat "$scratch/stderr"
+  cleanup
+  exit 1
+fi
+
+# the message the dying handler held goes back and is handled again.
+${subject} send -q "$topic" -c 'one' -p 5 && \
+${subject} send -q "$topic" -c 'die' -p 4 && \
+${subject} send -q "$topic" -c 'three' -p 3
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+EXPECTED='[5] one
+[4] die
+[3] three'
+ACTUAL=$( ${subject} consume -q "$topic" -e "sh $scratch/handler" \
+  --workers 1 -b false -T 10 2> "$scratch/stderr" )
+if [ "$ACTUAL" != "$EXPECTED" ] || \
+  ! grep -q 'exited holding a message' "$scratch/stderr"; then
+  echo "$ACTUAL"
+  cat "$scratch/stderr"
+  cleanup
+  exit 1
+fi
+
+# a handler that exits at once is not restarted; its message stays.
+${subject} send -q "$topic" -c 'kept' -p 2
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+${subject} consume -q "$topic" -e 'exit 0' --workers 1 -b false -T 10 \
+  2> "$scratch/stderr"
+code=$?
+if [ $code == 0 ] || ! grep -q 'not restarted' "$scratch/stderr"; then
+  echo $code
+  cat "$scratch/stderr"
+  cleanup
+  exit 1
+fi
+
+EXPECTED='[2]: kept'
+ACTUAL=$( ${subject} recv -q "$topic" -T 1 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+cleanup
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
@@ -0,0 +1,75 @@
+#!/bin/sh
+# exercises fragments reassembled from a queue of another message size.
+
+subject='./build/posixmqcontrol'
+narrow='/test123fragment'
+wide='/test123fragmentwide'
+
+for topic in "$narrow" "$wide"; do
+  ${subject} info -q "$topic"
+  if [ $? == 0 ]; then
+    echo "sorry, $topic exists."
+    exit 1
+  fi
+done
+
+cleanup() {
+  ${subject} rm -q "$narrow" -q "$wide"
+}
+
+${subject} create -q "$narrow" -s 128 -d 16 && \
+${subject} create -q "$wide" -s 512 -d 16
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+text=$(printf '%0900d' 5)
+
+${subject} send -q "$narrow" -c "$text" -p 2 --fragment true
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+# the fragments keep the size they were cut to in the wider queue.
+ignore=$( ${subject} relay -q "$narrow" -t "$wide" -b false )
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+EXPECTED="[2]: $text"
+ACTUAL=$( ${subject} recv -q "$wide" --reassemble true -T 1 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+# a spilled record would be cut to the message size on respill.
+spill=$( mktemp -d )
+${subject} send -q "$narrow" -c "$text" --fragment true --spill-dir "$spill"
+code=$?
+rm -rf "$spill"
+if [ $code != 64 ]; then
+  echo $code
+  cleanup
+  exit 1
+fi
+
+EXPECTED="$narrow: 0 message(s),"
+ACTUAL=$( ${subject} purge -q "$narrow" | cut -d' ' -f1-3 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+cleanup
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
@@ -0,0 +1,80 @@
+#!/bin/sh
+# exercises a payload larger than the queue message size, and tee of one.
+
+subject='./build/posixmqcontrol'
+topic='/test123large'
+one='/test123large1'
+two='/test123large2'
+payload="/tmp/posixmqcontroltest.$$.txt"
+
+for queue in "$topic" "$one" "$two"; do
+  ${subject} info -q "$queue"
+  if [ $? == 0 ]; then
+    echo "sorry, $queue exists."
+    exit 1
+  fi
+done
+
+cleanup() {
+  ${subject} rm -q "$topic" -q "$one" -q "$two"
+}
+
+for queue in "$topic" "$one" "$two"; do
+  ${subject} create -q "$queue" -s 128 -d 4
+  if [ $? != 0 ]; then
+    cleanup
+    exit 1
+  fi
+done
+
+text=$(printf '%04096d' 7)
+printf '%s' "$text" > "$payload"
+
+${subject} send -q "$topic" -p 3 --content-file "$payload" --large auto
+if [ $? != 0 ]; then
+  cleanup
+  rm -f "$payload"
+  exit 1
+fi
+rm -f "$payload"
+
+expected="[3]: $text"
+actual=$(${subject} recv -q "$topic")
+if [ "$expected" != "$actual" ]; then
+  echo "EXPECTED: $expected"
+  echo "  ACTUAL: $actual"
+  cleanup
+  exit 1
+fi
+
+# every tee target reads the one segment; the last read removes it.
+printf '%s' "$text" > "$payload"
+${subject} send -q "$topic" -p 3 --content-file "$payload" --large auto
+code=$?
+rm -f "$payload"
+ignore=$( ${subject} tee -q "$topic" -t "$one" -t "$two" -b false )
+if [ $? != 0 ] || [ $code != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+actual=$(${subject} recv -q "$one")
+if [ "$expected" != "$actual" ]; then
+  echo "  ACTUAL: $actual"
+  cleanup
+  exit 1
+fi
+actual=$(${subject} recv -q "$two")
+if [ "$expected" != "$actual" ]; then
+  echo "  ACTUAL: $actual"
+  cleanup
+  exit 1
+fi
+
+cleanup
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
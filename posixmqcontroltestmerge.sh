@@ -0,0 +1,83 @@
+#!/bin/sh
+# exercises merge priority order across sources, and tee copies.
+
+subject='./build/posixmqcontrol'
+one='/test123merge1'
+two='/test123merge2'
+target='/test123merge'
+
+for topic in "$one" "$two" "$target"; do
+  ${subject} info -q "$topic"
+  if [ $? == 0 ]; then
+    echo "sorry, $topic exists."
+    exit 1
+  fi
+done
+
+cleanup() {
+  ${subject} rm -q "$one" -q "$two" -q "$target"
+}
+
+for topic in "$one" "$two" "$target"; do
+  ${subject} create -q "$topic" -s 64 -d 8
+  if [ $? != 0 ]; then
+    cleanup
+    exit 1
+  fi
+done
+
+${subject} send -q "$one" -c 'low' -p 1 && \
+${subject} send -q "$one" -c 'high' -p 9 && \
+${subject} send -q "$two" -c 'middle' -p 5 && \
+${subject} send -q "$two" -c 'highest' -p 12
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+ignore=$( ${subject} merge -q "$one" -q "$two" -t "$target" -b false )
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+EXPECTED='[12]: highest
+[9]: high
+[5]: middle
+[1]: low'
+ACTUAL=$( for i in 1 2 3 4; do ${subject} recv -q "$target" -T 1; done )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+# tee copies each message of the source to every target.
+${subject} send -q "$target" -c 'copied' -p 4
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+ignore=$( ${subject} tee -q "$target" -t "$one" -t "$two" -b false )
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+EXPECTED='[4]: copied
+[4]: copied'
+ACTUAL=$( ${subject} recv -q "$one" -T 1; ${subject} recv -q "$two" -T 1 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+cleanup
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
@@ -0,0 +1,70 @@
+#!/bin/sh
+# exercises consume --notify, including a queue another process has armed.
+
+subject='./build/posixmqcontrol'
+busy='/test123notify'
+armed='/test123notifyarmed'
+output="/tmp/posixmqcontroltest.$$.txt"
+
+for topic in "$busy" "$armed"; do
+  ${subject} info -q "$topic"
+  if [ $? == 0 ]; then
+    echo "sorry, $topic exists."
+    exit 1
+  fi
+done
+
+cleanup() {
+  ${subject} rm -q "$busy" -q "$armed"
+  rm -f "$output"
+}
+
+${subject} create -q "$busy" -s 64 -d 8 && \
+${subject} create -q "$armed" -s 64 -d 8
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+# a stopped consumer keeps the notification of one queue to itself.
+${subject} consume --notify true -q "$armed" > /dev/null 2>&1 &
+holder=$!
+sleep 0.3
+kill -STOP $holder
+
+${subject} send -q "$busy" -c 'waiting' -p 1
+${subject} consume --notify true -q "$busy" -q "$armed" > "$output" \
+  2> /dev/null &
+consumer=$!
+sleep 0.3
+
+# the armed queue is only swept; a busy queue must not hold the sweep off.
+${subject} send -q "$armed" -c 'swept' -p 2
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  ${subject} send -q "$busy" -c "busy $i" -p 1
+  sleep 0.2
+done
+
+kill -INT $consumer
+wait $consumer
+kill -CONT $holder
+kill -INT $holder
+wait $holder
+
+EXPECTED='[1]: waiting
+[2]: swept
+12'
+ACTUAL=$( grep -e waiting -e swept "$output"; grep -c '^\[' "$output" )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+cleanup
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
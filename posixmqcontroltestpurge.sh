@@ -0,0 +1,71 @@
+#!/bin/sh
+# exercises purge: the queue ends empty and keeps its attributes and mode.
+
+subject='./build/posixmqcontrol'
+topic='/test123purge'
+
+${subject} info -q "$topic"
+if [ $? == 0 ]; then
+  echo "sorry, $topic exists."
+  exit 1
+fi
+
+${subject} create -q "$topic" -s 64 -d 8 -m 0640
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+for i in 1 2 3 4 5; do
+  ${subject} send -q "$topic" -c "message $i"
+  if [ $? != 0 ]; then
+    ${subject} rm -q "$topic"
+    exit 1
+  fi
+done
+
+before=$( ${subject} info -q "$topic" | grep -e MAXMSG -e MSGSIZE -e MODE )
+
+EXPECTED="$topic: 5 message(s), 45 byte(s)"
+ACTUAL=$( ${subject} purge -q "$topic" | cut -d' ' -f1-5 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+# the queue is empty; wait returns at once.
+${subject} wait -q "$topic" --until empty -T 1
+if [ $? != 0 ]; then
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+# a space may stand for the colon.
+${subject} wait -q "$topic" --until 'below 1' -T 1
+if [ $? != 0 ]; then
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+# the queue holds at most 8; above:8 can never be met.
+${subject} wait -q "$topic" --until above:8 -T 5
+code=$?
+if [ $code == 0 ] || [ $code == 124 ]; then
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+after=$( ${subject} info -q "$topic" | grep -e MAXMSG -e MSGSIZE -e MODE )
+if [ "$before" != "$after" ]; then
+  echo "$after"
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+${subject} rm -q "$topic"
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
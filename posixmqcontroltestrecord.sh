@@ -0,0 +1,73 @@
+#!/bin/sh
+# exercises record into a traffic log and replay of the log.
+
+subject='./build/posixmqcontrol'
+source='/test123record'
+target='/test123replay'
+log="/tmp/posixmqcontroltest.$$.log"
+
+for topic in "$source" "$target"
+do
+  ${subject} info -q "$topic"
+  if [ $? == 0 ]; then
+    echo "sorry, $topic exists."
+    exit 1
+  fi
+done
+
+${subject} create -q "$source" -s 32 -d 8
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+${subject} create -q "$target" -s 32 -d 8
+if [ $? != 0 ]; then
+  ${subject} rm -q "$source"
+  exit 1
+fi
+
+${subject} send -q "$source" -p 1 -c 'low priority.' -c 'also low.'
+${subject} send -q "$source" -p 9 -c 'high priority.'
+
+# drain the source into the log and stop.
+ignore=$( ${subject} record -q "$source" -f "$log" -b false 2>&1 )
+if [ $? != 0 ]; then
+  ${subject} rm -q "$source" -q "$target"
+  rm -f "$log"
+  exit 1
+fi
+
+ignore=$( ${subject} replay -f "$log" -q "$target" --speed max 2>&1 )
+if [ $? != 0 ]; then
+  ${subject} rm -q "$source" -q "$target"
+  rm -f "$log"
+  exit 1
+fi
+rm -f "$log"
+
+expected='CURMSG: 3'
+actual=$(${subject} info -q "$target" | grep 'CURMSG: ')
+if [ "$expected" != "$actual" ]; then
+  echo "EXPECTED: $expected"
+  echo "  ACTUAL: $actual"
+  ${subject} rm -q "$source" -q "$target"
+  exit 1
+fi
+
+# priority survives the round trip.
+expected='[9]: high priority.'
+actual=$(${subject} recv -q "$target")
+if [ "$expected" != "$actual" ]; then
+  echo "EXPECTED: $expected"
+  echo "  ACTUAL: $actual"
+  ${subject} rm -q "$source" -q "$target"
+  exit 1
+fi
+
+${subject} rm -q "$source" -q "$target"
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
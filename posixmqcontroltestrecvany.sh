@@ -0,0 +1,66 @@
+#!/bin/sh
+# exercises recv from several queues at once, kernel and shm: alike.
+
+subject='./build/posixmqcontrol'
+one='/test123recvany1'
+two='/test123recvany2'
+shared='shm:/test123recvany'
+
+for topic in "$one" "$two" "$shared"; do
+  ${subject} info -q "$topic"
+  if [ $? == 0 ]; then
+    echo "sorry, $topic exists."
+    exit 1
+  fi
+done
+
+cleanup() {
+  ${subject} rm -q "$one" -q "$two" -q "$shared"
+}
+
+for topic in "$one" "$two" "$shared"; do
+  ${subject} create -q "$topic" -s 64 -d 4
+  if [ $? != 0 ]; then
+    cleanup
+    exit 1
+  fi
+done
+
+# nothing anywhere: the deadline passes.
+${subject} recv -q "$one" -q "$two" -q "$shared" -T 0.2
+if [ $? != 124 ]; then
+  cleanup
+  exit 1
+fi
+
+# one message waiting in the second queue is taken at once.
+${subject} send -q "$two" -c 'waiting' -p 3
+EXPECTED='[3]: waiting'
+ACTUAL=$( ${subject} recv -q "$one" -q "$two" -q "$shared" -T 1 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+# a sleeping recv wakes for a kernel queue, then for a shm: queue.
+( sleep 0.3; ${subject} send -q "$one" -c 'kernel' -p 1;
+  sleep 0.3; ${subject} send -q "$shared" -c 'shared' -p 2 ) &
+EXPECTED='[1]: kernel
+[2]: shared'
+ACTUAL=$( ${subject} recv -q "$one" -q "$two" -q "$shared" -T 2;
+  ${subject} recv -q "$one" -q "$two" -q "$shared" -T 2 )
+wait
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+cleanup
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
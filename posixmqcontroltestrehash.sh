@@ -0,0 +1,111 @@
+#!/bin/sh
+# exercises rehash from 3 shards to 4 overlapping ones, and a full
+# destination with -b false.
+
+subject='./build/posixmqcontrol'
+group='/test123rehash'
+source='/test123rehashsource'
+full='/test123rehashfull'
+
+for topic in "${group}.0" "${group}.1" "${group}.2" "${group}.3" \
+  "$source" "$full"; do
+  ${subject} info -q "$topic"
+  if [ $? == 0 ]; then
+    echo "sorry, $topic exists."
+    exit 1
+  fi
+done
+
+cleanup() {
+  ${subject} rm -q "$group" --shards 4
+  ${subject} rm -q "$source" -q "$full"
+}
+
+${subject} create -q "$group" --shards 3 -s 64 -d 32
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+for i in 1 2 3 4 5 6 7 8 9 10 11 12; do
+  ${subject} send -q "$group" --shards 3 --key "key$i" -c "key$i" \
+    -p $(( i % 4 ))
+  if [ $? != 0 ]; then
+    cleanup
+    exit 1
+  fi
+done
+
+${subject} rehash --from "${group}.0" --from "${group}.1" \
+  --from "${group}.2" --to "${group}.0" --to "${group}.1" \
+  --to "${group}.2" --to "${group}.3" --key all -s 64 -d 32 2>/dev/null
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+# a second copy sent the way a writer of the new layout would.
+for i in 1 2 3 4 5 6 7 8 9 10 11 12; do
+  ${subject} send -q "$group" --shards 4 --key "key$i" -c "key$i" \
+    -p $(( i % 4 ))
+  if [ $? != 0 ]; then
+    cleanup
+    exit 1
+  fi
+done
+
+info=$( ${subject} info -q "$group" --shards 4 )
+if [ "$( echo "$info" | grep '^CURMSG: ' )" != 'CURMSG: 24' ]; then
+  echo "$info"
+  cleanup
+  exit 1
+fi
+
+# each shard holds both copies of a key, with the same priority.
+for i in 0 1 2 3; do
+  count=$( echo "$info" | grep "^CURMSG\.$i: " | cut -d' ' -f2 )
+  odd=$( for n in $( seq 1 $count ); do
+      ${subject} recv -q "${group}.$i" -T 1
+    done | sort | uniq -c | grep -v '^ *2 ' )
+  if [ -n "$odd" ]; then
+    echo "$odd"
+    cleanup
+    exit 1
+  fi
+done
+
+# a full destination without blocking: the message stays in its source.
+${subject} create -q "$source" -s 64 -d 4 && \
+${subject} create -q "$full" -s 64 -d 1 && \
+${subject} send -q "$full" -c 'occupant' -p 1 && \
+${subject} send -q "$source" -c 'first' -c 'second' -p 2
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+${subject} rehash --from "$source" --to "$full" --key all -b false \
+  2>/dev/null
+if [ $? == 0 ]; then
+  cleanup
+  exit 1
+fi
+
+# handed back, it queues behind the other.
+EXPECTED='[1]: occupant
+[2]: second
+[2]: first'
+ACTUAL=$( ${subject} recv -q "$full" -T 1; ${subject} recv -q "$source" -T 1;
+  ${subject} recv -q "$source" -T 1 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+cleanup
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
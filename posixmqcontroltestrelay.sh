@@ -0,0 +1,63 @@
+#!/bin/sh
+# exercises relay between two queues of different message sizes.
+
+subject='./build/posixmqcontrol'
+source='/test123source'
+target='/test123target'
+
+for topic in "$source" "$target"
+do
+  ${subject} info -q "$topic"
+  if [ $? == 0 ]; then
+    echo "sorry, $topic exists."
+    exit 1
+  fi
+done
+
+${subject} create -q "$source" -s 32 -d 8
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+${subject} create -q "$target" -s 64 -d 8
+if [ $? != 0 ]; then
+  ${subject} rm -q "$source"
+  exit 1
+fi
+
+${subject} send -q "$source" -p 1 -c 'low priority.' -c 'also low.'
+${subject} send -q "$source" -p 9 -c 'high priority.'
+
+# drain the source and stop.
+ignore=$( ${subject} relay -q "$source" -t "$target" -b false )
+if [ $? != 0 ]; then
+  ${subject} rm -q "$source" -q "$target"
+  exit 1
+fi
+
+expected='CURMSG: 3'
+actual=$(${subject} info -q "$target" | grep 'CURMSG: ')
+if [ "$expected" != "$actual" ]; then
+  echo "EXPECTED: $expected"
+  echo "  ACTUAL: $actual"
+  ${subject} rm -q "$source" -q "$target"
+  exit 1
+fi
+
+# priority survives the move.
+expected='[9]: high priority.'
+actual=$(${subject} recv -q "$target")
+if [ "$expected" != "$actual" ]; then
+  echo "EXPECTED: $expected"
+  echo "  ACTUAL: $actual"
+  ${subject} rm -q "$source" -q "$target"
+  exit 1
+fi
+
+${subject} rm -q "$source" -q "$target"
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
@@ -0,0 +1,69 @@
+#!/bin/sh
+# exercises route rules, the required --default, and priority ranges.
+
+subject='./build/posixmqcontrol'
+source='/test123route'
+urgent='/test123routeurgent'
+orders='/test123routeorders'
+other='/test123routeother'
+
+for topic in "$source" "$urgent" "$orders" "$other"; do
+  ${subject} info -q "$topic"
+  if [ $? == 0 ]; then
+    echo "sorry, $topic exists."
+    exit 1
+  fi
+done
+
+cleanup() {
+  ${subject} rm -q "$source" -q "$urgent" -q "$orders" -q "$other"
+}
+
+for topic in "$source" "$urgent" "$orders" "$other"; do
+  ${subject} create -q "$topic" -s 64 -d 8
+  if [ $? != 0 ]; then
+    cleanup
+    exit 1
+  fi
+done
+
+# without --default an unmatched message would have nowhere to go.
+${subject} route -q "$source" -r "prefix:order=$orders" -b false
+if [ $? != 64 ]; then
+  cleanup
+  exit 1
+fi
+
+${subject} send -q "$source" -c 'order 1' -p 2 && \
+${subject} send -q "$source" -c 'alarm' -p 9 && \
+${subject} send -q "$source" -c 'chatter' -p 1
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+ignore=$( ${subject} route -q "$source" -r "priority:8-10=$urgent" \
+  -r "prefix:order=$orders" --default "$other" -b false )
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+EXPECTED='[9]: alarm
+[2]: order 1
+[1]: chatter'
+ACTUAL=$( ${subject} recv -q "$urgent" -T 1; ${subject} recv -q "$orders" -T 1;
+  ${subject} recv -q "$other" -T 1 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+cleanup
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
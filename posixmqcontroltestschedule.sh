@@ -0,0 +1,63 @@
+#!/bin/sh
+# exercises schedule delivery order, and a full queue that holds up no other.
+
+subject='./build/posixmqcontrol'
+slow='/test123schedule'
+fast='/test123schedulefast'
+
+for topic in "$slow" "$fast"; do
+  ${subject} info -q "$topic"
+  if [ $? == 0 ]; then
+    echo "sorry, $topic exists."
+    exit 1
+  fi
+done
+
+cleanup() {
+  ${subject} rm -q "$slow" -q "$fast"
+}
+
+# the slow queue holds a single message.
+${subject} create -q "$slow" -s 64 -d 1 && \
+${subject} create -q "$fast" -s 64 -d 8
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+printf '%s\n' "+0.2 $slow 1 third" "+0.1 $slow 1 second" "+0 $slow 1 first" \
+  "+0.3 $fast 1 late" "+0.2 $fast 1 early" | \
+  ${subject} schedule -T 5 2>/dev/null &
+scheduling=$!
+
+# the slow queue is full from the first message, the fast one is not.
+EXPECTED='[1]: early
+[1]: late'
+ACTUAL=$( ${subject} recv -q "$fast" -T 2; ${subject} recv -q "$fast" -T 2 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  wait $scheduling
+  cleanup
+  exit 1
+fi
+
+EXPECTED='[1]: first
+[1]: second
+[1]: third'
+ACTUAL=$( for i in 1 2 3; do ${subject} recv -q "$slow" -T 2; done )
+wait $scheduling
+code=$?
+if [ "$ACTUAL" != "$EXPECTED" ] || [ $code != 0 ]; then
+  echo "$ACTUAL"
+  echo $code
+  cleanup
+  exit 1
+fi
+
+cleanup
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
@@ -0,0 +1,65 @@
+#!/bin/sh
+# exercises create, send, info and rm on a sharded queue group.
+
+subject='./build/posixmqcontrol'
+group='/test123group'
+
+for i in 0 1 2 3
+do
+  ${subject} info -q "${group}.${i}"
+  if [ $? == 0 ]; then
+    echo "sorry, ${group}.${i} exists."
+    exit 1
+  fi
+done
+
+# an explicit count of zero is not "unsharded".
+${subject} create -q "$group" --shards 0 -s 64 -d 8
+if [ $? != 64 ]; then
+  ${subject} rm -q "$group"
+  exit 1
+fi
+
+${subject} create -q "$group" --shards 4 -s 64 -d 8
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+# the same key lands in the same shard every time.
+for i in 1 2 3
+do
+  ${subject} send -q "$group" --shards 4 --key 'customer-42' -c "order $i"
+  if [ $? != 0 ]; then
+    ${subject} rm -q "$group" --shards 4
+    exit 1
+  fi
+done
+
+info=$(${subject} info -q "$group" --shards 4)
+if [ $? != 0 ]; then
+  ${subject} rm -q "$group" --shards 4
+  exit 1
+fi
+expected='CURMSG: 3'
+actual=$(echo "${info}" | grep '^CURMSG: ')
+if [ "$expected" != "$actual" ]; then
+  echo "EXPECTED: $expected"
+  echo "  ACTUAL: $actual"
+  ${subject} rm -q "$group" --shards 4
+  exit 1
+fi
+actual=$(echo "${info}" | grep -c 'CURMSG\.[0-3]: 3')
+if [ "$actual" != 1 ]; then
+  echo "EXPECTED: one shard holding all three messages."
+  echo "${info}"
+  ${subject} rm -q "$group" --shards 4
+  exit 1
+fi
+
+${subject} rm -q "$group" --shards 4
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
@@ -0,0 +1,79 @@
+#!/bin/sh
+# exercises shared memory queues: priority order, timeout, unlink and spsc.
+
+subject='./build/posixmqcontrol'
+topic='shm:/test123shm'
+
+${subject} info -q "$topic"
+if [ $? == 0 ]; then
+  echo "sorry, $topic exists."
+  exit 1
+fi
+
+${subject} create -q "$topic" -s 64 -d 8
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+# received as from a kernel queue: by priority, then in the order sent.
+for priority in 0 7 1 40 41; do
+  ${subject} send -q "$topic" -p $priority -c "p$priority"
+  if [ $? != 0 ]; then
+    ${subject} rm -q "$topic"
+    exit 1
+  fi
+done
+${subject} send -q "$topic" -p 7 -c 'p7 again'
+if [ $? != 0 ]; then
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+expected='[41]: p41 [40]: p40 [7]: p7 [7]: p7 again [1]: p1 [0]: p0'
+actual=$(for i in 1 2 3 4 5 6; do ${subject} recv -q "$topic"; done)
+actual=$(echo $actual)
+if [ "$expected" != "$actual" ]; then
+  echo "EXPECTED: $expected"
+  echo "  ACTUAL: $actual"
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+${subject} recv -q "$topic" -T 0.2
+if [ $? != 124 ]; then
+  echo "expected recv of an empty queue to time out."
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+${subject} rm -q "$topic"
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+# a single producer queue keeps the order of sending.
+${subject} create -q "$topic" -s 64 -d 4 --type spsc
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+${subject} send -q "$topic" -p 3 -c p3
+${subject} send -q "$topic" -p 40 -c p40
+
+expected='[3]: p3 [40]: p40'
+actual=$(for i in 1 2; do ${subject} recv -q "$topic"; done)
+actual=$(echo $actual)
+if [ "$expected" != "$actual" ]; then
+  echo "EXPECTED: $expected"
+  echo "  ACTUAL: $actual"
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+${subject} rm -q "$topic"
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
@@ -0,0 +1,98 @@
+#!/bin/sh
+# exercises send --spill-dir on a full queue and respill back into it,
+# for a kernel queue and a shm: queue.
+
+subject='./build/posixmqcontrol'
+topic='/test123spill'
+shared='shm:/test123spill'
+spill=$( mktemp -d )
+
+${subject} info -q "$topic"
+if [ $? == 0 ]; then
+  echo "sorry, $topic exists."
+  exit 1
+fi
+
+# queue holds a single message.
+${subject} create -q "$topic" -s 64 -d 1
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+# blocking is the default; a spilling send must not wait for room.
+${subject} send -q "$topic" -c 'first' -c 'second' -c 'third' -p 3 \
+  --spill-dir "$spill" -T 5
+code=$?
+if [ $code != 0 ]; then
+  echo $code
+  ${subject} rm -q "$topic"
+  rm -rf "$spill"
+  exit 1
+fi
+
+EXPECTED='[3]: first'
+ACTUAL=$( ${subject} recv -q "$topic" -T 1 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  ${subject} rm -q "$topic"
+  rm -rf "$spill"
+  exit 1
+fi
+
+# respill waits for room until the journal is empty.
+${subject} respill -q "$topic" --spill-dir "$spill" -T 5 &
+respilling=$!
+
+EXPECTED='[3]: second
+[3]: third'
+ACTUAL=$( ${subject} recv -q "$topic" -T 5; ${subject} recv -q "$topic" -T 5 )
+wait $respilling
+code=$?
+if [ "$ACTUAL" != "$EXPECTED" ] || [ $code != 0 ]; then
+  echo "$ACTUAL"
+  echo $code
+  ${subject} rm -q "$topic"
+  rm -rf "$spill"
+  exit 1
+fi
+
+${subject} rm -q "$topic"
+if [ $? != 0 ]; then
+  rm -rf "$spill"
+  exit 1
+fi
+
+${subject} create -q "$shared" -s 64 -d 1
+if [ $? != 0 ]; then
+  rm -rf "$spill"
+  exit 1
+fi
+
+# the journal of shm:/name is shm.name.spill, apart from that of /name.
+${subject} send -q "$shared" -c 'kept' -c 'spilled' -p 2 --spill-dir "$spill"
+if [ $? != 0 ] || [ ! -s "$spill/shm.test123spill.spill" ]; then
+  ${subject} rm -q "$shared"
+  rm -rf "$spill"
+  exit 1
+fi
+
+EXPECTED='[2]: kept
+[2]: spilled'
+ACTUAL=$( ${subject} recv -q "$shared" -T 1;
+  ${subject} respill -q "$shared" --spill-dir "$spill" -b false;
+  ${subject} recv -q "$shared" -T 1 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  ${subject} rm -q "$shared"
+  rm -rf "$spill"
+  exit 1
+fi
+
+rm -rf "$spill"
+${subject} rm -q "$shared"
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
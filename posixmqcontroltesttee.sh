@@ -0,0 +1,150 @@
+#!/bin/sh
+# exercises tee to a slow target under each --policy, and the backlog
+# handed back to the source on exit.
+
+subject='./build/posixmqcontrol'
+source='/test123tee'
+fast='/test123teefast'
+slow='/test123teeslow'
+spill=$( mktemp -d )
+
+for topic in "$source" "$fast" "$slow"; do
+  ${subject} info -q "$topic"
+  if [ $? == 0 ]; then
+    echo "sorry, $topic exists."
+    exit 1
+  fi
+done
+
+cleanup() {
+  rm -rf "$spill"
+  ${subject} rm -q "$source" -q "$fast" -q "$slow"
+}
+
+${subject} create -q "$source" -s 64 -d 8 && \
+${subject} create -q "$fast" -s 64 -d 8 && \
+${subject} create -q "$slow" -s 64 -d 1
+if [ $? != 0 ]; then
+  cleanup
+  exit 1
+fi
+
+fill() {
+  ${subject} send -q "$source" -c 'one' -c 'two' -c 'three' -p 3
+}
+
+drain() {
+  for i in 1 2 3; do ${subject} recv -q "$1" -T 5; done
+}
+
+# block: tee waits for the slow target to take the whole backlog.
+fill
+${subject} tee -q "$source" -t "$fast" -t "$slow" --backlog 1 \
+  --policy block -b false -T 10 > /dev/null &
+teeing=$!
+
+EXPECTED='[3]: one
+[3]: two
+[3]: three'
+ACTUAL=$( drain "$slow" )
+wait $teeing
+code=$?
+if [ "$ACTUAL" != "$EXPECTED" ] || [ $code != 0 ]; then
+  echo "$ACTUAL"
+  echo $code
+  cleanup
+  exit 1
+fi
+
+ACTUAL=$( drain "$fast" )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+# block: what no target took by the deadline goes back to the source.
+fill
+EXPECTED="tee: $slow delivered 1, dropped 0, spilled 0, returned 2"
+ACTUAL=$( ${subject} tee -q "$source" -t "$slow" --backlog 2 \
+  --policy block -b false -T 1 | grep "^tee: $slow" )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+EXPECTED='[3]: one
+[3]: two
+[3]: three'
+ACTUAL=$( ${subject} recv -q "$slow" -T 1; ${subject} recv -q "$source" -T 1;
+  ${subject} recv -q "$source" -T 1 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+# drop: the oldest backlogged message gives way.
+fill
+ACTUAL=$( ${subject} tee -q "$source" -t "$fast" -t "$slow" --backlog 1 \
+  --policy drop -b false | grep "^tee: $slow" )
+EXPECTED="tee: $slow delivered 1, dropped 2, spilled 0, returned 0"
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+EXPECTED='[3]: one
+[3]: two
+[3]: three'
+ACTUAL=$( drain "$fast" )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+EXPECTED="$slow: 1 message(s),"
+ACTUAL=$( ${subject} purge -q "$slow" | cut -d' ' -f1-3 )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+# spill: the backlog moves to the journal and respills in order.
+fill
+EXPECTED="tee: $slow delivered 1, dropped 0, spilled 2, returned 0"
+ACTUAL=$( ${subject} tee -q "$source" -t "$fast" -t "$slow" --backlog 1 \
+  --policy spill --spill-dir "$spill" -b false | grep "^tee: $slow" )
+if [ "$ACTUAL" != "$EXPECTED" ]; then
+  echo "$ACTUAL"
+  cleanup
+  exit 1
+fi
+
+${subject} respill -q "$slow" --spill-dir "$spill" -T 10 &
+respilling=$!
+
+EXPECTED='[3]: one
+[3]: two
+[3]: three'
+ACTUAL=$( drain "$slow" )
+wait $respilling
+code=$?
+if [ "$ACTUAL" != "$EXPECTED" ] || [ $code != 0 ]; then
+  echo "$ACTUAL"
+  echo $code
+  cleanup
+  exit 1
+fi
+
+cleanup
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
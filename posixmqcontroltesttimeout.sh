@@ -0,0 +1,55 @@
+#!/bin/sh
+# exercises -T timeout on recv from an empty queue and send to a full queue.
+
+subject='./build/posixmqcontrol'
+topic='/test123timeout'
+
+${subject} info -q "$topic"
+if [ $? == 0 ]; then
+  echo "sorry, $topic exists."
+  exit 1
+fi
+
+# queue holds a single message.
+${subject} create -q "$topic" -s 64 -d 1
+if [ $? != 0 ]; then
+  exit 1
+fi
+
+# nothing to receive; expect the timeout status, 124.
+${subject} recv -q "$topic" -T 0.1
+code=$?
+if [ $code != 124 ]; then
+  echo $code
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+${subject} send -q "$topic" -c 'fills the queue.'
+if [ $? != 0 ]; then
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+# no room to send; expect the timeout status, 124.
+${subject} send -q "$topic" -c 'does not fit.' -T 0.1
+code=$?
+if [ $code != 124 ]; then
+  echo $code
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+ignore=$( ${subject} recv -q "$topic" -T 1 )
+if [ $? != 0 ]; then
+  ${subject} rm -q "$topic"
+  exit 1
+fi
+
+${subject} rm -q "$topic"
+if [ $? == 0 ]; then
+  echo "Pass!"
+  exit 0
+fi
+
+exit 1
@@ -0,0 +1,729 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Rick Parrish <unitrunker@unitrunker.net>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory message queues.
+ *
+ * A queue is a POSIX shared memory segment holding maxmsg message slots,
+ * a bounded lock-free MPMC ring of free slot indexes, after Vyukov, and a
+ * binary heap of sent messages ordered by priority, then by a sequence
+ * number taken as they are filed. A sender takes a free slot, fills it and
+ * files it in the heap; a receiver takes the top of the heap and returns
+ * the slot to the ring. Messages therefore come out in the order a kernel
+ * queue gives, whatever MQ_PRIO_MAX is. The heap is guarded by a spin
+ * lock held only for one push or pop of at most log2(maxmsg) swaps; the
+ * ring can hold every slot, so returning a slot never fails.
+ *
+ * The lock word holds the pid of its holder. Each slot also records its
+ * sequence number and whether it is filed, so a waiter that finds the
+ * holder gone takes the lock over and rebuilds the heap from the slots.
+ *
+ * Blocked senders and receivers sleep on a futex word that the other side
+ * bumps after every transfer; the wake system call is skipped unless
+ * someone sleeps.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __FreeBSD__
+#include <sys/types.h>
+#include <sys/umtx.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shmq.h"
+
+static const char shmq_magic[8] = "PMQSHM03";
+/* default geometry, as for the kernel queues. */
+static const long shmq_default_maxmsg = 10;
+static const long shmq_default_msgsize = 8192;
+/* how long an opener waits for the creator to finish. */
+static const long shmq_ready_spins = 100000;
+
+struct shmq_cell {
+	_Atomic uint64_t sequence;
+	uint64_t value;
+};
+
+struct shmq_ring {
+	alignas(64) _Atomic uint64_t head;
+	alignas(64) _Atomic uint64_t tail;
+	/* offset of the ring's cells from the start of the segment. */
+	uint64_t cells;
+};
+
+struct shmq_slot {
+	uint32_t length;
+	uint32_t priority;
+	/* heap order of the message, and whether it is in the heap. */
+	uint64_t sequence;
+	uint32_t filed;
+	uint32_t reserved;
+	char text[];
+};
+
+/* a sent message in the heap. */
+struct shmq_entry {
+	uint32_t priority;
+	uint32_t index;
+	uint64_t sequence;
+};
+
+struct shmq_header {
+	char magic[8];
+	_Atomic uint32_t ready;
+	/* cells per ring, a power of two no less than maxmsg. */
+	uint32_t ring_size;
+	int64_t maxmsg;
+	int64_t msgsize;
+	uint64_t slot_size;
+	/* offset of the first slot from the start of the segment. */
+	uint64_t slots;
+	/* offset of the heap's maxmsg entries. */
+	uint64_t heap;
+	alignas(64) _Atomic int64_t curmsgs;
+	/* bumped after every send; receivers sleep on it. */
+	alignas(64) _Atomic uint32_t readable;
+	_Atomic uint32_t read_waiters;
+	/* bumped after every receive; senders sleep on it. */
+	alignas(64) _Atomic uint32_t writable;
+	_Atomic uint32_t write_waiters;
+	/* pid holding the heap, its length and the sequence counter, or 0. */
+	alignas(64) _Atomic int32_t owner;
+	uint32_t queued;
+	uint64_t sequence;
+	struct shmq_ring free;
+};
+
+struct shmq {
+	int fd;
+	/* our pid, for the heap lock. */
+	int32_t pid;
+	bool nonblock;
+	size_t size;
+	struct shmq_header *header;
+};
+
+bool
+shmq_named(const char *queue)
+{
+	return (strncmp(queue, SHMQ_PREFIX, sizeof(SHMQ_PREFIX) - 1) == 0);
+}
+
+int
+shmq_path(const char *queue, const char *kind, char *path, size_t size)
+{
+	if (!shmq_named(queue)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	queue += sizeof(SHMQ_PREFIX) - 1;
+	if (*queue != '/') {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((size_t)snprintf(path, size, "/%s.%s", kind, queue + 1) >= size) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	return (0);
+}
+
+static struct shmq_cell *
+shmq_cells(struct shmq_header *header)
+{
+	return ((struct shmq_cell *)((char *)header + header->free.cells));
+}
+
+static struct shmq_entry *
+shmq_heap(struct shmq_header *header)
+{
+	return ((struct shmq_entry *)((char *)header + header->heap));
+}
+
+static struct shmq_slot *
+shmq_slot(struct shmq_header *header, uint64_t index)
+{
+	return ((struct shmq_slot *)((char *)header + header->slots +
+	    index * header->slot_size));
+}
+
+/* return a slot to the free ring. */
+static bool
+shmq_push(struct shmq_header *header, uint64_t value)
+{
+	struct shmq_ring *r = &header->free;
+	struct shmq_cell *cells = shmq_cells(header);
+	uint64_t mask = header->ring_size - 1;
+	uint64_t position = atomic_load_explicit(&r->head,
+	    memory_order_relaxed);
+
+	for (;;) {
+		struct shmq_cell *cell = &cells[position & mask];
+		uint64_t sequence = atomic_load_explicit(&cell->sequence,
+		    memory_order_acquire);
+		int64_t difference = (int64_t)(sequence - position);
+
+		if (difference == 0) {
+			if (atomic_compare_exchange_weak_explicit(&r->head,
+			    &position, position + 1, memory_order_relaxed,
+			    memory_order_relaxed)) {
+				cell->value = value;
+				atomic_store_explicit(&cell->sequence,
+				    position + 1, memory_order_release);
+				return (true);
+			}
+		} else if (difference < 0) {
+			return (false);
+		} else {
+			position = atomic_load_explicit(&r->head,
+			    memory_order_relaxed);
+		}
+	}
+}
+
+/* take a slot from the free ring. */
+static bool
+shmq_pop(struct shmq_header *header, uint64_t *value)
+{
+	struct shmq_ring *r = &header->free;
+	struct shmq_cell *cells = shmq_cells(header);
+	uint64_t mask = header->ring_size - 1;
+	uint64_t position = atomic_load_explicit(&r->tail,
+	    memory_order_relaxed);
+
+	for (;;) {
+		struct shmq_cell *cell = &cells[position & mask];
+		uint64_t sequence = atomic_load_explicit(&cell->sequence,
+		    memory_order_acquire);
+		int64_t difference = (int64_t)(sequence - (position + 1));
+
+		if (difference == 0) {
+			if (atomic_compare_exchange_weak_explicit(&r->tail,
+			    &position, position + 1, memory_order_relaxed,
+			    memory_order_relaxed)) {
+				*value = cell->value;
+				atomic_store_explicit(&cell->sequence,
+				    position + mask + 1, memory_order_release);
+				return (true);
+			}
+		} else if (difference < 0) {
+			return (false);
+		} else {
+			position = atomic_load_explicit(&r->tail,
+			    memory_order_relaxed);
+		}
+	}
+}
+
+/* true if a comes out of the queue before b. */
+static bool
+shmq_before(const struct shmq_entry *a, const struct shmq_entry *b)
+{
+	if (a->priority != b->priority)
+		return (a->priority > b->priority);
+	return (a->sequence < b->sequence);
+}
+
+/* place item at the free position at, moving it up past later entries. */
+static void
+shmq_sift_up(struct shmq_entry *heap, uint32_t at, struct shmq_entry item)
+{
+	while (at > 0 && shmq_before(&item, &heap[(at - 1) / 2])) {
+		heap[at] = heap[(at - 1) / 2];
+		at = (at - 1) / 2;
+	}
+	heap[at] = item;
+}
+
+/* refile every filed slot after a holder died with the heap half done. */
+static void
+shmq_rebuild(struct shmq_header *header)
+{
+	struct shmq_entry *heap = shmq_heap(header);
+	uint32_t queued = 0;
+
+	for (int64_t i = 0; i < header->maxmsg; i++) {
+		struct shmq_slot *slot = shmq_slot(header, i);
+		struct shmq_entry item = {
+			.priority = slot->priority,
+			.index = i,
+			.sequence = slot->sequence
+		};
+
+		if (slot->filed == 0)
+			continue;
+		shmq_sift_up(heap, queued++, item);
+		if (slot->sequence >= header->sequence)
+			header->sequence = slot->sequence + 1;
+	}
+	header->queued = queued;
+}
+
+static void
+shmq_lock(struct shmq *queue)
+{
+	struct shmq_header *header = queue->header;
+	int32_t holder = 0;
+
+	for (unsigned spins = 1; !atomic_compare_exchange_weak_explicit(
+	    &header->owner, &holder, queue->pid, memory_order_acquire,
+	    memory_order_relaxed); spins++) {
+		if (spins % 64 == 0) {
+			/* a lock held by a process that has gone is free. */
+			if (holder != 0 && kill(holder, 0) != 0 &&
+			    errno == ESRCH &&
+			    atomic_compare_exchange_strong_explicit(
+			    &header->owner, &holder, queue->pid,
+			    memory_order_acquire, memory_order_relaxed)) {
+				shmq_rebuild(header);
+				return;
+			}
+			sched_yield();
+		}
+		holder = 0;
+	}
+}
+
+static void
+shmq_unlock(struct shmq *queue)
+{
+	atomic_store_explicit(&queue->header->owner, 0, memory_order_release);
+}
+
+/* file a filled slot. there is always room for every slot. */
+static void
+shmq_file(struct shmq *queue, uint64_t index)
+{
+	struct shmq_header *header = queue->header;
+
+	shmq_lock(queue);
+
+	struct shmq_slot *slot = shmq_slot(header, index);
+	struct shmq_entry item = {
+		.priority = slot->priority,
+		.index = index,
+		.sequence = header->sequence++
+	};
+
+	slot->sequence = item.sequence;
+	slot->filed = 1;
+	shmq_sift_up(shmq_heap(header), header->queued++, item);
+	shmq_unlock(queue);
+}
+
+/* take the first filed slot, if any. */
+static bool
+shmq_take(struct shmq *queue, uint64_t *index)
+{
+	struct shmq_header *header = queue->header;
+
+	shmq_lock(queue);
+	if (header->queued == 0) {
+		shmq_unlock(queue);
+		return (false);
+	}
+
+	struct shmq_entry *heap = shmq_heap(header);
+	struct shmq_entry last = heap[--header->queued];
+	uint32_t count = header->queued;
+	uint32_t at = 0;
+
+	*index = heap[0].index;
+	shmq_slot(header, *index)->filed = 0;
+	for (;;) {
+		uint32_t child = 2 * at + 1;
+
+		if (child >= count)
+			break;
+		if (child + 1 < count &&
+		    shmq_before(&heap[child + 1], &heap[child]))
+			child++;
+		if (!shmq_before(&heap[child], &last))
+			break;
+		heap[at] = heap[child];
+		at = child;
+	}
+	if (count > 0)
+		heap[at] = last;
+	shmq_unlock(queue);
+	return (true);
+}
+
+int
+shmq_wait(_Atomic uint32_t *word, uint32_t seen, _Atomic uint32_t *waiters,
+    const struct timespec *deadline)
+{
+	struct timespec now;
+
+	atomic_fetch_add(waiters, 1);
+	if (atomic_load(word) == seen) {
+#if defined(__FreeBSD__)
+		struct _umtx_time timeout = {
+			._flags = UMTX_ABSTIME,
+			._clockid = CLOCK_REALTIME
+		};
+
+		if (deadline != NULL)
+			timeout._timeout = *deadline;
+		_umtx_op(word, UMTX_OP_WAIT_UINT, seen,
+		    deadline == NULL ? NULL : (void *)sizeof(timeout),
+		    deadline == NULL ? NULL : &timeout);
+#elif defined(__linux__)
+		struct timespec relative;
+		struct timespec *pause = NULL;
+
+		if (deadline != NULL) {
+			clock_gettime(CLOCK_REALTIME, &now);
+			relative.tv_sec = deadline->tv_sec - now.tv_sec;
+			relative.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+			if (relative.tv_nsec < 0) {
+				relative.tv_sec--;
+				relative.tv_nsec += 1000000000L;
+			}
+			if (relative.tv_sec < 0)
+				relative.tv_sec = relative.tv_nsec = 0;
+			pause = &relative;
+		}
+		syscall(SYS_futex, word, FUTEX_WAIT, seen, pause, NULL, 0);
+#else
+		struct timespec nap = {.tv_nsec = 50000};
+
+		nanosleep(&nap, NULL);
+#endif
+	}
+	atomic_fetch_sub(waiters, 1);
+
+	if (deadline != NULL) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (now.tv_sec > deadline->tv_sec ||
+		    (now.tv_sec == deadline->tv_sec &&
+		    now.tv_nsec >= deadline->tv_nsec))
+			return (ETIMEDOUT);
+	}
+	return (0);
+}
+
+void
+shmq_wake(_Atomic uint32_t *word, _Atomic uint32_t *waiters)
+{
+	atomic_fetch_add(word, 1);
+	if (atomic_load(waiters) == 0)
+		return;
+#if defined(__FreeBSD__)
+	_umtx_op(word, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+#elif defined(__linux__)
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void
+shmq_format(struct shmq_header *header, long maxmsg, long msgsize)
+{
+	uint32_t ring_size = 1;
+
+	while (ring_size < (uint64_t)maxmsg)
+		ring_size *= 2;
+
+	header->ring_size = ring_size;
+	header->maxmsg = maxmsg;
+	header->msgsize = msgsize;
+	header->slot_size = (sizeof(struct shmq_slot) + msgsize + 63) & ~63;
+
+	uint64_t offset = (sizeof(*header) + 63) & ~(uint64_t)63;
+	struct shmq_cell *cells = (struct shmq_cell *)((char *)header + offset);
+
+	header->free.cells = offset;
+	for (uint32_t j = 0; j < ring_size; j++)
+		atomic_init(&cells[j].sequence, j);
+	offset += ring_size * sizeof(struct shmq_cell);
+	header->heap = offset;
+	offset += maxmsg * sizeof(struct shmq_entry);
+	header->slots = (offset + 63) & ~(uint64_t)63;
+	for (long i = 0; i < maxmsg; i++)
+		shmq_push(header, i);
+	memcpy(header->magic, shmq_magic, sizeof(header->magic));
+	atomic_store(&header->ready, 1);
+}
+
+static size_t
+shmq_size(long maxmsg, long msgsize)
+{
+	uint64_t ring_size = 1;
+
+	while (ring_size < (uint64_t)maxmsg)
+		ring_size *= 2;
+
+	uint64_t offset = (sizeof(struct shmq_header) + 63) & ~(uint64_t)63;
+
+	offset += ring_size * sizeof(struct shmq_cell);
+	offset += maxmsg * sizeof(struct shmq_entry);
+	offset = (offset + 63) & ~(uint64_t)63;
+	return (offset + maxmsg *
+	    ((sizeof(struct shmq_slot) + msgsize + 63) & ~(uint64_t)63));
+}
+
+static struct shmq *
+shmq_map(int fd, int flags)
+{
+	struct stat status;
+
+	/* a queue just created may not have its size yet. */
+	for (long i = 0; i < shmq_ready_spins; i++) {
+		if (fstat(fd, &status) != 0)
+			return (NULL);
+		if ((size_t)status.st_size >= sizeof(struct shmq_header))
+			break;
+		sched_yield();
+	}
+	if ((size_t)status.st_size < sizeof(struct shmq_header)) {
+		errno = EAGAIN;
+		return (NULL);
+	}
+
+	struct shmq_header *header = mmap(NULL, status.st_size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (header == MAP_FAILED)
+		return (NULL);
+	for (long i = 0; i < shmq_ready_spins &&
+	    atomic_load(&header->ready) == 0; i++)
+		sched_yield();
+	if (atomic_load(&header->ready) == 0 ||
+	    memcmp(header->magic, shmq_magic, sizeof(shmq_magic)) != 0 ||
+	    shmq_size(header->maxmsg, header->msgsize) >
+	    (size_t)status.st_size) {
+		munmap(header, status.st_size);
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	struct shmq *queue = malloc(sizeof(*queue));
+
+	if (queue == NULL) {
+		munmap(header, status.st_size);
+		return (NULL);
+	}
+	queue->fd = fd;
+	queue->pid = getpid();
+	queue->nonblock = (flags & O_NONBLOCK) != 0;
+	queue->size = status.st_size;
+	queue->header = header;
+	return (queue);
+}
+
+struct shmq *
+shmq_open(const char *queue, int flags, mode_t mode,
+    const struct mq_attr *attr)
+{
+	char path[NAME_MAX + 8];
+
+	if (shmq_path(queue, "shmq", path, sizeof(path)) != 0)
+		return (NULL);
+
+	/* receivers update the heap and ring, so every opener needs write. */
+	int fd = -1;
+
+	if ((flags & O_CREAT) != 0) {
+		long maxmsg = attr != NULL ? attr->mq_maxmsg :
+		    shmq_default_maxmsg;
+		long msgsize = attr != NULL ? attr->mq_msgsize :
+		    shmq_default_msgsize;
+
+		if (maxmsg <= 0 || msgsize <= 0 || maxmsg > UINT32_MAX / 2) {
+			errno = EINVAL;
+			return (NULL);
+		}
+
+		fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+		if (fd >= 0) {
+			size_t size = shmq_size(maxmsg, msgsize);
+			struct shmq_header *header = NULL;
+
+			if (ftruncate(fd, size) == 0)
+				header = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED, fd, 0);
+			if (header == NULL || header == MAP_FAILED) {
+				int what = errno;
+
+				shm_unlink(path);
+				close(fd);
+				errno = what;
+				return (NULL);
+			}
+			shmq_format(header, maxmsg, msgsize);
+			munmap(header, size);
+		} else if (errno != EEXIST || (flags & O_EXCL) != 0) {
+			return (NULL);
+		}
+	}
+	if (fd < 0)
+		fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return (NULL);
+
+	struct shmq *opened = shmq_map(fd, flags);
+
+	if (opened == NULL) {
+		int what = errno;
+
+		close(fd);
+		errno = what;
+	}
+	return (opened);
+}
+
+int
+shmq_close(struct shmq *queue)
+{
+	munmap(queue->header, queue->size);
+	close(queue->fd);
+	free(queue);
+	return (0);
+}
+
+int
+shmq_unlink(const char *queue)
+{
+	char path[NAME_MAX + 8];
+
+	if (shmq_path(queue, "shmq", path, sizeof(path)) != 0)
+		return (-1);
+	return (shm_unlink(path));
+}
+
+int
+shmq_getattr(struct shmq *queue, struct mq_attr *attr)
+{
+	struct shmq_header *header = queue->header;
+
+	memset(attr, 0, sizeof(*attr));
+	attr->mq_maxmsg = header->maxmsg;
+	attr->mq_msgsize = header->msgsize;
+	attr->mq_curmsgs = atomic_load(&header->curmsgs);
+	attr->mq_flags = queue->nonblock ? O_NONBLOCK : 0;
+	return (0);
+}
+
+int
+shmq_fd(struct shmq *queue)
+{
+	return (queue->fd);
+}
+
+int
+shmq_timedsend(struct shmq *queue, const char *text, size_t length,
+    unsigned priority, const struct timespec *deadline)
+{
+	struct shmq_header *header = queue->header;
+	uint64_t index;
+
+	if (length > (uint64_t)header->msgsize) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	if (priority >= MQ_PRIO_MAX) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/* a slot freed as the deadline passes is still taken. */
+	for (bool expired = false;;) {
+		uint32_t seen = atomic_load(&header->writable);
+
+		if (shmq_pop(header, &index))
+			break;
+		if (queue->nonblock || expired) {
+			errno = queue->nonblock ? EAGAIN : ETIMEDOUT;
+			return (-1);
+		}
+		expired = shmq_wait(&header->writable, seen,
+		    &header->write_waiters, deadline) != 0;
+	}
+
+	struct shmq_slot *slot = shmq_slot(header, index);
+
+	slot->length = length;
+	slot->priority = priority;
+	memcpy(slot->text, text, length);
+	shmq_file(queue, index);
+	atomic_fetch_add(&header->curmsgs, 1);
+	shmq_wake(&header->readable, &header->read_waiters);
+	return (0);
+}
+
+ssize_t
+shmq_timedreceive(struct shmq *queue, char *text, size_t length,
+    unsigned *priority, const struct timespec *deadline)
+{
+	struct shmq_header *header = queue->header;
+	uint64_t index;
+
+	if (length < (uint64_t)header->msgsize) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+
+	for (bool expired = false;;) {
+		uint32_t seen = atomic_load(&header->readable);
+
+		if (shmq_take(queue, &index))
+			break;
+		if (queue->nonblock || expired) {
+			errno = queue->nonblock ? EAGAIN : ETIMEDOUT;
+			return (-1);
+		}
+		expired = shmq_wait(&header->readable, seen,
+		    &header->read_waiters, deadline) != 0;
+	}
+
+	struct shmq_slot *slot = shmq_slot(header, index);
+	ssize_t got = slot->length;
+
+	memcpy(text, slot->text, got);
+	if (priority != NULL)
+		*priority = slot->priority;
+	atomic_fetch_sub(&header->curmsgs, 1);
+	shmq_push(header, index);
+	shmq_wake(&header->writable, &header->write_waiters);
+	return (got);
+}
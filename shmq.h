@@ -0,0 +1,81 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Rick Parrish <unitrunker@unitrunker.net>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SHMQ_H
+#define SHMQ_H
+
+#include <sys/types.h>
+#include <mqueue.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* queue names with this prefix live in shared memory. */
+#define SHMQ_PREFIX "shm:"
+
+struct shmq;
+
+/* true if queue names a shared memory queue. */
+bool shmq_named(const char *queue);
+
+/*
+ * Open or, with O_CREAT, create a queue. attr gives the depth and message
+ * size of a new queue. Returns NULL with errno set on failure.
+ */
+struct shmq *shmq_open(const char *queue, int flags, mode_t mode,
+    const struct mq_attr *attr);
+int shmq_close(struct shmq *queue);
+int shmq_unlink(const char *queue);
+int shmq_getattr(struct shmq *queue, struct mq_attr *attr);
+/* descriptor of the backing segment, for fstat, fchown and fchmod. */
+int shmq_fd(struct shmq *queue);
+
+/*
+ * Send and receive like mq_timedsend(2) and mq_timedreceive(2). A NULL
+ * deadline waits forever.
+ */
+int shmq_timedsend(struct shmq *queue, const char *text, size_t length,
+    unsigned priority, const struct timespec *deadline);
+ssize_t shmq_timedreceive(struct shmq *queue, char *text, size_t length,
+    unsigned *priority, const struct timespec *deadline);
+
+/* Shared with the other kinds of shared memory queue. */
+
+/* shm_open(2) name "/kind.name" of queue. Returns zero or -1 with errno. */
+int shmq_path(const char *queue, const char *kind, char *path, size_t size);
+/*
+ * Sleep while *word still reads seen, or until the deadline, counting the
+ * sleeper in *waiters. Returns zero, or ETIMEDOUT once the deadline has
+ * passed.
+ */
+int shmq_wait(_Atomic uint32_t *word, uint32_t seen, _Atomic uint32_t *waiters,
+    const struct timespec *deadline);
+/* bump *word and wake its sleepers, if any. */
+void shmq_wake(_Atomic uint32_t *word, _Atomic uint32_t *waiters);
+
+#endif /* SHMQ_H */
@@ -0,0 +1,511 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Rick Parrish <unitrunker@unitrunker.net>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Single producer, single consumer shared memory queues.
+ *
+ * A queue is a POSIX shared memory segment holding a ring of message
+ * slots. The producer owns head and the consumer owns tail, each on a
+ * cache line of its own, and each side keeps a private copy of the other's
+ * index, reading the shared one only when its copy says the ring is full
+ * or empty. Messages leave in the order they were sent; their priorities
+ * travel with them but do not reorder them.
+ *
+ * The producer publishes head with every message, so a message can be
+ * received once send returns. The consumer publishes tail once per batch,
+ * when it finds the ring empty, and on close, so one cache line transfer
+ * returns many slots. A consumer that dies between two publications leaves
+ * the messages it took since the last one to be received again.
+ *
+ * A consumer finding the ring empty polls it a while, then sleeps on the
+ * readable futex word; the producer rings it only if someone sleeps.
+ * A producer finding the ring full sleeps on writable the same way.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shmq.h"
+#include "spsc.h"
+
+static const char spsc_magic[8] = "PMQSPSC1";
+/* default geometry, as for the kernel queues. */
+static const long spsc_default_maxmsg = 10;
+static const long spsc_default_msgsize = 8192;
+/* how long an opener waits for the creator to finish. */
+static const long spsc_ready_spins = 100000;
+/* the consumer publishes tail at least this often. */
+static const uint64_t spsc_batch_max = 64;
+/* polls of an empty ring before the consumer sleeps, given a spare CPU. */
+static const long spsc_polls = 20000;
+
+struct spsc_slot {
+	uint32_t length;
+	uint32_t priority;
+	char text[];
+};
+
+struct spsc_header {
+	char magic[8];
+	_Atomic uint32_t ready;
+	/* slots in the ring, a power of two no less than maxmsg. */
+	uint32_t ring_size;
+	int64_t maxmsg;
+	int64_t msgsize;
+	uint64_t slot_size;
+	/* process ids holding the two sides, or zero. */
+	_Atomic int32_t producer;
+	_Atomic int32_t consumer;
+	/* messages ever sent; written by the producer only. */
+	alignas(64) _Atomic uint64_t head;
+	/* messages ever received; written by the consumer only. */
+	alignas(64) _Atomic uint64_t tail;
+	/* bumped for a sleeping consumer. */
+	alignas(64) _Atomic uint32_t readable;
+	_Atomic uint32_t read_waiters;
+	/* bumped for a sleeping producer. */
+	alignas(64) _Atomic uint32_t writable;
+	_Atomic uint32_t write_waiters;
+};
+
+struct spsc {
+	int fd;
+	bool nonblock;
+	size_t size;
+	struct spsc_header *header;
+	char *slots;
+	uint64_t mask;
+	/* messages the consumer takes between two publications of tail. */
+	uint64_t batch;
+	/* polls before sleeping; none on a single CPU. */
+	long polls;
+	/* producer side: next message to send and the last tail read. */
+	bool producing;
+	uint64_t head;
+	uint64_t tail_seen;
+	/* consumer side: next message to take and the last head read. */
+	bool consuming;
+	uint64_t tail;
+	uint64_t head_seen;
+	uint64_t unpublished;
+};
+
+static uint64_t
+spsc_slots_offset(void)
+{
+	return ((sizeof(struct spsc_header) + 63) & ~(uint64_t)63);
+}
+
+static uint32_t
+spsc_ring_size(long maxmsg)
+{
+	uint32_t ring_size = 1;
+
+	while (ring_size < (uint64_t)maxmsg)
+		ring_size *= 2;
+	return (ring_size);
+}
+
+static uint64_t
+spsc_slot_size(long msgsize)
+{
+	return ((sizeof(struct spsc_slot) + msgsize + 63) & ~(uint64_t)63);
+}
+
+static size_t
+spsc_size(long maxmsg, long msgsize)
+{
+	return (spsc_slots_offset() +
+	    spsc_ring_size(maxmsg) * spsc_slot_size(msgsize));
+}
+
+static struct spsc_slot *
+spsc_slot(struct spsc *queue, uint64_t sequence)
+{
+	return ((struct spsc_slot *)(queue->slots +
+	    (sequence & queue->mask) * queue->header->slot_size));
+}
+
+static void
+spsc_format(struct spsc_header *header, long maxmsg, long msgsize)
+{
+	header->ring_size = spsc_ring_size(maxmsg);
+	header->maxmsg = maxmsg;
+	header->msgsize = msgsize;
+	header->slot_size = spsc_slot_size(msgsize);
+	memcpy(header->magic, spsc_magic, sizeof(header->magic));
+	atomic_store(&header->ready, 1);
+}
+
+/* take one side of the queue for this process. */
+static int
+spsc_claim(_Atomic int32_t *owner)
+{
+	int32_t self = getpid();
+	int32_t holder = atomic_load(owner);
+
+	while (holder != self) {
+		/* a side held by a process that has gone is free. */
+		if (holder != 0 && (kill(holder, 0) == 0 || errno != ESRCH)) {
+			errno = EBUSY;
+			return (-1);
+		}
+		if (atomic_compare_exchange_weak(owner, &holder, self))
+			break;
+	}
+	return (0);
+}
+
+static void
+spsc_release(_Atomic int32_t *owner)
+{
+	int32_t self = getpid();
+
+	atomic_compare_exchange_strong(owner, &self, 0);
+}
+
+/* make the slots taken so far available to the producer. */
+static void
+spsc_publish(struct spsc *queue)
+{
+	struct spsc_header *header = queue->header;
+
+	if (queue->unpublished == 0)
+		return;
+	queue->unpublished = 0;
+	atomic_store(&header->tail, queue->tail);
+	if (atomic_load(&header->write_waiters) != 0)
+		shmq_wake(&header->writable, &header->write_waiters);
+}
+
+static struct spsc *
+spsc_map(int fd, int flags)
+{
+	struct stat status;
+
+	/* a queue just created may not have its size yet. */
+	for (long i = 0; i < spsc_ready_spins; i++) {
+		if (fstat(fd, &status) != 0)
+			return (NULL);
+		if ((size_t)status.st_size >= sizeof(struct spsc_header))
+			break;
+		sched_yield();
+	}
+	if ((size_t)status.st_size < sizeof(struct spsc_header)) {
+		errno = EAGAIN;
+		return (NULL);
+	}
+
+	struct spsc_header *header = mmap(NULL, status.st_size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (header == MAP_FAILED)
+		return (NULL);
+	for (long i = 0; i < spsc_ready_spins &&
+	    atomic_load(&header->ready) == 0; i++)
+		sched_yield();
+	if (atomic_load(&header->ready) == 0 ||
+	    memcmp(header->magic, spsc_magic, sizeof(spsc_magic)) != 0 ||
+	    spsc_size(header->maxmsg, header->msgsize) >
+	    (size_t)status.st_size) {
+		munmap(header, status.st_size);
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	struct spsc *queue = calloc(1, sizeof(*queue));
+
+	if (queue == NULL) {
+		munmap(header, status.st_size);
+		return (NULL);
+	}
+	queue->fd = fd;
+	queue->nonblock = (flags & O_NONBLOCK) != 0;
+	queue->size = status.st_size;
+	queue->header = header;
+	queue->slots = (char *)header + spsc_slots_offset();
+	queue->mask = header->ring_size - 1;
+	queue->batch = header->maxmsg / 4;
+	if (queue->batch < 1)
+		queue->batch = 1;
+	if (queue->batch > spsc_batch_max)
+		queue->batch = spsc_batch_max;
+	queue->polls = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? spsc_polls : 0;
+	return (queue);
+}
+
+bool
+spsc_exists(const char *queue)
+{
+	char path[NAME_MAX + 8];
+
+	if (!shmq_named(queue) ||
+	    shmq_path(queue, "spsc", path, sizeof(path)) != 0)
+		return (false);
+
+	int fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+
+	if (fd < 0)
+		return (errno != ENOENT);
+	close(fd);
+	return (true);
+}
+
+struct spsc *
+spsc_open(const char *queue, int flags, mode_t mode,
+    const struct mq_attr *attr)
+{
+	char path[NAME_MAX + 8];
+
+	if (shmq_path(queue, "spsc", path, sizeof(path)) != 0)
+		return (NULL);
+
+	/* the consumer publishes tail, so every opener needs write. */
+	int fd = -1;
+
+	if ((flags & O_CREAT) != 0) {
+		long maxmsg = attr != NULL ? attr->mq_maxmsg :
+		    spsc_default_maxmsg;
+		long msgsize = attr != NULL ? attr->mq_msgsize :
+		    spsc_default_msgsize;
+
+		if (maxmsg <= 0 || msgsize <= 0 || maxmsg > UINT32_MAX / 2) {
+			errno = EINVAL;
+			return (NULL);
+		}
+
+		fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+		if (fd >= 0) {
+			size_t size = spsc_size(maxmsg, msgsize);
+			struct spsc_header *header = NULL;
+
+			if (ftruncate(fd, size) == 0)
+				header = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED, fd, 0);
+			if (header == NULL || header == MAP_FAILED) {
+				int what = errno;
+
+				shm_unlink(path);
+				close(fd);
+				errno = what;
+				return (NULL);
+			}
+			spsc_format(header, maxmsg, msgsize);
+			munmap(header, size);
+		} else if (errno != EEXIST || (flags & O_EXCL) != 0) {
+			return (NULL);
+		}
+	}
+	if (fd < 0)
+		fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return (NULL);
+
+	struct spsc *opened = spsc_map(fd, flags);
+
+	if (opened == NULL) {
+		int what = errno;
+
+		close(fd);
+		errno = what;
+	}
+	return (opened);
+}
+
+int
+spsc_close(struct spsc *queue)
+{
+	if (queue->consuming) {
+		spsc_publish(queue);
+		spsc_release(&queue->header->consumer);
+	}
+	if (queue->producing)
+		spsc_release(&queue->header->producer);
+	munmap(queue->header, queue->size);
+	close(queue->fd);
+	free(queue);
+	return (0);
+}
+
+int
+spsc_unlink(const char *queue)
+{
+	char path[NAME_MAX + 8];
+
+	if (shmq_path(queue, "spsc", path, sizeof(path)) != 0)
+		return (-1);
+	return (shm_unlink(path));
+}
+
+int
+spsc_getattr(struct spsc *queue, struct mq_attr *attr)
+{
+	struct spsc_header *header = queue->header;
+	uint64_t tail = queue->consuming ? queue->tail :
+	    atomic_load(&header->tail);
+
+	memset(attr, 0, sizeof(*attr));
+	attr->mq_maxmsg = header->maxmsg;
+	attr->mq_msgsize = header->msgsize;
+	attr->mq_curmsgs = atomic_load(&header->head) - tail;
+	attr->mq_flags = queue->nonblock ? O_NONBLOCK : 0;
+	return (0);
+}
+
+int
+spsc_fd(struct spsc *queue)
+{
+	return (queue->fd);
+}
+
+int
+spsc_timedsend(struct spsc *queue, const char *text, size_t length,
+    unsigned priority, const struct timespec *deadline)
+{
+	struct spsc_header *header = queue->header;
+	uint64_t maxmsg = header->maxmsg;
+
+	if (length > (uint64_t)header->msgsize) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	if (priority >= MQ_PRIO_MAX) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (!queue->producing) {
+		if (spsc_claim(&header->producer) != 0)
+			return (-1);
+		queue->producing = true;
+		queue->head = atomic_load(&header->head);
+		queue->tail_seen = atomic_load(&header->tail);
+	}
+
+	for (bool expired = false;
+	    queue->head - queue->tail_seen >= maxmsg;) {
+		uint32_t seen = atomic_load(&header->writable);
+
+		queue->tail_seen = atomic_load(&header->tail);
+		if (queue->head - queue->tail_seen < maxmsg)
+			break;
+		if (queue->nonblock || expired) {
+			errno = queue->nonblock ? EAGAIN : ETIMEDOUT;
+			return (-1);
+		}
+
+		/* count ourselves before the last look: publish cannot miss us. */
+		atomic_fetch_add(&header->write_waiters, 1);
+		queue->tail_seen = atomic_load(&header->tail);
+		if (queue->head - queue->tail_seen >= maxmsg)
+			expired = shmq_wait(&header->writable, seen,
+			    &header->write_waiters, deadline) != 0;
+		atomic_fetch_sub(&header->write_waiters, 1);
+	}
+
+	struct spsc_slot *slot = spsc_slot(queue, queue->head);
+
+	slot->length = length;
+	slot->priority = priority;
+	memcpy(slot->text, text, length);
+	atomic_store(&header->head, ++queue->head);
+	if (atomic_load(&header->read_waiters) != 0)
+		shmq_wake(&header->readable, &header->read_waiters);
+	return (0);
+}
+
+ssize_t
+spsc_timedreceive(struct spsc *queue, char *text, size_t length,
+    unsigned *priority, const struct timespec *deadline)
+{
+	struct spsc_header *header = queue->header;
+
+	if (length < (uint64_t)header->msgsize) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	if (!queue->consuming) {
+		if (spsc_claim(&header->consumer) != 0)
+			return (-1);
+		queue->consuming = true;
+		queue->tail = atomic_load(&header->tail);
+		queue->head_seen = atomic_load(&header->head);
+	}
+
+	for (bool expired = false, polled = false;
+	    queue->tail == queue->head_seen;) {
+		uint32_t seen = atomic_load(&header->readable);
+
+		queue->head_seen = atomic_load(&header->head);
+		if (queue->tail != queue->head_seen)
+			break;
+		/* hand back what was taken before going idle. */
+		spsc_publish(queue);
+		if (queue->nonblock || expired) {
+			errno = queue->nonblock ? EAGAIN : ETIMEDOUT;
+			return (-1);
+		}
+		if (!polled) {
+			polled = true;
+			for (long i = 0; i < queue->polls &&
+			    queue->head_seen == queue->tail; i++)
+				queue->head_seen = atomic_load_explicit(
+				    &header->head, memory_order_acquire);
+			continue;
+		}
+
+		/* count ourselves before the last look: send cannot miss us. */
+		atomic_fetch_add(&header->read_waiters, 1);
+		queue->head_seen = atomic_load(&header->head);
+		if (queue->head_seen == queue->tail)
+			expired = shmq_wait(&header->readable, seen,
+			    &header->read_waiters, deadline) != 0;
+		atomic_fetch_sub(&header->read_waiters, 1);
+	}
+
+	struct spsc_slot *slot = spsc_slot(queue, queue->tail);
+	ssize_t got = slot->length;
+
+	memcpy(text, slot->text, got);
+	if (priority != NULL)
+		*priority = slot->priority;
+	queue->tail++;
+	if (++queue->unpublished >= queue->batch)
+		spsc_publish(queue);
+	return (got);
+}
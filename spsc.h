@@ -0,0 +1,68 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Rick Parrish <unitrunker@unitrunker.net>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <sys/types.h>
+#include <mqueue.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Single producer, single consumer queues. They share the shm: names of
+ * shmq.h and are otherwise used like them.
+ */
+struct spsc;
+
+/* true if queue names an existing single producer queue. */
+bool spsc_exists(const char *queue);
+
+/*
+ * Open or, with O_CREAT, create a queue. attr gives the depth and message
+ * size of a new queue. Returns NULL with errno set on failure.
+ */
+struct spsc *spsc_open(const char *queue, int flags, mode_t mode,
+    const struct mq_attr *attr);
+int spsc_close(struct spsc *queue);
+int spsc_unlink(const char *queue);
+int spsc_getattr(struct spsc *queue, struct mq_attr *attr);
+/* descriptor of the backing segment, for fstat, fchown and fchmod. */
+int spsc_fd(struct spsc *queue);
+
+/*
+ * Send and receive like mq_timedsend(2) and mq_timedreceive(2). A NULL
+ * deadline waits forever. The first send claims the producer side and the
+ * first receive the consumer side for this process; another live process
+ * holding the side fails with EBUSY.
+ */
+int spsc_timedsend(struct spsc *queue, const char *text, size_t length,
+    unsigned priority, const struct timespec *deadline);
+ssize_t spsc_timedreceive(struct spsc *queue, char *text, size_t length,
+    unsigned *priority, const struct timespec *deadline);
+
+#endif /* SPSC_H */
@@ -0,0 +1,293 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Rick Parrish <unitrunker@unitrunker.net>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Transports.
+ *
+ * Each entry of transports adapts one queue store to struct transport.
+ * transport_for() hands a queue name to the first entry claiming it, so
+ * the kernel, which claims everything, comes last, and the single producer
+ * queues, which claim shm: names only once created, come before the other
+ * shm: queues.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shmq.h"
+#include "spsc.h"
+#include "transport.h"
+
+int
+queue_fd(mqd_t handle)
+{
+#if defined(__FreeBSD__)
+	/*
+	 * undocumented.
+	 * See https://bugs.freebsd.org/bugzilla//show_bug.cgi?id=273230
+	 */
+	return (mq_getfd_np(handle));
+#elif defined(__linux__)
+	return ((int)handle);
+#else
+	(void)handle;
+	return (-1);
+#endif
+}
+
+/* Kernel POSIX message queues. mqd_t need not fit a pointer, so box it. */
+
+struct kernel_queue {
+	mqd_t handle;
+};
+
+static bool
+kernel_claims(const char *queue)
+{
+	(void)queue;
+	return (true);
+}
+
+static void *
+kernel_open(const char *queue, int flags, mode_t mode,
+    const struct mq_attr *attr)
+{
+	struct kernel_queue *box = malloc(sizeof(*box));
+
+	if (box == NULL)
+		return (NULL);
+	if (flags & O_CREAT)
+		box->handle = mq_open(queue, flags, mode, attr);
+	else
+		box->handle = mq_open(queue, flags);
+	if (box->handle == (mqd_t)-1) {
+		int what = errno;
+
+		free(box);
+		errno = what;
+		return (NULL);
+	}
+	return (box);
+}
+
+static int
+kernel_close(void *handle)
+{
+	struct kernel_queue *box = handle;
+	int result = mq_close(box->handle);
+
+	free(box);
+	return (result);
+}
+
+static int
+kernel_getattr(void *handle, struct mq_attr *attr)
+{
+	return (mq_getattr(((struct kernel_queue *)handle)->handle, attr));
+}
+
+static int
+kernel_send(void *handle, const char *text, size_t length,
+    unsigned priority, const struct timespec *deadline)
+{
+	mqd_t queue = ((struct kernel_queue *)handle)->handle;
+
+	if (deadline == NULL)
+		return (mq_send(queue, text, length, priority));
+	return (mq_timedsend(queue, text, length, priority, deadline));
+}
+
+static ssize_t
+kernel_receive(void *handle, char *text, size_t length, unsigned *priority,
+    const struct timespec *deadline)
+{
+	mqd_t queue = ((struct kernel_queue *)handle)->handle;
+
+	if (deadline == NULL)
+		return (mq_receive(queue, text, length, priority));
+	return (mq_timedreceive(queue, text, length, priority, deadline));
+}
+
+static int
+kernel_fd(void *handle)
+{
+	return (queue_fd(((struct kernel_queue *)handle)->handle));
+}
+
+/* Shared memory queues, see shmq.c. */
+
+static void *
+shared_open(const char *queue, int flags, mode_t mode,
+    const struct mq_attr *attr)
+{
+	return (shmq_open(queue, flags, mode, attr));
+}
+
+static int
+shared_close(void *handle)
+{
+	return (shmq_close(handle));
+}
+
+static int
+shared_getattr(void *handle, struct mq_attr *attr)
+{
+	return (shmq_getattr(handle, attr));
+}
+
+static int
+shared_send(void *handle, const char *text, size_t length,
+    unsigned priority, const struct timespec *deadline)
+{
+	return (shmq_timedsend(handle, text, length, priority, deadline));
+}
+
+static ssize_t
+shared_receive(void *handle, char *text, size_t length, unsigned *priority,
+    const struct timespec *deadline)
+{
+	return (shmq_timedreceive(handle, text, length, priority, deadline));
+}
+
+static int
+shared_fd(void *handle)
+{
+	return (shmq_fd(handle));
+}
+
+/* waiters sleep on a futex, which no descriptor reflects. */
+static int
+shared_notify_fd(void *handle)
+{
+	(void)handle;
+	return (-1);
+}
+
+/* Single producer, single consumer queues, see spsc.c. */
+
+static void *
+single_open(const char *queue, int flags, mode_t mode,
+    const struct mq_attr *attr)
+{
+	return (spsc_open(queue, flags, mode, attr));
+}
+
+static int
+single_close(void *handle)
+{
+	return (spsc_close(handle));
+}
+
+static int
+single_getattr(void *handle, struct mq_attr *attr)
+{
+	return (spsc_getattr(handle, attr));
+}
+
+static int
+single_send(void *handle, const char *text, size_t length,
+    unsigned priority, const struct timespec *deadline)
+{
+	return (spsc_timedsend(handle, text, length, priority, deadline));
+}
+
+static ssize_t
+single_receive(void *handle, char *text, size_t length, unsigned *priority,
+    const struct timespec *deadline)
+{
+	return (spsc_timedreceive(handle, text, length, priority, deadline));
+}
+
+static int
+single_fd(void *handle)
+{
+	return (spsc_fd(handle));
+}
+
+static const struct transport transports[] = {
+	{
+		.name = "spsc",
+		.claims = spsc_exists,
+		.open = single_open,
+		.close = single_close,
+		.getattr = single_getattr,
+		.send = single_send,
+		.receive = single_receive,
+		.unlink = spsc_unlink,
+		.fd = single_fd,
+		.notify_fd = shared_notify_fd
+	},
+	{
+		.name = "shmq",
+		.claims = shmq_named,
+		.open = shared_open,
+		.close = shared_close,
+		.getattr = shared_getattr,
+		.send = shared_send,
+		.receive = shared_receive,
+		.unlink = shmq_unlink,
+		.fd = shared_fd,
+		.notify_fd = shared_notify_fd
+	},
+	{
+		.name = "mq",
+		.claims = kernel_claims,
+		.open = kernel_open,
+		.close = kernel_close,
+		.getattr = kernel_getattr,
+		.send = kernel_send,
+		.receive = kernel_receive,
+		.unlink = mq_unlink,
+		.fd = kernel_fd,
+		.notify_fd = kernel_fd
+	}
+};
+
+const struct transport *
+transport_named(const char *name)
+{
+	size_t count = sizeof(transports) / sizeof(transports[0]);
+
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(transports[i].name, name) == 0)
+			return (&transports[i]);
+	}
+	return (NULL);
+}
+
+const struct transport *
+transport_for(const char *queue)
+{
+	size_t count = sizeof(transports) / sizeof(transports[0]);
+	size_t i = 0;
+
+	while (i < count - 1 && !transports[i].claims(queue))
+		i++;
+	return (&transports[i]);
+}
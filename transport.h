@@ -0,0 +1,75 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Rick Parrish <unitrunker@unitrunker.net>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <sys/types.h>
+#include <mqueue.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * A transport holds named queues: the kernel POSIX message queues, or
+ * another store with the same semantics. Every call but claims, open and
+ * unlink takes the handle open returned. Calls that fail return -1 (NULL
+ * for open) with errno set, as their mq_* counterparts do.
+ */
+struct transport {
+	/* prefix of the calls it stands in for, for messages. */
+	const char *name;
+	/* true if queue names a queue of this transport. */
+	bool (*claims)(const char *queue);
+	/* open, or with O_CREAT create, a queue; attr as for mq_open(2). */
+	void *(*open)(const char *queue, int flags, mode_t mode,
+	    const struct mq_attr *attr);
+	int (*close)(void *handle);
+	int (*getattr)(void *handle, struct mq_attr *attr);
+	/* a NULL deadline waits forever, unless opened O_NONBLOCK. */
+	int (*send)(void *handle, const char *text, size_t length,
+	    unsigned priority, const struct timespec *deadline);
+	ssize_t (*receive)(void *handle, char *text, size_t length,
+	    unsigned *priority, const struct timespec *deadline);
+	int (*unlink)(const char *queue);
+	/* descriptor for fstat, fchown and fchmod, or -1. */
+	int (*fd)(void *handle);
+	/* descriptor that polls readable and writable with the queue, or -1. */
+	int (*notify_fd)(void *handle);
+};
+
+/* the transport holding queue. never NULL: the kernel takes the rest. */
+const struct transport *transport_for(const char *queue);
+/* the transport with the given name, or NULL. */
+const struct transport *transport_named(const char *name);
+
+/*
+ * Return a descriptor that poll(2) accepts for a kernel queue, or -1 where
+ * the platform offers none.
+ */
+int queue_fd(mqd_t handle);
+
+#endif /* TRANSPORT_H */